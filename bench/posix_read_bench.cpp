@@ -0,0 +1,162 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Measures random-read throughput when several threads share one Posix read
+ * handle. The pread-based PosixRandomReadFile is compared against the stdio
+ * implementation it replaced, which had to serialize every seek and read
+ * behind a mutex, and against that implementation with one handle per thread.
+ */
+
+#include "storehouse/posix/posix_storage.h"
+#include "storehouse/util.h"
+
+#include <benchmark/benchmark.h>
+
+#include <unistd.h>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace storehouse;
+
+namespace {
+
+const uint64_t FILE_SIZE = 256 * 1024 * 1024;
+
+std::string file_path;
+
+// The stdio reader as it was before the switch to pread
+class StdioRandomReadFile : public RandomReadFile {
+ public:
+  StdioRandomReadFile(const std::string& file_path) : file_path_(file_path) {
+    fp_ = fopen(file_path.c_str(), "r");
+    position_ = 0;
+  }
+
+  ~StdioRandomReadFile() {
+    if (fp_ != NULL) {
+      fclose(fp_);
+    }
+  }
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (position_ != offset) {
+      fseek(fp_, offset, SEEK_SET);
+      position_ = offset;
+    }
+    size_read = fread(data, sizeof(uint8_t), size, fp_);
+    position_ += size_read;
+    return feof(fp_) ? StoreResult::EndOfFile : StoreResult::Success;
+  }
+
+  StoreResult get_size(uint64_t& size) override {
+    size = FILE_SIZE;
+    return StoreResult::Success;
+  }
+
+  const std::string path() override { return file_path_; }
+
+ private:
+  const std::string file_path_;
+  FILE* fp_;
+  int position_;
+  std::mutex mutex_;
+};
+
+std::unique_ptr<RandomReadFile> stdio_shared;
+std::unique_ptr<RandomReadFile> pread_shared;
+
+void make_test_file() {
+  FILE* fp;
+  temp_file(&fp, file_path);
+  std::vector<uint8_t> block(1024 * 1024);
+  for (size_t i = 0; i < block.size(); ++i) {
+    block[i] = static_cast<uint8_t>(i * 31);
+  }
+  for (uint64_t written = 0; written < FILE_SIZE; written += block.size()) {
+    fwrite(block.data(), 1, block.size(), fp);
+  }
+  fclose(fp);
+}
+
+void random_reads(benchmark::State& state, RandomReadFile* file) {
+  size_t size = state.range(0);
+  std::vector<uint8_t> buffer(size);
+  uint64_t slots = FILE_SIZE / size;
+  uint64_t x = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+  uint64_t bytes_read = 0;
+
+  for (auto _ : state) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    size_t size_read;
+    file->read((x % slots) * size, size, buffer.data(), size_read);
+    bytes_read += size_read;
+  }
+  state.SetBytesProcessed(bytes_read);
+}
+
+void BM_StdioSharedHandle(benchmark::State& state) {
+  random_reads(state, stdio_shared.get());
+}
+
+void BM_StdioHandlePerThread(benchmark::State& state) {
+  StdioRandomReadFile file(file_path);
+  random_reads(state, &file);
+}
+
+void BM_PreadSharedHandle(benchmark::State& state) {
+  random_reads(state, pread_shared.get());
+}
+
+}
+
+BENCHMARK(BM_StdioSharedHandle)
+  ->RangeMultiplier(16)->Range(4 << 10, 1 << 20)
+  ->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_StdioHandlePerThread)
+  ->RangeMultiplier(16)->Range(4 << 10, 1 << 20)
+  ->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_PreadSharedHandle)
+  ->RangeMultiplier(16)->Range(4 << 10, 1 << 20)
+  ->ThreadRange(1, 16)->UseRealTime();
+
+int main(int argc, char** argv) {
+  make_test_file();
+  stdio_shared.reset(new StdioRandomReadFile(file_path));
+
+  PosixStorage storage{PosixConfig()};
+  RandomReadFile* file;
+  if (storage.make_random_read_file(file_path, file) != StoreResult::Success) {
+    fprintf(stderr, "Could not open %s\n", file_path.c_str());
+    return 1;
+  }
+  pread_shared.reset(file);
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+
+  stdio_shared.reset();
+  pread_shared.reset();
+  unlink(file_path.c_str());
+  return 0;
+}
@@ -0,0 +1,222 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Measures 4KB random-read IOPS and latency at queue depths 1 to 128. The
+ * pread reader reaches a given depth with that many threads each blocked on
+ * one read; the io_uring reader keeps that many reads in flight from a
+ * single thread through read_async.
+ *
+ * Set STOREHOUSE_BENCH_FILE to a large file on the device under test.
+ * Otherwise a 256MB temporary file is used, which is served from the page
+ * cache and so measures software overhead only. The benchmark fails if
+ * io_uring is unavailable rather than silently timing pread twice.
+ */
+
+#include "storehouse/posix/posix_storage.h"
+#include "storehouse/util.h"
+
+#include <benchmark/benchmark.h>
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace storehouse;
+
+namespace {
+
+const size_t BLOCK_SIZE = 4096;
+const uint64_t TEMP_FILE_SIZE = 256 * 1024 * 1024;
+
+std::string file_path;
+bool remove_file = false;
+uint64_t file_size;
+
+std::unique_ptr<StorageBackend> pread_storage;
+std::unique_ptr<StorageBackend> uring_storage;
+std::unique_ptr<RandomReadFile> pread_file;
+std::unique_ptr<RandomReadFile> uring_file;
+
+typedef std::chrono::steady_clock Clock;
+
+class RandomOffsets {
+ public:
+  RandomOffsets()
+      : x_(std::hash<std::thread::id>()(std::this_thread::get_id()) | 1) {}
+
+  uint64_t next() {
+    x_ ^= x_ << 13;
+    x_ ^= x_ >> 7;
+    x_ ^= x_ << 17;
+    return (x_ % (file_size / BLOCK_SIZE)) * BLOCK_SIZE;
+  }
+
+ private:
+  uint64_t x_;
+};
+
+double micros_since(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start)
+    .count();
+}
+
+void report_latency(benchmark::State& state, std::vector<double>& latencies,
+                    benchmark::Counter::Flags flags) {
+  state.SetItemsProcessed(latencies.size());
+  if (latencies.empty()) {
+    return;
+  }
+  std::sort(latencies.begin(), latencies.end());
+  state.counters["p50_us"] =
+    benchmark::Counter(latencies[latencies.size() / 2], flags);
+  state.counters["p99_us"] =
+    benchmark::Counter(latencies[latencies.size() * 99 / 100], flags);
+}
+
+void BM_Pread(benchmark::State& state) {
+  std::vector<uint8_t> buffer(BLOCK_SIZE);
+  std::vector<double> latencies;
+  RandomOffsets offsets;
+
+  for (auto _ : state) {
+    Clock::time_point start = Clock::now();
+    size_t size_read;
+    StoreResult result =
+      pread_file->read(offsets.next(), BLOCK_SIZE, buffer.data(), size_read);
+    latencies.push_back(micros_since(start));
+    if (result != StoreResult::Success) {
+      state.SkipWithError("read failed");
+      break;
+    }
+  }
+  report_latency(state, latencies, benchmark::Counter::kAvgThreads);
+}
+
+void BM_IoUring(benchmark::State& state) {
+  size_t depth = state.range(0);
+  std::vector<std::vector<uint8_t>> buffers(depth,
+                                            std::vector<uint8_t>(BLOCK_SIZE));
+  std::vector<size_t> free_slots;
+  for (size_t i = 0; i < depth; ++i) {
+    free_slots.push_back(i);
+  }
+  std::vector<double> latencies;
+  size_t failures = 0;
+  std::mutex mutex;
+  std::condition_variable cv;
+  RandomOffsets offsets;
+
+  for (auto _ : state) {
+    size_t slot;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return !free_slots.empty(); });
+      slot = free_slots.back();
+      free_slots.pop_back();
+    }
+    Clock::time_point start = Clock::now();
+    uring_file->read_async(
+      offsets.next(), BLOCK_SIZE, buffers[slot].data(),
+      [&, slot, start](StoreResult result, size_t size_read) {
+        double latency = micros_since(start);
+        std::lock_guard<std::mutex> lock(mutex);
+        latencies.push_back(latency);
+        if (result != StoreResult::Success) {
+          ++failures;
+        }
+        free_slots.push_back(slot);
+        cv.notify_one();
+      });
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&] { return free_slots.size() == depth; });
+  if (failures > 0) {
+    state.SkipWithError("read failed");
+    return;
+  }
+  if (!static_cast<PosixStorage*>(uring_storage.get())->uses_io_uring()) {
+    state.SkipWithError("io_uring failed during the run");
+    return;
+  }
+  report_latency(state, latencies, benchmark::Counter::kDefaults);
+}
+
+StoreResult open_file(const std::map<std::string, std::string>& args,
+                      std::unique_ptr<StorageBackend>& storage,
+                      std::unique_ptr<RandomReadFile>& file) {
+  std::unique_ptr<StorageConfig> config(
+    StorageConfig::make_config("posix", args));
+  storage.reset(StorageBackend::make_from_config(config.get()));
+  return make_unique_random_read_file(storage.get(), file_path, file);
+}
+
+}
+
+BENCHMARK(BM_Pread)->ThreadRange(1, 128)->UseRealTime();
+BENCHMARK(BM_IoUring)->RangeMultiplier(2)->Range(1, 128)->UseRealTime();
+
+int main(int argc, char** argv) {
+  const char* path = getenv("STOREHOUSE_BENCH_FILE");
+  if (path != nullptr) {
+    file_path = path;
+  } else {
+    FILE* fp;
+    temp_file(&fp, file_path);
+    std::vector<uint8_t> block(1024 * 1024, 'x');
+    for (uint64_t written = 0; written < TEMP_FILE_SIZE;
+         written += block.size()) {
+      fwrite(block.data(), 1, block.size(), fp);
+    }
+    fclose(fp);
+    remove_file = true;
+  }
+
+  if (open_file({}, pread_storage, pread_file) != StoreResult::Success ||
+      open_file({{"use_io_uring", "true"}}, uring_storage, uring_file) !=
+        StoreResult::Success) {
+    fprintf(stderr, "Could not open %s\n", file_path.c_str());
+    return 1;
+  }
+  if (!static_cast<PosixStorage*>(uring_storage.get())->uses_io_uring()) {
+    fprintf(stderr, "io_uring is not available\n");
+    return 1;
+  }
+  pread_file->get_size(file_size);
+  if (file_size < BLOCK_SIZE) {
+    fprintf(stderr, "%s is too small\n", file_path.c_str());
+    return 1;
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+
+  pread_file.reset();
+  uring_file.reset();
+  if (remove_file) {
+    unlink(file_path.c_str());
+  }
+  return 0;
+}
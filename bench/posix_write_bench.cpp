@@ -0,0 +1,112 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Measures the throughput of writing and saving a file with PosixWriteFile
+ * at each durability level, against the stdio writer it replaced. Each
+ * iteration appends 256MB in 1MB pieces and saves.
+ *
+ * Files are written under STOREHOUSE_BENCH_DIR, or /tmp if it is unset.
+ */
+
+#include "storehouse/posix/posix_storage.h"
+
+#include <benchmark/benchmark.h>
+
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace storehouse;
+
+namespace {
+
+const size_t APPEND_SIZE = 1024 * 1024;
+const size_t FILE_SIZE = 256 * 1024 * 1024;
+
+std::string bench_path() {
+  const char* directory = getenv("STOREHOUSE_BENCH_DIR");
+  return std::string(directory != nullptr ? directory : "/tmp") +
+         "/storehouse_write_bench.dat";
+}
+
+// The writer as it was before the switch to pwrite: stdio with the default
+// buffer, and save only flushing it
+void BM_Stdio(benchmark::State& state) {
+  std::vector<uint8_t> data(APPEND_SIZE, 'x');
+  std::string path = bench_path();
+
+  for (auto _ : state) {
+    FILE* fp = fopen(path.c_str(), "w");
+    for (size_t written = 0; written < FILE_SIZE; written += data.size()) {
+      fwrite(data.data(), 1, data.size(), fp);
+    }
+    fflush(fp);
+    fclose(fp);
+  }
+  state.SetBytesProcessed(state.iterations() * FILE_SIZE);
+  unlink(path.c_str());
+}
+
+void BM_PosixWriteFile(benchmark::State& state,
+                       std::map<std::string, std::string> args) {
+  std::unique_ptr<StorageConfig> config(
+    StorageConfig::make_config("posix", args));
+  std::unique_ptr<StorageBackend> storage(
+    StorageBackend::make_from_config(config.get()));
+  std::vector<uint8_t> data(APPEND_SIZE, 'x');
+  std::string path = bench_path();
+
+  for (auto _ : state) {
+    std::unique_ptr<WriteFile> file;
+    if (make_unique_write_file(storage.get(), path, file) !=
+        StoreResult::Success) {
+      state.SkipWithError("could not open the benchmark file");
+      break;
+    }
+    file->reserve(FILE_SIZE);
+    for (size_t written = 0; written < FILE_SIZE; written += data.size()) {
+      file->append(data.size(), data.data());
+    }
+    if (file->save() != StoreResult::Success) {
+      state.SkipWithError("save failed");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * FILE_SIZE);
+  unlink(path.c_str());
+}
+
+}
+
+BENCHMARK(BM_Stdio)->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_PosixWriteFile, none, {{"sync_policy", "none"}})
+  ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_PosixWriteFile, data, {{"sync_policy", "data"}})
+  ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_PosixWriteFile, full, {{"sync_policy", "full"}})
+  ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_PosixWriteFile, full_every_32mb,
+                  {{"sync_policy", "full"},
+                   {"sync_interval_bytes", "33554432"}})
+  ->Unit(benchmark::kMillisecond)->UseRealTime();
+BENCHMARK_CAPTURE(BM_PosixWriteFile, direct_full,
+                  {{"sync_policy", "full"}, {"use_direct_io", "true"}})
+  ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
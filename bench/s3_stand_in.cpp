@@ -0,0 +1,626 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "s3_stand_in.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+namespace storehouse {
+
+namespace {
+
+const size_t MAX_KEYS = 1000;
+
+bool send_all(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+std::string lower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
+}
+
+std::string url_decode(const std::string& s) {
+  std::string decoded;
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '%' && i + 2 < s.size() && isxdigit(s[i + 1]) &&
+        isxdigit(s[i + 2])) {
+      decoded +=
+        static_cast<char>(strtol(s.substr(i + 1, 2).c_str(), NULL, 16));
+      i += 2;
+    } else {
+      decoded += s[i];
+    }
+  }
+  return decoded;
+}
+
+std::string xml_escape(const std::string& s) {
+  std::string escaped;
+  for (char c : s) {
+    switch (c) {
+      case '&': escaped += "&amp;"; break;
+      case '<': escaped += "&lt;"; break;
+      case '>': escaped += "&gt;"; break;
+      case '"': escaped += "&quot;"; break;
+      case '\'': escaped += "&apos;"; break;
+      default: escaped += c;
+    }
+  }
+  return escaped;
+}
+
+std::string xml_unescape(const std::string& s) {
+  static const std::pair<const char*, char> entities[] = {
+    {"&amp;", '&'}, {"&lt;", '<'},   {"&gt;", '>'},
+    {"&quot;", '"'}, {"&apos;", '\''}};
+  std::string unescaped;
+  for (size_t i = 0; i < s.size(); ++i) {
+    bool replaced = false;
+    if (s[i] == '&') {
+      for (auto& entity : entities) {
+        size_t length = strlen(entity.first);
+        if (s.compare(i, length, entity.first) == 0) {
+          unescaped += entity.second;
+          i += length - 1;
+          replaced = true;
+          break;
+        }
+      }
+    }
+    if (!replaced) {
+      unescaped += s[i];
+    }
+  }
+  return unescaped;
+}
+
+std::string format_time(int64_t time, const char* format) {
+  time_t t = time;
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  char buffer[64];
+  strftime(buffer, sizeof(buffer), format, &tm);
+  return buffer;
+}
+
+std::string http_date(int64_t time) {
+  return format_time(time, "%a, %d %b %Y %H:%M:%S GMT");
+}
+
+std::string iso_date(int64_t time) {
+  return format_time(time, "%Y-%m-%dT%H:%M:%S.000Z");
+}
+
+std::string strip_quotes(const std::string& etag) {
+  if (etag.size() >= 2 && etag.front() == '"' && etag.back() == '"') {
+    return etag.substr(1, etag.size() - 2);
+  }
+  return etag;
+}
+
+const char* status_text(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 412: return "Precondition Failed";
+    case 416: return "Requested Range Not Satisfiable";
+    case 501: return "Not Implemented";
+    default: return "Internal Server Error";
+  }
+}
+
+}
+
+struct S3StandIn::Request {
+  std::string method;
+  std::string bucket;
+  std::string key;
+  std::map<std::string, std::string> query;
+  // Names lower-cased
+  std::map<std::string, std::string> headers;
+  std::string body;
+  bool keep_alive = true;
+
+  bool has_query(const std::string& name) const {
+    return query.count(name) > 0;
+  }
+
+  std::string header(const std::string& name) const {
+    auto it = headers.find(name);
+    return it == headers.end() ? "" : it->second;
+  }
+};
+
+namespace {
+
+// Buffered reader for one connection
+class Connection {
+ public:
+  Connection(int fd) : fd_(fd) {}
+
+  bool read_line(std::string& line) {
+    while (true) {
+      size_t end = buffer_.find("\r\n", position_);
+      if (end != std::string::npos) {
+        line = buffer_.substr(position_, end - position_);
+        position_ = end + 2;
+        return true;
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+  }
+
+  bool read(size_t size, std::string& data) {
+    while (buffer_.size() - position_ < size) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    data.append(buffer_, position_, size);
+    position_ += size;
+    return true;
+  }
+
+ private:
+  bool fill() {
+    if (position_ > 0) {
+      buffer_.erase(0, position_);
+      position_ = 0;
+    }
+    char chunk[64 * 1024];
+    ssize_t received = recv(fd_, chunk, sizeof(chunk), 0);
+    if (received <= 0) {
+      return false;
+    }
+    buffer_.append(chunk, received);
+    return true;
+  }
+
+  int fd_;
+  std::string buffer_;
+  size_t position_ = 0;
+};
+
+void respond(int fd, int status,
+             const std::vector<std::pair<std::string, std::string>>& headers,
+             const char* body, size_t body_size, bool send_body = true) {
+  std::ostringstream head;
+  head << "HTTP/1.1 " << status << " " << status_text(status) << "\r\n"
+       << "Content-Length: " << body_size << "\r\n"
+       << "x-amz-request-id: standin\r\n";
+  for (auto& header : headers) {
+    head << header.first << ": " << header.second << "\r\n";
+  }
+  head << "\r\n";
+  std::string h = head.str();
+  if (send_all(fd, h.data(), h.size()) && send_body) {
+    send_all(fd, body, body_size);
+  }
+}
+
+void respond_xml(int fd, int status, const std::string& xml,
+                 bool send_body = true) {
+  respond(fd, status, {{"Content-Type", "application/xml"}}, xml.data(),
+          xml.size(), send_body);
+}
+
+void respond_error(int fd, int status, const std::string& code,
+                   const std::string& message, bool send_body = true) {
+  std::string xml =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Error><Code>" + code +
+    "</Code><Message>" + xml_escape(message) + "</Message></Error>";
+  respond_xml(fd, status, xml, send_body);
+}
+
+}
+
+S3StandIn::S3StandIn() : stopping_(false) {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    throw std::runtime_error("S3StandIn: socket failed");
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  socklen_t length = sizeof(address);
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), length) != 0 ||
+      listen(listen_fd_, 128) != 0 ||
+      getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address),
+                  &length) != 0) {
+    close(listen_fd_);
+    throw std::runtime_error("S3StandIn: could not listen on 127.0.0.1");
+  }
+  port_ = ntohs(address.sin_port);
+  acceptor_ = std::thread(&S3StandIn::accept_connections, this);
+}
+
+S3StandIn::~S3StandIn() {
+  stopping_ = true;
+  shutdown(listen_fd_, SHUT_RDWR);
+  acceptor_.join();
+  close(listen_fd_);
+
+  std::vector<std::thread> connections;
+  {
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    for (int fd : connection_fds_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    connections.swap(connections_);
+  }
+  for (auto& connection : connections) {
+    connection.join();
+  }
+}
+
+std::string S3StandIn::endpoint() const {
+  return "127.0.0.1:" + std::to_string(port_);
+}
+
+void S3StandIn::accept_connections() {
+  while (!stopping_) {
+    int fd = accept(listen_fd_, NULL, NULL);
+    if (fd < 0) {
+      if (stopping_ || (errno != EINTR && errno != ECONNABORTED)) {
+        return;
+      }
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::lock_guard<std::mutex> lock(connections_mutex_);
+    if (stopping_) {
+      close(fd);
+      return;
+    }
+    connection_fds_.push_back(fd);
+    connections_.emplace_back(&S3StandIn::serve, this, fd);
+  }
+}
+
+void S3StandIn::serve(int fd) {
+  Connection connection(fd);
+  std::string line;
+  while (connection.read_line(line)) {
+    if (line.empty()) {
+      continue;
+    }
+    Request request;
+    std::istringstream request_line(line);
+    std::string target, version;
+    request_line >> request.method >> target >> version;
+
+    bool valid = true;
+    while ((valid = connection.read_line(line)) && !line.empty()) {
+      size_t colon = line.find(':');
+      if (colon == std::string::npos) {
+        continue;
+      }
+      size_t value = line.find_first_not_of(" \t", colon + 1);
+      request.headers[lower(line.substr(0, colon))] =
+        value == std::string::npos ? "" : line.substr(value);
+    }
+    if (!valid) {
+      break;
+    }
+    request.keep_alive = lower(request.header("connection")) != "close";
+
+    if (lower(request.header("expect")) == "100-continue") {
+      const char* proceed = "HTTP/1.1 100 Continue\r\n\r\n";
+      send_all(fd, proceed, strlen(proceed));
+    }
+    if (lower(request.header("transfer-encoding")) == "chunked") {
+      while ((valid = connection.read_line(line))) {
+        size_t size = strtoull(line.c_str(), NULL, 16);
+        if (size == 0) {
+          // Trailers end with an empty line
+          while ((valid = connection.read_line(line)) && !line.empty()) {
+          }
+          break;
+        }
+        valid = connection.read(size, request.body) &&
+                connection.read_line(line);
+        if (!valid) {
+          break;
+        }
+      }
+    } else if (!request.header("content-length").empty()) {
+      valid = connection.read(
+        strtoull(request.header("content-length").c_str(), NULL, 10),
+        request.body);
+    }
+    if (!valid) {
+      break;
+    }
+
+    // Path-style target: /bucket/key?query
+    size_t question = target.find('?');
+    std::string path = target.substr(0, question);
+    if (question != std::string::npos) {
+      std::istringstream query(target.substr(question + 1));
+      std::string parameter;
+      while (std::getline(query, parameter, '&')) {
+        size_t equals = parameter.find('=');
+        request.query[url_decode(parameter.substr(0, equals))] =
+          equals == std::string::npos
+            ? ""
+            : url_decode(parameter.substr(equals + 1));
+      }
+    }
+    size_t start = path.find_first_not_of('/');
+    if (start != std::string::npos) {
+      size_t slash = path.find('/', start);
+      request.bucket = url_decode(path.substr(start, slash - start));
+      if (slash != std::string::npos) {
+        request.key = url_decode(path.substr(slash + 1));
+      }
+    }
+
+    handle(fd, request);
+    if (!request.keep_alive) {
+      break;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(connections_mutex_);
+  close(fd);
+  connection_fds_.erase(
+    std::find(connection_fds_.begin(), connection_fds_.end(), fd));
+}
+
+void S3StandIn::handle(int fd, Request& request) {
+  const std::string& method = request.method;
+  bool head = method == "HEAD";
+  if (request.bucket.empty()) {
+    respond_error(fd, 501, "NotImplemented", "Bucket listing", !head);
+    return;
+  }
+  if (request.key.empty()) {
+    if (method == "GET" && request.query["list-type"] == "2") {
+      list_objects(fd, request.bucket, request);
+    } else if (method == "POST" && request.has_query("delete")) {
+      delete_objects(fd, request.bucket, request);
+    } else if (method == "HEAD" || method == "PUT") {
+      // Buckets always exist
+      respond(fd, 200, {}, NULL, 0);
+    } else {
+      respond_error(fd, 501, "NotImplemented", method + " on a bucket", !head);
+    }
+    return;
+  }
+  if (request.has_query("uploads") || request.has_query("uploadId")) {
+    respond_error(fd, 501, "NotImplemented", "Multipart uploads", !head);
+    return;
+  }
+
+  if (method == "GET" || method == "HEAD") {
+    std::shared_ptr<const Object> object = find(request.bucket, request.key);
+    if (!object) {
+      respond_error(fd, 404, "NoSuchKey", request.key, !head);
+      return;
+    }
+    std::string if_match = request.header("if-match");
+    if (!if_match.empty() && strip_quotes(if_match) != object->etag) {
+      respond_error(fd, 412, "PreconditionFailed", "If-Match", !head);
+      return;
+    }
+
+    uint64_t size = object->data.size();
+    uint64_t first = 0;
+    uint64_t last = size == 0 ? 0 : size - 1;
+    int status = 200;
+    std::vector<std::pair<std::string, std::string>> headers = {
+      {"ETag", "\"" + object->etag + "\""},
+      {"Last-Modified", http_date(object->mtime)},
+      {"Content-Type", "binary/octet-stream"},
+      {"Accept-Ranges", "bytes"}};
+    std::string range = request.header("range");
+    if (!range.empty() && range.compare(0, 6, "bytes=") == 0) {
+      size_t dash = range.find('-', 6);
+      first = strtoull(range.c_str() + 6, NULL, 10);
+      if (dash != std::string::npos && dash + 1 < range.size()) {
+        last = std::min(last, (uint64_t)strtoull(range.c_str() + dash + 1,
+                                                 NULL, 10));
+      }
+      if (first >= size) {
+        respond_error(fd, 416, "InvalidRange", range, !head);
+        return;
+      }
+      status = 206;
+      headers.emplace_back("Content-Range", "bytes " + std::to_string(first) +
+                                              "-" + std::to_string(last) +
+                                              "/" + std::to_string(size));
+    }
+    uint64_t length = size == 0 ? 0 : last - first + 1;
+    respond(fd, status, headers, object->data.data() + first, length, !head);
+  } else if (method == "PUT") {
+    std::shared_ptr<Object> object(new Object);
+    object->data.swap(request.body);
+    char etag[32];
+    snprintf(etag, sizeof(etag), "%016zx",
+             std::hash<std::string>()(object->data));
+    object->etag = etag;
+    object->mtime = time(NULL);
+    {
+      std::lock_guard<std::mutex> lock(objects_mutex_);
+      objects_[request.bucket][request.key] = object;
+    }
+    respond(fd, 200, {{"ETag", "\"" + object->etag + "\""}}, NULL, 0);
+  } else if (method == "DELETE") {
+    {
+      std::lock_guard<std::mutex> lock(objects_mutex_);
+      objects_[request.bucket].erase(request.key);
+    }
+    respond(fd, 204, {}, NULL, 0);
+  } else {
+    respond_error(fd, 501, "NotImplemented", method, !head);
+  }
+}
+
+void S3StandIn::list_objects(int fd, const std::string& bucket,
+                             Request& request) {
+  const std::string prefix = request.query["prefix"];
+  const std::string delimiter = request.query["delimiter"];
+  size_t max_keys = MAX_KEYS;
+  if (request.has_query("max-keys")) {
+    max_keys = std::min(
+      max_keys, (size_t)strtoull(request.query["max-keys"].c_str(), NULL, 10));
+  }
+  // The continuation token is the first key the next page starts from
+  std::string from = prefix;
+  if (request.has_query("continuation-token")) {
+    from = std::max(from, request.query["continuation-token"]);
+  }
+  if (request.has_query("start-after")) {
+    from = std::max(from, request.query["start-after"] + '\0');
+  }
+
+  std::ostringstream contents;
+  size_t count = 0;
+  std::string next;
+  {
+    std::lock_guard<std::mutex> lock(objects_mutex_);
+    auto& objects = objects_[bucket];
+    auto it = objects.lower_bound(from);
+    while (it != objects.end() && it->first.compare(0, prefix.size(),
+                                                    prefix) == 0) {
+      if (count == max_keys) {
+        next = it->first;
+        break;
+      }
+      const std::string& key = it->first;
+      size_t split = delimiter.empty()
+                       ? std::string::npos
+                       : key.find(delimiter, prefix.size());
+      if (split != std::string::npos) {
+        std::string common = key.substr(0, split + delimiter.size());
+        contents << "<CommonPrefixes><Prefix>" << xml_escape(common)
+                 << "</Prefix></CommonPrefixes>";
+        // Skip past every key under the common prefix
+        while (it != objects.end() &&
+               it->first.compare(0, common.size(), common) == 0) {
+          ++it;
+        }
+      } else {
+        const Object& object = *it->second;
+        contents << "<Contents><Key>" << xml_escape(key)
+                 << "</Key><LastModified>" << iso_date(object.mtime)
+                 << "</LastModified><ETag>&quot;" << object.etag
+                 << "&quot;</ETag><Size>" << object.data.size()
+                 << "</Size><StorageClass>STANDARD</StorageClass></Contents>";
+        ++it;
+      }
+      ++count;
+    }
+  }
+
+  std::ostringstream xml;
+  xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<ListBucketResult "
+         "xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">"
+      << "<Name>" << xml_escape(bucket) << "</Name>"
+      << "<Prefix>" << xml_escape(prefix) << "</Prefix>"
+      << "<KeyCount>" << count << "</KeyCount>"
+      << "<MaxKeys>" << max_keys << "</MaxKeys>";
+  if (!delimiter.empty()) {
+    xml << "<Delimiter>" << xml_escape(delimiter) << "</Delimiter>";
+  }
+  xml << "<IsTruncated>" << (next.empty() ? "false" : "true")
+      << "</IsTruncated>";
+  if (!next.empty()) {
+    xml << "<NextContinuationToken>" << xml_escape(next)
+        << "</NextContinuationToken>";
+  }
+  xml << contents.str() << "</ListBucketResult>";
+  respond_xml(fd, 200, xml.str());
+}
+
+void S3StandIn::delete_objects(int fd, const std::string& bucket,
+                               Request& request) {
+  std::vector<std::string> keys;
+  const std::string open = "<Key>", close = "</Key>";
+  size_t position = 0;
+  while ((position = request.body.find(open, position)) != std::string::npos) {
+    position += open.size();
+    size_t end = request.body.find(close, position);
+    if (end == std::string::npos) {
+      break;
+    }
+    keys.push_back(xml_unescape(request.body.substr(position, end - position)));
+    position = end + close.size();
+  }
+  bool quiet = request.body.find("<Quiet>true</Quiet>") != std::string::npos;
+
+  std::ostringstream xml;
+  xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<DeleteResult xmlns=\"http://s3.amazonaws.com/doc/2006-03-01/\">";
+  {
+    std::lock_guard<std::mutex> lock(objects_mutex_);
+    auto& objects = objects_[bucket];
+    for (const std::string& key : keys) {
+      objects.erase(key);
+      if (!quiet) {
+        xml << "<Deleted><Key>" << xml_escape(key) << "</Key></Deleted>";
+      }
+    }
+  }
+  xml << "</DeleteResult>";
+  respond_xml(fd, 200, xml.str());
+}
+
+std::shared_ptr<const S3StandIn::Object> S3StandIn::find(
+  const std::string& bucket, const std::string& key) {
+  std::lock_guard<std::mutex> lock(objects_mutex_);
+  auto bucket_it = objects_.find(bucket);
+  if (bucket_it == objects_.end()) {
+    return nullptr;
+  }
+  auto it = bucket_it->second.find(key);
+  return it == bucket_it->second.end() ? nullptr : it->second;
+}
+}
@@ -0,0 +1,87 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// S3StandIn
+/* An in-memory S3-compatible HTTP server on a local port, so the S3 backend
+ * can be benchmarked offline. Serves path-style requests over plain HTTP
+ * (set use_https and virtual_addressing to false) and implements what the
+ * backend uses apart from multipart uploads: GetObject with ranges and
+ * If-Match, HeadObject, PutObject, DeleteObject, DeleteObjects and
+ * ListObjectsV2. Buckets exist as soon as they are written to, and
+ * signatures are not checked.
+ */
+class S3StandIn {
+ public:
+  /* Starts listening on an ephemeral port of 127.0.0.1. */
+  S3StandIn();
+
+  ~S3StandIn();
+
+  /* endpoint
+   *
+   * host:port to use as S3Config::endpointOverride.
+   */
+  std::string endpoint() const;
+
+ private:
+  struct Object {
+    std::string data;
+    std::string etag;
+    int64_t mtime;
+  };
+
+  struct Request;
+
+  void accept_connections();
+
+  void serve(int fd);
+
+  void handle(int fd, Request& request);
+
+  void list_objects(int fd, const std::string& bucket, Request& request);
+
+  void delete_objects(int fd, const std::string& bucket, Request& request);
+
+  std::shared_ptr<const Object> find(const std::string& bucket,
+                                     const std::string& key);
+
+  int listen_fd_;
+  int port_;
+  std::atomic<bool> stopping_;
+  std::thread acceptor_;
+
+  std::mutex connections_mutex_;
+  std::vector<int> connection_fds_;
+  std::vector<std::thread> connections_;
+
+  std::mutex objects_mutex_;
+  // Bucket to key to object
+  std::map<std::string, std::map<std::string, std::shared_ptr<const Object>>>
+    objects_;
+};
+}
@@ -0,0 +1,137 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Compares the two ways S3RandomReadFile can receive a GET body: the SDK's
+ * default growable stream followed by a copy into the caller's buffer, and a
+ * PreallocatedIOStream that writes into the caller's buffer directly. The
+ * body is delivered in transport-sized chunks the way the HTTP client does,
+ * and every byte moved after leaving the transport is counted.
+ */
+
+#include "storehouse/s3/s3_streams.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <sstream>
+#include <vector>
+
+using namespace storehouse;
+
+namespace {
+
+// Size of each write the HTTP client makes into the response stream
+const size_t TRANSPORT_CHUNK_SIZE = 16 * 1024;
+
+uint64_t bytes_allocated = 0;
+uint64_t bytes_regrown = 0;
+
+// Tracks the buffer growth done by the default stream. Each reallocation
+// copies the previous contents, so the size of every buffer released while
+// the body is still being received is counted as copied.
+template <class T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() {}
+  template <class U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(size_t n) {
+    bytes_allocated += n * sizeof(T);
+    return std::allocator<T>().allocate(n);
+  }
+
+  void deallocate(T* p, size_t n) {
+    bytes_regrown += n * sizeof(T);
+    std::allocator<T>().deallocate(p, n);
+  }
+
+  template <class U>
+  bool operator==(const CountingAllocator<U>&) const { return true; }
+  template <class U>
+  bool operator!=(const CountingAllocator<U>&) const { return false; }
+};
+
+typedef std::basic_stringstream<char, std::char_traits<char>,
+                                CountingAllocator<char>>
+  DefaultResponseStream;
+
+void deliver_body(std::ostream& body, const std::vector<uint8_t>& payload) {
+  for (size_t offset = 0; offset < payload.size();
+       offset += TRANSPORT_CHUNK_SIZE) {
+    size_t size = std::min(TRANSPORT_CHUNK_SIZE, payload.size() - offset);
+    body.write(reinterpret_cast<const char*>(payload.data() + offset), size);
+  }
+}
+
+void report(benchmark::State& state, uint64_t bytes_read,
+            uint64_t bytes_copied) {
+  state.SetBytesProcessed(bytes_read);
+  state.counters["copied_per_byte_read"] =
+    static_cast<double>(bytes_copied) / bytes_read;
+  state.counters["allocated_per_byte_read"] =
+    static_cast<double>(bytes_allocated) / bytes_read;
+}
+
+void BM_DefaultStreamThenCopy(benchmark::State& state) {
+  std::vector<uint8_t> payload(state.range(0), 'x');
+  std::vector<uint8_t> destination(payload.size());
+  uint64_t bytes_read = 0;
+  uint64_t bytes_copied = 0;
+  bytes_allocated = 0;
+
+  for (auto _ : state) {
+    bytes_regrown = 0;
+    {
+      DefaultResponseStream body;
+      deliver_body(body, payload);
+      bytes_copied += payload.size();
+      // Everything freed so far was an outgrown buffer
+      bytes_copied += bytes_regrown;
+
+      body.rdbuf()->sgetn(reinterpret_cast<char*>(destination.data()),
+                          destination.size());
+      bytes_copied += destination.size();
+    }
+    benchmark::DoNotOptimize(destination.data());
+    bytes_read += destination.size();
+  }
+  report(state, bytes_read, bytes_copied);
+}
+
+void BM_PreallocatedStream(benchmark::State& state) {
+  std::vector<uint8_t> payload(state.range(0), 'x');
+  std::vector<uint8_t> destination(payload.size());
+  uint64_t bytes_read = 0;
+  uint64_t bytes_copied = 0;
+  bytes_allocated = 0;
+
+  for (auto _ : state) {
+    PreallocatedIOStream body(destination.data(), destination.size());
+    deliver_body(body, payload);
+    bytes_copied += body.size_written();
+    benchmark::DoNotOptimize(destination.data());
+    bytes_read += body.size_written();
+  }
+  report(state, bytes_read, bytes_copied);
+}
+
+}
+
+BENCHMARK(BM_DefaultStreamThenCopy)->RangeMultiplier(16)->Range(64 << 10, 64 << 20);
+BENCHMARK(BM_PreallocatedStream)->RangeMultiplier(16)->Range(64 << 10, 64 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,492 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Measures the access patterns storehouse is used for, on every backend
+ * that can run offline: sequential reads, small random reads, whole-file
+ * reads, append+save and metadata calls, across thread counts and request
+ * sizes. The S3 backend talks to an in-process S3StandIn over loopback, so
+ * its numbers show the client-side cost rather than S3's. The memory backend
+ * does no I/O at all, which makes it the baseline for the cost of the
+ * storehouse layer itself.
+ *
+ * Besides bytes_per_second and items_per_second (calls per second), each
+ * benchmark reports p50_us, p90_us and p99_us. Every thread keeps its own
+ * histogram while it runs; once all threads are done the histograms are
+ * merged, and the percentiles are those of the merged histogram, so a slow
+ * thread's tail is not averaged away.
+ *
+ * Posix files go in a temp folder under $STOREHOUSE_BENCH_DIR, or /tmp.
+ * Restrict a run with --benchmark_filter, e.g. --benchmark_filter=/posix/.
+ */
+
+#include "s3_stand_in.h"
+#include "storehouse/metrics.h"
+#include "storehouse/storage_backend.h"
+#include "storehouse/storage_config.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace storehouse;
+
+namespace {
+
+const uint64_t LARGE_FILE_SIZE = 64 * 1024 * 1024;
+const std::vector<uint64_t> WHOLE_FILE_SIZES = {1024 * 1024,
+                                                16 * 1024 * 1024};
+const int NUM_METADATA_FILES = 256;
+const uint64_t METADATA_FILE_SIZE = 1024;
+
+struct Backend {
+  std::unique_ptr<StorageBackend> storage;
+  // Prefix of every name the benchmarks use
+  std::string root;
+};
+
+std::map<std::string, Backend> backends;
+
+std::atomic<uint64_t> next_writer{0};
+
+std::string large_file(const Backend& backend) {
+  return backend.root + "/large";
+}
+
+std::string whole_file(const Backend& backend, uint64_t size) {
+  return backend.root + "/whole/" + std::to_string(size);
+}
+
+std::string metadata_file(const Backend& backend, int i) {
+  return backend.root + "/meta/" + std::to_string(i);
+}
+
+// Per-thread latencies. Every thread of a benchmark must call report once,
+// which waits for the others and reports percentiles over all of them.
+class LatencyRecorder {
+ public:
+  LatencyRecorder() { clear(histogram_); }
+
+  void start() { start_ = std::chrono::steady_clock::now(); }
+
+  void stop() {
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start_)
+                    .count();
+    histogram_.count++;
+    histogram_.sum_us += us;
+    histogram_.buckets[LatencyHistogramSnapshot::bucket_index(us)]++;
+  }
+
+  void report(benchmark::State& state) {
+    LatencyHistogramSnapshot merged;
+    {
+      Merge& merge = shared_merge();
+      std::unique_lock<std::mutex> lock(merge.mutex);
+      if (merge.arrived == 0) {
+        clear(merge.histogram);
+      }
+      merge.histogram.count += histogram_.count;
+      merge.histogram.sum_us += histogram_.sum_us;
+      for (size_t i = 0; i < histogram_.buckets.size(); ++i) {
+        merge.histogram.buckets[i] += histogram_.buckets[i];
+      }
+      if (++merge.arrived == state.threads) {
+        // The threads of the next run only start once all of these return
+        merge.arrived = 0;
+        merge.generation++;
+        merge.cv.notify_all();
+      } else {
+        uint64_t generation = merge.generation;
+        merge.cv.wait(lock, [&] { return merge.generation != generation; });
+      }
+      merged = merge.histogram;
+    }
+
+    // Every thread sets the same values, so averaging them leaves them as is
+    const std::pair<const char*, double> percentiles[] = {
+      {"p50_us", 0.5}, {"p90_us", 0.9}, {"p99_us", 0.99}};
+    for (auto& p : percentiles) {
+      state.counters[p.first] = benchmark::Counter(
+        merged.percentile_us(p.second), benchmark::Counter::kAvgThreads);
+    }
+  }
+
+ private:
+  struct Merge {
+    std::mutex mutex;
+    std::condition_variable cv;
+    LatencyHistogramSnapshot histogram;
+    int arrived = 0;
+    uint64_t generation = 0;
+  };
+
+  static Merge& shared_merge() {
+    static Merge merge;
+    return merge;
+  }
+
+  static void clear(LatencyHistogramSnapshot& histogram) {
+    histogram.count = 0;
+    histogram.sum_us = 0;
+    histogram.buckets.assign(LatencyHistogramSnapshot::NUM_BUCKETS, 0);
+  }
+
+  std::chrono::steady_clock::time_point start_;
+  LatencyHistogramSnapshot histogram_;
+};
+
+uint64_t xorshift(uint64_t& x) {
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return x;
+}
+
+uint64_t thread_seed() {
+  return std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+}
+
+bool open_file(benchmark::State& state, Backend& backend,
+               const std::string& name, std::unique_ptr<RandomReadFile>& file) {
+  StoreResult result =
+    make_unique_random_read_file(backend.storage.get(), name, file);
+  if (result != StoreResult::Success) {
+    state.SkipWithError(("Could not open " + name).c_str());
+    return false;
+  }
+  return true;
+}
+
+// Each thread streams through the large file on its own handle, starting at
+// a different point so threads do not read the same bytes in lockstep
+void BM_SequentialRead(benchmark::State& state, const char* backend_name) {
+  Backend& backend = backends.at(backend_name);
+  LatencyRecorder latency;
+  std::unique_ptr<RandomReadFile> file;
+  if (!open_file(state, backend, large_file(backend), file)) {
+    latency.report(state);
+    return;
+  }
+  size_t size = state.range(0);
+  std::vector<uint8_t> buffer(size);
+  uint64_t slots = LARGE_FILE_SIZE / size;
+  uint64_t slot = thread_seed() % slots;
+  uint64_t bytes_read = 0;
+  uint64_t reads = 0;
+
+  for (auto _ : state) {
+    size_t size_read;
+    latency.start();
+    StoreResult result =
+      file->read(slot * size, size, buffer.data(), size_read);
+    latency.stop();
+    if (result != StoreResult::Success && result != StoreResult::EndOfFile) {
+      state.SkipWithError(store_result_to_string(result).c_str());
+      break;
+    }
+    slot = (slot + 1) % slots;
+    bytes_read += size_read;
+    reads++;
+  }
+  state.SetBytesProcessed(bytes_read);
+  state.SetItemsProcessed(reads);
+  latency.report(state);
+}
+
+// Small reads at random aligned offsets of the large file, all threads on one
+// shared handle
+std::map<std::string, std::unique_ptr<RandomReadFile>> shared_files;
+
+void BM_RandomRead(benchmark::State& state, const char* backend_name) {
+  RandomReadFile* file = shared_files.at(backend_name).get();
+  size_t size = state.range(0);
+  std::vector<uint8_t> buffer(size);
+  uint64_t slots = LARGE_FILE_SIZE / size;
+  uint64_t x = thread_seed();
+  uint64_t bytes_read = 0;
+  uint64_t reads = 0;
+  LatencyRecorder latency;
+
+  for (auto _ : state) {
+    size_t size_read;
+    latency.start();
+    StoreResult result =
+      file->read((xorshift(x) % slots) * size, size, buffer.data(), size_read);
+    latency.stop();
+    if (result != StoreResult::Success) {
+      state.SkipWithError(store_result_to_string(result).c_str());
+      break;
+    }
+    bytes_read += size_read;
+    reads++;
+  }
+  state.SetBytesProcessed(bytes_read);
+  state.SetItemsProcessed(reads);
+  latency.report(state);
+}
+
+// Opens a file, reads all of it and closes it, the way callers that load a
+// file into memory do
+void BM_WholeFileRead(benchmark::State& state, const char* backend_name) {
+  Backend& backend = backends.at(backend_name);
+  std::string name = whole_file(backend, state.range(0));
+  uint64_t bytes_read = 0;
+  uint64_t files = 0;
+  LatencyRecorder latency;
+
+  for (auto _ : state) {
+    latency.start();
+    std::unique_ptr<RandomReadFile> file;
+    if (!open_file(state, backend, name, file)) {
+      break;
+    }
+    uint64_t pos = 0;
+    std::vector<uint8_t> data = read_entire_file(file.get(), pos);
+    latency.stop();
+    benchmark::DoNotOptimize(data.data());
+    bytes_read += data.size();
+    files++;
+  }
+  state.SetBytesProcessed(bytes_read);
+  state.SetItemsProcessed(files);
+  latency.report(state);
+}
+
+// Writes a file of range(0) bytes in appends of range(1) bytes and saves it.
+// Each thread overwrites its own file.
+void BM_AppendSave(benchmark::State& state, const char* backend_name) {
+  Backend& backend = backends.at(backend_name);
+  std::string name =
+    backend.root + "/writes/" + std::to_string(next_writer++);
+  uint64_t file_size = state.range(0);
+  size_t append_size = state.range(1);
+  std::vector<uint8_t> chunk(append_size, 'w');
+  uint64_t bytes_written = 0;
+  uint64_t files = 0;
+  LatencyRecorder latency;
+
+  for (auto _ : state) {
+    latency.start();
+    std::unique_ptr<WriteFile> file;
+    StoreResult result =
+      make_unique_write_file(backend.storage.get(), name, file);
+    for (uint64_t written = 0;
+         result == StoreResult::Success && written < file_size;
+         written += append_size) {
+      result = file->append(append_size, chunk.data());
+    }
+    if (result == StoreResult::Success) {
+      result = file->save();
+    }
+    file.reset();
+    latency.stop();
+    if (result != StoreResult::Success) {
+      state.SkipWithError(store_result_to_string(result).c_str());
+      break;
+    }
+    bytes_written += file_size;
+    files++;
+  }
+  state.SetBytesProcessed(bytes_written);
+  state.SetItemsProcessed(files);
+  latency.report(state);
+}
+
+void BM_GetFileInfo(benchmark::State& state, const char* backend_name) {
+  Backend& backend = backends.at(backend_name);
+  uint64_t x = thread_seed();
+  uint64_t calls = 0;
+  LatencyRecorder latency;
+
+  for (auto _ : state) {
+    std::string name =
+      metadata_file(backend, xorshift(x) % NUM_METADATA_FILES);
+    FileInfo info;
+    latency.start();
+    StoreResult result = backend.storage->get_file_info(name, info);
+    latency.stop();
+    if (result != StoreResult::Success) {
+      state.SkipWithError(store_result_to_string(result).c_str());
+      break;
+    }
+    calls++;
+  }
+  state.SetItemsProcessed(calls);
+  latency.report(state);
+}
+
+// One get_file_info_many over range(0) files of the metadata folder. Items
+// are files, so items_per_second compares with BM_GetFileInfo.
+void BM_GetFileInfoMany(benchmark::State& state, const char* backend_name) {
+  Backend& backend = backends.at(backend_name);
+  std::vector<std::string> names;
+  for (int i = 0; i < state.range(0); ++i) {
+    names.push_back(metadata_file(backend, i));
+  }
+  uint64_t files = 0;
+  LatencyRecorder latency;
+
+  for (auto _ : state) {
+    std::vector<FileInfo> infos;
+    std::vector<StoreResult> results;
+    latency.start();
+    StoreResult result =
+      backend.storage->get_file_info_many(names, infos, results);
+    latency.stop();
+    if (result != StoreResult::Success) {
+      state.SkipWithError(store_result_to_string(result).c_str());
+      break;
+    }
+    files += names.size();
+  }
+  state.SetItemsProcessed(files);
+  latency.report(state);
+}
+
+// Lists every page of the metadata folder. Items are listings.
+void BM_ListDirectory(benchmark::State& state, const char* backend_name) {
+  Backend& backend = backends.at(backend_name);
+  std::string folder = backend.root + "/meta";
+  uint64_t listings = 0;
+  LatencyRecorder latency;
+
+  for (auto _ : state) {
+    std::vector<DirectoryEntry> entries;
+    latency.start();
+    StoreResult result =
+      list_directory(backend.storage.get(), folder, false, entries);
+    latency.stop();
+    if (result != StoreResult::Success ||
+        entries.size() != NUM_METADATA_FILES) {
+      state.SkipWithError(("Listing " + folder + " failed").c_str());
+      break;
+    }
+    listings++;
+  }
+  state.SetItemsProcessed(listings);
+  latency.report(state);
+}
+
+void write_file(Backend& backend, const std::string& name, uint64_t size) {
+  std::vector<uint8_t> block(std::min(size, (uint64_t)(1024 * 1024)));
+  for (size_t i = 0; i < block.size(); ++i) {
+    block[i] = static_cast<uint8_t>(i * 31);
+  }
+  std::unique_ptr<WriteFile> file;
+  exit_on_error(make_unique_write_file(backend.storage.get(), name, file),
+                "Could not create " + name);
+  for (uint64_t written = 0; written < size; written += block.size()) {
+    exit_on_error(file->append(block.size(), block.data()),
+                  "Could not write " + name);
+  }
+  exit_on_error(file->save(), "Could not save " + name);
+}
+
+void add_backend(const std::string& name, StorageConfig* config,
+                 const std::string& root) {
+  std::unique_ptr<StorageConfig> owned_config(config);
+  Backend& backend = backends[name];
+  backend.storage.reset(StorageBackend::make_from_config(config));
+  backend.root = root;
+
+  write_file(backend, large_file(backend), LARGE_FILE_SIZE);
+  for (uint64_t size : WHOLE_FILE_SIZES) {
+    write_file(backend, whole_file(backend, size), size);
+  }
+  for (int i = 0; i < NUM_METADATA_FILES; ++i) {
+    write_file(backend, metadata_file(backend, i), METADATA_FILE_SIZE);
+  }
+
+  RandomReadFile* file;
+  exit_on_error(
+    backend.storage->make_random_read_file(large_file(backend), file),
+    "Could not open " + large_file(backend));
+  shared_files[name].reset(file);
+}
+
+}
+
+#define STOREHOUSE_BENCHMARKS(backend)                                     \
+  BENCHMARK_CAPTURE(BM_SequentialRead, backend, #backend)                 \
+    ->RangeMultiplier(16)->Range(64 << 10, 16 << 20)                      \
+    ->ThreadRange(1, 16)->UseRealTime();                                  \
+  BENCHMARK_CAPTURE(BM_RandomRead, backend, #backend)                     \
+    ->Arg(4 << 10)->Arg(64 << 10)                                          \
+    ->ThreadRange(1, 16)->UseRealTime();                                  \
+  BENCHMARK_CAPTURE(BM_WholeFileRead, backend, #backend)                  \
+    ->Arg(1 << 20)->Arg(16 << 20)                                          \
+    ->ThreadRange(1, 8)->UseRealTime();                                   \
+  BENCHMARK_CAPTURE(BM_AppendSave, backend, #backend)                     \
+    ->Args({64 << 10, 4 << 10})->Args({4 << 20, 64 << 10})                 \
+    ->Args({4 << 20, 1 << 20})                                             \
+    ->ThreadRange(1, 8)->UseRealTime();                                   \
+  BENCHMARK_CAPTURE(BM_GetFileInfo, backend, #backend)                    \
+    ->ThreadRange(1, 16)->UseRealTime();                                  \
+  BENCHMARK_CAPTURE(BM_GetFileInfoMany, backend, #backend)                \
+    ->Arg(16)->Arg(NUM_METADATA_FILES)                                     \
+    ->ThreadRange(1, 8)->UseRealTime();                                   \
+  BENCHMARK_CAPTURE(BM_ListDirectory, backend, #backend)                  \
+    ->ThreadRange(1, 8)->UseRealTime()
+
+STOREHOUSE_BENCHMARKS(memory);
+STOREHOUSE_BENCHMARKS(posix);
+STOREHOUSE_BENCHMARKS(s3);
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+
+  const char* bench_dir = getenv("STOREHOUSE_BENCH_DIR");
+  std::string posix_root =
+    std::string(bench_dir != NULL ? bench_dir : "/tmp") +
+    "/storehouse_bench.XXXXXX";
+  if (mkdtemp(&posix_root[0]) == NULL) {
+    fprintf(stderr, "Could not create %s\n", posix_root.c_str());
+    return 1;
+  }
+  add_backend("memory", StorageConfig::make_memory_config(), "bench");
+  add_backend("posix", StorageConfig::make_posix_config(), posix_root);
+
+  S3StandIn stand_in;
+  add_backend("s3",
+              StorageConfig::make_config(
+                "s3", {{"bucket", "storehouse-bench"},
+                       {"region", "us-east-1"},
+                       {"endpoint", stand_in.endpoint()},
+                       {"use_https", "false"},
+                       {"virtual_addressing", "false"},
+                       // Static credentials keep the SDK from looking for
+                       // instance metadata
+                       {"access_key_id", "bench"},
+                       {"secret_access_key", "bench"}}),
+              "bench");
+
+  benchmark::RunSpecifiedBenchmarks();
+
+  shared_files.clear();
+  backends.at("posix").storage->delete_dir(posix_root, true);
+  backends.clear();
+  return 0;
+}
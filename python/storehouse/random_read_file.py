@@ -2,9 +2,10 @@ from __future__ import absolute_import
 import os
 
 class RandomReadFile(object):
-    def __init__(self, storage_backend, filename):
+    def __init__(self, storage_backend, filename, readahead=True):
         self._offset = 0
-        self._f = storage_backend.make_random_read_file(filename)
+        self._f = storage_backend.make_random_read_file(
+            filename, readahead=readahead)
         self._size = self._f.get_size()
 
     def _close_guard(self):
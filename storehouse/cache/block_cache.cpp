@@ -0,0 +1,141 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/cache/block_cache.h"
+
+#include <algorithm>
+#include <functional>
+
+namespace storehouse {
+
+BlockCache::BlockCache(size_t capacity_bytes, size_t num_shards)
+    : shard_capacity_(capacity_bytes / std::max(num_shards, (size_t)1)) {
+  for (size_t i = 0; i < std::max(num_shards, (size_t)1); ++i) {
+    shards_.emplace_back(new Shard);
+  }
+  for (auto& generation : generations_) {
+    generation = 0;
+  }
+}
+
+CachedBlock BlockCache::lookup(const std::string& path, uint64_t block) {
+  std::string key = make_key(path, block);
+  Shard& shard = shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    shard.misses++;
+    return nullptr;
+  }
+  shard.hits++;
+  shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+  return it->second->data;
+}
+
+uint64_t BlockCache::generation(const std::string& path) {
+  return generation_slot(path).load();
+}
+
+void BlockCache::insert(const std::string& path, uint64_t block,
+                        CachedBlock data, uint64_t generation) {
+  if (data->size() > shard_capacity_) {
+    return;
+  }
+  std::string key = make_key(path, block);
+  Shard& shard = shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  // Invalidation bumps the generation before it takes the shard locks, so
+  // either this sees the bump or the block is removed after the insert
+  if (generation_slot(path).load() != generation) {
+    return;
+  }
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    shard.bytes -= it->second->data->size();
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+  }
+  while (!shard.lru.empty() &&
+         shard.bytes + data->size() > shard_capacity_) {
+    const Entry& victim = shard.lru.back();
+    shard.bytes -= victim.data->size();
+    shard.index.erase(make_key(victim.path, victim.block));
+    shard.lru.pop_back();
+    shard.evictions++;
+  }
+  shard.lru.push_front(Entry{path, block, data});
+  shard.index[key] = shard.lru.begin();
+  shard.bytes += data->size();
+}
+
+void BlockCache::invalidate(const std::string& path) {
+  generation_slot(path)++;
+  remove_matching(false, path);
+}
+
+void BlockCache::invalidate_prefix(const std::string& prefix) {
+  // Paths under a prefix hash anywhere in the table
+  for (auto& generation : generations_) {
+    generation++;
+  }
+  remove_matching(true, prefix);
+}
+
+CacheStats BlockCache::stats() {
+  CacheStats stats = {0, 0, 0, 0};
+  for (auto& shard : shards_) {
+    stats.hits += shard->hits;
+    stats.misses += shard->misses;
+    stats.evictions += shard->evictions;
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    stats.bytes += shard->bytes;
+  }
+  return stats;
+}
+
+std::string BlockCache::make_key(const std::string& path, uint64_t block) {
+  std::string key = path;
+  key.push_back('\0');
+  key.append(reinterpret_cast<const char*>(&block), sizeof(block));
+  return key;
+}
+
+BlockCache::Shard& BlockCache::shard_for(const std::string& key) {
+  return *shards_[std::hash<std::string>()(key) % shards_.size()];
+}
+
+std::atomic<uint64_t>& BlockCache::generation_slot(const std::string& path) {
+  return generations_[std::hash<std::string>()(path) % kGenerationSlots];
+}
+
+void BlockCache::remove_matching(bool prefix, const std::string& path) {
+  // Blocks of one file are spread over every shard, so visit them all.
+  // Writes are rare next to reads, which keeps this scan off the hot path.
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    for (auto it = shard->lru.begin(); it != shard->lru.end();) {
+      bool matches = prefix ? it->path.compare(0, path.size(), path) == 0
+                            : it->path == path;
+      if (matches) {
+        shard->bytes -= it->data->size();
+        shard->index.erase(make_key(it->path, it->block));
+        it = shard->lru.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+}
@@ -0,0 +1,108 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace storehouse {
+
+typedef std::shared_ptr<const std::vector<uint8_t>> CachedBlock;
+
+struct CacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t bytes;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// BlockCache
+/* An LRU cache of file blocks keyed by path and block index. The capacity is
+ * split evenly across shards, each with its own lock, so readers touching
+ * different blocks rarely contend. Blocks are handed out as shared pointers
+ * and stay valid after eviction for as long as a reader holds them.
+ *
+ * Invalidating a file also bumps its generation, so a block fetched from the
+ * old contents is not inserted once the fetch finishes. Generations live in a
+ * fixed table indexed by a hash of the path; files sharing a slot only cost
+ * each other a skipped insert.
+ */
+class BlockCache {
+ public:
+  BlockCache(size_t capacity_bytes, size_t num_shards = 16);
+
+  CachedBlock lookup(const std::string& path, uint64_t block);
+
+  /* generation
+   *
+   * Read before fetching a block of path, and pass to insert.
+   */
+  uint64_t generation(const std::string& path);
+
+  /* insert
+   *
+   * Drops the block instead if path was invalidated since generation was
+   * read.
+   */
+  void insert(const std::string& path, uint64_t block, CachedBlock data,
+              uint64_t generation);
+
+  /* Drops every block of the file at path. */
+  void invalidate(const std::string& path);
+
+  /* Drops every block of every file whose path starts with prefix. */
+  void invalidate_prefix(const std::string& prefix);
+
+  CacheStats stats();
+
+ private:
+  struct Entry {
+    std::string path;
+    uint64_t block;
+    CachedBlock data;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru;  // Most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes = 0;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+  };
+
+  static const size_t kGenerationSlots = 1024;
+
+  static std::string make_key(const std::string& path, uint64_t block);
+
+  std::atomic<uint64_t>& generation_slot(const std::string& path);
+
+  Shard& shard_for(const std::string& key);
+
+  void remove_matching(bool prefix, const std::string& path);
+
+  const size_t shard_capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::atomic<uint64_t> generations_[kGenerationSlots];
+};
+}
@@ -0,0 +1,218 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/cache/caching_storage.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// CachingRandomReadFile
+class CachingRandomReadFile : public RandomReadFile {
+ public:
+  CachingRandomReadFile(RandomReadFile* file,
+                        std::shared_ptr<BlockCache> cache, size_t block_size)
+      : file_(file), cache_(cache), block_size_(block_size) {}
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override {
+    size_read = 0;
+    if (size == 0) {
+      return StoreResult::Success;
+    }
+
+    uint64_t first_block = offset / block_size_;
+    uint64_t last_block = (offset + size - 1) / block_size_;
+    const std::string path = file_->path();
+
+    std::vector<CachedBlock> blocks;
+    std::vector<ReadRange> misses;
+    for (uint64_t block = first_block; block <= last_block; ++block) {
+      blocks.push_back(cache_->lookup(path, block));
+      if (!blocks.back()) {
+        ReadRange range;
+        range.offset = block * block_size_;
+        range.size = block_size_;
+        range.data = nullptr;
+        misses.push_back(range);
+      }
+    }
+
+    if (!misses.empty()) {
+      // Read before the fetch, so a save that lands during it keeps the old
+      // blocks out of the cache
+      uint64_t generation = cache_->generation(path);
+      // Fetch all missing blocks at once; adjacent ones are merged into a
+      // single request by the wrapped file
+      std::vector<std::shared_ptr<std::vector<uint8_t>>> fetched;
+      for (ReadRange& range : misses) {
+        fetched.push_back(
+          std::make_shared<std::vector<uint8_t>>(block_size_));
+        range.data = fetched.back()->data();
+      }
+      file_->read_many(misses, 0);
+
+      size_t miss = 0;
+      for (uint64_t block = first_block; block <= last_block; ++block) {
+        CachedBlock& cached = blocks[block - first_block];
+        if (cached) {
+          continue;
+        }
+        const ReadRange& range = misses[miss];
+        std::shared_ptr<std::vector<uint8_t>>& buffer = fetched[miss];
+        miss++;
+        if (range.result != StoreResult::Success &&
+            range.result != StoreResult::EndOfFile) {
+          return range.result;
+        }
+        buffer->resize(range.size_read);
+        buffer->shrink_to_fit();
+        cached = buffer;
+        cache_->insert(path, block, cached, generation);
+      }
+    }
+
+    for (uint64_t block = first_block; block <= last_block; ++block) {
+      const CachedBlock& cached = blocks[block - first_block];
+      uint64_t block_offset = block * block_size_;
+      uint64_t start = std::max(offset, block_offset) - block_offset;
+      if (start >= cached->size()) {
+        break;
+      }
+      size_t length =
+        std::min((uint64_t)cached->size() - start, size - size_read);
+      memcpy(data + size_read, cached->data() + start, length);
+      size_read += length;
+      if (cached->size() < block_size_) {
+        // A short block is the end of the file
+        break;
+      }
+    }
+    return size_read == size ? StoreResult::Success : StoreResult::EndOfFile;
+  }
+
+  StoreResult get_size(uint64_t& size) override {
+    return file_->get_size(size);
+  }
+
+  const std::string path() override { return file_->path(); }
+
+ private:
+  std::unique_ptr<RandomReadFile> file_;
+  std::shared_ptr<BlockCache> cache_;
+  const size_t block_size_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// CachingWriteFile
+class CachingWriteFile : public WriteFile {
+ public:
+  CachingWriteFile(WriteFile* file, std::shared_ptr<BlockCache> cache)
+      : file_(file), cache_(cache), path_(file->path()) {}
+
+  ~CachingWriteFile() {
+    // The wrapped file saves on destruction
+    file_.reset();
+    cache_->invalidate(path_);
+  }
+
+  StoreResult append(size_t size, const uint8_t* data) override {
+    return file_->append(size, data);
+  }
+
+  StoreResult reserve(uint64_t size) override { return file_->reserve(size); }
+
+  StoreResult save() override {
+    StoreResult result = file_->save();
+    cache_->invalidate(path_);
+    return result;
+  }
+
+  const std::string path() override { return file_->path(); }
+
+ private:
+  std::unique_ptr<WriteFile> file_;
+  std::shared_ptr<BlockCache> cache_;
+  std::string path_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// CachingStorage
+CachingStorage::CachingStorage(StorageBackend* backend, size_t capacity_bytes,
+                               size_t block_size, size_t num_shards)
+    : backend_(backend),
+      cache_(new BlockCache(capacity_bytes, num_shards)),
+      block_size_(block_size) {
+  set_retry_policy(backend->retry_policy());
+}
+
+StoreResult CachingStorage::get_file_info(const std::string& name,
+                                          FileInfo& file_info) {
+  return backend_->get_file_info(name, file_info);
+}
+
+StoreResult CachingStorage::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  return backend_->get_file_info_many(names, file_infos, results);
+}
+
+StoreResult CachingStorage::make_random_read_file(const std::string& name,
+                                                  RandomReadFile*& file) {
+  RandomReadFile* base_file;
+  StoreResult result = backend_->make_random_read_file(name, base_file);
+  if (result != StoreResult::Success) {
+    return result;
+  }
+  file = new CachingRandomReadFile(base_file, cache_, block_size_);
+  return StoreResult::Success;
+}
+
+StoreResult CachingStorage::make_write_file(const std::string& name,
+                                            WriteFile*& file) {
+  WriteFile* base_file;
+  StoreResult result = backend_->make_write_file(name, base_file);
+  if (result != StoreResult::Success) {
+    return result;
+  }
+  file = new CachingWriteFile(base_file, cache_);
+  return StoreResult::Success;
+}
+
+StoreResult CachingStorage::make_dir(const std::string& name) {
+  return backend_->make_dir(name);
+}
+
+StoreResult CachingStorage::delete_file(const std::string& name) {
+  StoreResult result = backend_->delete_file(name);
+  cache_->invalidate(name);
+  return result;
+}
+
+StoreResult CachingStorage::delete_dir(const std::string& name,
+                                       bool recursive) {
+  StoreResult result = backend_->delete_dir(name, recursive);
+  cache_->invalidate_prefix(name + "/");
+  return result;
+}
+
+StoreResult CachingStorage::make_directory_listing(const std::string& name,
+                                                   bool recursive,
+                                                   DirectoryListing*& listing) {
+  return backend_->make_directory_listing(name, recursive, listing);
+}
+}
@@ -0,0 +1,68 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/cache/block_cache.h"
+#include "storehouse/storage_backend.h"
+
+#include <memory>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// CachingStorage
+/* Wraps another backend and serves RandomReadFile reads from an in-memory
+ * cache of fixed-size, block-aligned pieces of each file. Files written,
+ * deleted or removed through this backend are dropped from the cache; changes
+ * made by other processes are not seen until the blocks are evicted.
+ */
+class CachingStorage : public StorageBackend {
+ public:
+  /* Takes ownership of backend. */
+  CachingStorage(StorageBackend* backend, size_t capacity_bytes,
+                 size_t block_size = 1024 * 1024, size_t num_shards = 16);
+
+  StoreResult get_file_info(const std::string& name,
+                            FileInfo& file_info) override;
+
+  StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                 std::vector<FileInfo>& file_infos,
+                                 std::vector<StoreResult>& results) override;
+
+  StoreResult make_random_read_file(const std::string& name,
+                                    RandomReadFile*& file) override;
+
+  StoreResult make_write_file(const std::string& name,
+                              WriteFile*& file) override;
+
+  StoreResult make_dir(const std::string& name) override;
+
+  StoreResult delete_file(const std::string& name) override;
+
+  StoreResult delete_dir(const std::string& name,
+                         bool recursive = false) override;
+
+  StoreResult make_directory_listing(const std::string& name, bool recursive,
+                                     DirectoryListing*& listing) override;
+
+  CacheStats cache_stats() { return cache_->stats(); }
+
+ private:
+  std::unique_ptr<StorageBackend> backend_;
+  std::shared_ptr<BlockCache> cache_;
+  const size_t block_size_;
+};
+}
@@ -0,0 +1,499 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/cache/disk_cache_storage.h"
+#include "storehouse/thread_pool.h"
+#include "storehouse/util.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+namespace storehouse {
+
+namespace {
+
+// Block files record their full key ahead of the data, so a hash collision
+// is detected instead of served
+const uint32_t BLOCK_FILE_MAGIC = 0x53484443;  // "SHDC"
+
+// Hits only refresh a block's LRU timestamp when it is older than this, to
+// avoid a metadata write on every read of a hot block
+const time_t TOUCH_INTERVAL_SEC = 60;
+
+// Temp files older than this belong to writers that crashed
+const time_t STALE_TEMP_FILE_SEC = 60 * 60;
+
+uint64_t fnv1a(const std::string& data, uint64_t hash) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string hash_key(const std::string& key) {
+  char hex[33];
+  snprintf(hex, sizeof(hex), "%016llx%016llx",
+           (unsigned long long)fnv1a(key, 14695981039346656037ULL),
+           (unsigned long long)fnv1a(key, 0x9e3779b97f4a7c15ULL));
+  return std::string(hex);
+}
+
+bool pread_all(int fd, uint8_t* data, size_t size, off_t offset) {
+  while (size > 0) {
+    ssize_t n = pread(fd, data, size, offset);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool write_all(int fd, const uint8_t* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = write(fd, data, size);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+DiskCacheConfig checked_config(DiskCacheConfig config) {
+  if (config.block_size == 0) {
+    config.block_size = DiskCacheConfig().block_size;
+    LOG(WARNING) << "DiskCacheStorage: block_size must be positive, using "
+                 << config.block_size;
+  }
+  return config;
+}
+
+struct CachedFile {
+  std::string path;
+  time_t mtime;
+  uint64_t size;
+};
+
+void list_files(const std::string& directory, std::vector<CachedFile>& files) {
+  DIR* dir = opendir(directory.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string path = directory + "/" + entry->d_name;
+    struct stat stat_buf;
+    if (lstat(path.c_str(), &stat_buf) != 0) {
+      continue;
+    }
+    if (S_ISDIR(stat_buf.st_mode)) {
+      list_files(path, files);
+    } else if (S_ISREG(stat_buf.st_mode)) {
+      files.push_back({path, stat_buf.st_mtime, (uint64_t)stat_buf.st_size});
+    }
+  }
+  closedir(dir);
+}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// DiskCacheRandomReadFile
+class DiskCacheRandomReadFile : public RandomReadFile {
+ public:
+  DiskCacheRandomReadFile(DiskCacheStorage* storage, const std::string& name,
+                          const std::string& key, const std::string& etag,
+                          uint64_t size)
+      : storage_(storage), name_(name), key_(key), etag_(etag), size_(size) {}
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override {
+    size_read = 0;
+    if (size == 0) {
+      return StoreResult::Success;
+    }
+    if (offset >= size_) {
+      return StoreResult::EndOfFile;
+    }
+    const size_t block_size = storage_->config_.block_size;
+    uint64_t end = std::min(size_, offset + size);
+    uint64_t first_block = offset / block_size;
+    uint64_t last_block = (end - 1) / block_size;
+
+    std::vector<std::vector<uint8_t>> blocks(last_block - first_block + 1);
+    std::vector<ReadRange> misses;
+    std::vector<uint64_t> miss_blocks;
+    for (uint64_t block = first_block; block <= last_block; ++block) {
+      std::vector<uint8_t>& buffer = blocks[block - first_block];
+      uint64_t block_offset = block * block_size;
+      size_t length = std::min((uint64_t)block_size, size_ - block_offset);
+      if (storage_->read_block(key_, block, length, buffer)) {
+        storage_->hits_++;
+        continue;
+      }
+      storage_->misses_++;
+      buffer.resize(length);
+      ReadRange range;
+      range.offset = block_offset;
+      range.size = buffer.size();
+      range.data = buffer.data();
+      misses.push_back(range);
+      miss_blocks.push_back(block);
+    }
+
+    if (!misses.empty()) {
+      RandomReadFile* file;
+      StoreResult result = base_file(file);
+      if (result != StoreResult::Success) {
+        return result;
+      }
+      file->read_many(misses, 0);
+      for (size_t i = 0; i < misses.size(); ++i) {
+        if (misses[i].result != StoreResult::Success) {
+          // Includes a short read, which means the object no longer matches
+          // the size recorded for its ETag
+          return misses[i].result == StoreResult::EndOfFile
+                   ? StoreResult::TransientFailure
+                   : misses[i].result;
+        }
+      }
+      // The wrapped file is not pinned to the ETag in the key, so the
+      // object may have been overwritten at the same size since it was
+      // opened. Checking after the fetch covers every block it returned.
+      std::string etag;
+      result = file->get_etag(etag);
+      if (result == StoreResult::Success && etag.empty()) {
+        FileInfo file_info;
+        result = storage_->backend_->get_file_info(name_, file_info);
+        etag = file_info.etag;
+      }
+      if (result != StoreResult::Success) {
+        return result;
+      }
+      if (etag != etag_) {
+        LOG(WARNING) << "DiskCacheStorage: " << name_
+                     << " changed while being read, not caching it";
+        return StoreResult::TransientFailure;
+      }
+      for (size_t i = 0; i < misses.size(); ++i) {
+        storage_->write_block(key_, miss_blocks[i], misses[i].data,
+                              misses[i].size);
+      }
+    }
+
+    for (uint64_t block = first_block; block <= last_block; ++block) {
+      const std::vector<uint8_t>& buffer = blocks[block - first_block];
+      uint64_t block_offset = block * block_size;
+      uint64_t start = std::max(offset, block_offset) - block_offset;
+      size_t length = std::min((uint64_t)buffer.size() - start,
+                               end - block_offset - start);
+      memcpy(data + size_read, buffer.data() + start, length);
+      size_read += length;
+    }
+    return size_read == size ? StoreResult::Success : StoreResult::EndOfFile;
+  }
+
+  StoreResult get_size(uint64_t& size) override {
+    size = size_;
+    return StoreResult::Success;
+  }
+
+  const std::string path() override { return name_; }
+
+ private:
+  DiskCacheStorage* storage_;
+  const std::string name_;
+  const std::string key_;
+  const std::string etag_;
+  const uint64_t size_;
+
+  std::mutex mutex_;
+  std::unique_ptr<RandomReadFile> file_;
+
+  // The wrapped file is only opened once a block has to be fetched
+  StoreResult base_file(RandomReadFile*& file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!file_) {
+      RandomReadFile* opened;
+      StoreResult result =
+        storage_->backend_->make_random_read_file(name_, opened);
+      if (result != StoreResult::Success) {
+        return result;
+      }
+      file_.reset(opened);
+    }
+    file = file_.get();
+    return StoreResult::Success;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// DiskCacheStorage
+DiskCacheStorage::DiskCacheStorage(StorageBackend* backend,
+                                   DiskCacheConfig config)
+    : backend_(backend),
+      config_(checked_config(config)),
+      // Start due for eviction so every process enforces the capacity at
+      // least once, even if it only writes a few blocks
+      bytes_since_evict_(config.capacity_bytes),
+      hits_(0),
+      misses_(0),
+      evictions_(0),
+      evicting_(false) {
+  set_retry_policy(backend->retry_policy());
+  LOG_IF(WARNING, mkdir_p((config_.directory + "/tmp").c_str(), S_IRWXU) != 0)
+    << "DiskCacheStorage: could not create cache directory "
+    << config_.directory << ": " << strerror(errno);
+}
+
+DiskCacheStorage::~DiskCacheStorage() {
+  std::unique_lock<std::mutex> lock(evict_mutex_);
+  evict_cv_.wait(lock, [this] { return !evicting_; });
+}
+
+StoreResult DiskCacheStorage::get_file_info(const std::string& name,
+                                            FileInfo& file_info) {
+  return backend_->get_file_info(name, file_info);
+}
+
+StoreResult DiskCacheStorage::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  return backend_->get_file_info_many(names, file_infos, results);
+}
+
+StoreResult DiskCacheStorage::make_random_read_file(const std::string& name,
+                                                    RandomReadFile*& file) {
+  FileInfo file_info;
+  StoreResult result = backend_->get_file_info(name, file_info);
+  if (result != StoreResult::Success) {
+    return result;
+  }
+  if (file_info.etag.empty()) {
+    // Without a version there is no way to tell if cached blocks are stale
+    return backend_->make_random_read_file(name, file);
+  }
+  std::string key = config_.cache_namespace;
+  key.push_back('\0');
+  key += name;
+  key.push_back('\0');
+  key += file_info.etag;
+  // Processes sharing the directory may cut objects into other block sizes
+  key.push_back('\0');
+  key += std::to_string(config_.block_size);
+  file = new DiskCacheRandomReadFile(this, name, key, file_info.etag,
+                                     file_info.size);
+  return StoreResult::Success;
+}
+
+StoreResult DiskCacheStorage::make_write_file(const std::string& name,
+                                              WriteFile*& file) {
+  // Saving changes the ETag, which retires the old blocks on its own
+  return backend_->make_write_file(name, file);
+}
+
+StoreResult DiskCacheStorage::make_dir(const std::string& name) {
+  return backend_->make_dir(name);
+}
+
+StoreResult DiskCacheStorage::delete_file(const std::string& name) {
+  return backend_->delete_file(name);
+}
+
+StoreResult DiskCacheStorage::delete_dir(const std::string& name,
+                                         bool recursive) {
+  return backend_->delete_dir(name, recursive);
+}
+
+StoreResult DiskCacheStorage::make_directory_listing(
+  const std::string& name, bool recursive, DirectoryListing*& listing) {
+  return backend_->make_directory_listing(name, recursive, listing);
+}
+
+CacheStats DiskCacheStorage::cache_stats() {
+  std::vector<CachedFile> files;
+  list_files(config_.directory + "/blocks", files);
+  CacheStats stats = {hits_, misses_, evictions_, 0};
+  for (const CachedFile& file : files) {
+    stats.bytes += file.size;
+  }
+  return stats;
+}
+
+void DiskCacheStorage::evict() {
+  // Reset even if another process turns out to be evicting, or every block
+  // written meanwhile would queue another attempt
+  bytes_since_evict_ = 0;
+  std::string lock_path = config_.directory + "/lock";
+  int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (lock_fd < 0) {
+    LOG(WARNING) << "DiskCacheStorage: could not open " << lock_path << ": "
+                 << strerror(errno);
+    return;
+  }
+  // Another process holding the lock is already evicting
+  if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    close(lock_fd);
+    return;
+  }
+
+  time_t now = time(NULL);
+  std::vector<CachedFile> temp_files;
+  list_files(config_.directory + "/tmp", temp_files);
+  for (const CachedFile& file : temp_files) {
+    if (now - file.mtime > STALE_TEMP_FILE_SEC) {
+      unlink(file.path.c_str());
+    }
+  }
+
+  std::vector<CachedFile> files;
+  list_files(config_.directory + "/blocks", files);
+  uint64_t total = 0;
+  for (const CachedFile& file : files) {
+    total += file.size;
+  }
+  if (total > config_.capacity_bytes) {
+    // Evict down to a low watermark so the next pass is not due right away
+    uint64_t target = config_.capacity_bytes - config_.capacity_bytes / 10;
+    std::sort(files.begin(), files.end(),
+              [](const CachedFile& a, const CachedFile& b) {
+                return a.mtime < b.mtime;
+              });
+    for (const CachedFile& file : files) {
+      if (total <= target) {
+        break;
+      }
+      // Readers that already opened the block keep their open descriptor
+      if (unlink(file.path.c_str()) == 0) {
+        total -= file.size;
+        evictions_++;
+      }
+    }
+  }
+
+  flock(lock_fd, LOCK_UN);
+  close(lock_fd);
+}
+
+std::string DiskCacheStorage::block_path(const std::string& key,
+                                         uint64_t block) {
+  std::string hash = hash_key(key);
+  return config_.directory + "/blocks/" + hash.substr(0, 2) + "/" + hash +
+         "." + std::to_string(block);
+}
+
+bool DiskCacheStorage::read_block(const std::string& key, uint64_t block,
+                                  size_t size, std::vector<uint8_t>& data) {
+  std::string path = block_path(key, block);
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool valid = false;
+  // A block of someone else's key only means the hashes collided
+  bool corrupt = true;
+  struct stat stat_buf;
+  uint32_t header[2];
+  off_t data_offset = sizeof(header) + key.size();
+  if (fstat(fd, &stat_buf) == 0 &&
+      pread_all(fd, (uint8_t*)header, sizeof(header), 0) &&
+      header[0] == BLOCK_FILE_MAGIC && header[1] == key.size()) {
+    std::string stored_key(key.size(), '\0');
+    if (pread_all(fd, (uint8_t*)&stored_key[0], key.size(), sizeof(header))) {
+      corrupt = stored_key == key;
+      // Anything but the exact length is a block cut short by a crash
+      if (stored_key == key && stat_buf.st_size == data_offset + (off_t)size) {
+        data.resize(size);
+        valid = pread_all(fd, data.data(), size, data_offset);
+      }
+    }
+  }
+  if (valid && time(NULL) - stat_buf.st_mtime > TOUCH_INTERVAL_SEC) {
+    // The modification time doubles as the LRU timestamp
+    futimens(fd, NULL);
+  }
+  close(fd);
+  if (!valid && corrupt) {
+    LOG(WARNING) << "DiskCacheStorage: deleting damaged block " << path;
+    unlink(path.c_str());
+  }
+  return valid;
+}
+
+void DiskCacheStorage::write_block(const std::string& key, uint64_t block,
+                                   const uint8_t* data, size_t size) {
+  std::string path = block_path(key, block);
+  if (mkdir_p(dirname_s(path).c_str(), S_IRWXU) != 0) {
+    LOG(WARNING) << "DiskCacheStorage: could not create directory for "
+                 << path << ": " << strerror(errno);
+    return;
+  }
+
+  std::string temp_path = config_.directory + "/tmp/blockXXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    LOG(WARNING) << "DiskCacheStorage: could not create temp file in "
+                 << config_.directory << ": " << strerror(errno);
+    return;
+  }
+  uint32_t header[2] = {BLOCK_FILE_MAGIC, (uint32_t)key.size()};
+  bool written = write_all(fd, (const uint8_t*)header, sizeof(header)) &&
+                 write_all(fd, (const uint8_t*)key.data(), key.size()) &&
+                 write_all(fd, data, size);
+  // Synced before the rename so a crash cannot leave a short block in place
+  written = written && fdatasync(fd) == 0;
+  close(fd);
+  if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+    LOG(WARNING) << "DiskCacheStorage: could not write block " << path << ": "
+                 << strerror(errno);
+    unlink(temp_path.c_str());
+    return;
+  }
+
+  bytes_since_evict_ += size;
+  if (bytes_since_evict_ > config_.capacity_bytes / 16) {
+    schedule_evict();
+  }
+}
+
+void DiskCacheStorage::schedule_evict() {
+  std::lock_guard<std::mutex> lock(evict_mutex_);
+  if (evicting_) {
+    return;
+  }
+  evicting_ = true;
+  // Scanning and unlinking would otherwise stall the read that missed
+  io_executor()->enqueue([this] {
+    evict();
+    std::lock_guard<std::mutex> lock(evict_mutex_);
+    evicting_ = false;
+    evict_cv_.notify_all();
+  });
+}
+}
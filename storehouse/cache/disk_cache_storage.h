@@ -0,0 +1,128 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/cache/block_cache.h"
+#include "storehouse/storage_backend.h"
+#include "storehouse/storage_config.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace storehouse {
+
+struct DiskCacheConfig : public StorageConfig {
+  // Config of the backend whose objects are cached
+  std::shared_ptr<StorageConfig> base_config;
+  // Distinguishes objects of different buckets or endpoints sharing one
+  // cache directory, e.g. "s3://endpoint/bucket"
+  std::string cache_namespace;
+  std::string directory;
+  uint64_t capacity_bytes = 10ULL * 1024 * 1024 * 1024;
+  size_t block_size = 4 * 1024 * 1024;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// DiskCacheStorage
+/* Wraps a remote backend and keeps the blocks it reads in a directory on
+ * local disk, so later jobs on the same node read them from there instead of
+ * the network.
+ *
+ * Blocks are keyed by namespace, object name, ETag and block size, so a
+ * changed object is never served from stale blocks and caches with other
+ * block sizes can share a directory; objects without an ETag are not cached.
+ * Fetched blocks are only cached and returned once the object is seen to
+ * still have that ETag, so an overwrite during a read fails it with
+ * TransientFailure instead of mixing versions.
+ * Each block is its own file, written to a temp file, synced and renamed
+ * into place, so the directory itself is the index. A block file whose
+ * length is not that of its block is treated as a miss and deleted. Any
+ * number of processes may share a directory.
+ * When the blocks written by a process exceed a fraction of the capacity it
+ * queues an eviction on the io_executor, which takes an flock on the
+ * directory and deletes the least recently used blocks until the total is
+ * below the capacity. At most one eviction per backend is queued at a time.
+ */
+class DiskCacheStorage : public StorageBackend {
+ public:
+  /* Takes ownership of backend. */
+  DiskCacheStorage(StorageBackend* backend, DiskCacheConfig config);
+
+  /* Waits for a queued eviction to finish. */
+  ~DiskCacheStorage();
+
+  StoreResult get_file_info(const std::string& name,
+                            FileInfo& file_info) override;
+
+  StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                 std::vector<FileInfo>& file_infos,
+                                 std::vector<StoreResult>& results) override;
+
+  StoreResult make_random_read_file(const std::string& name,
+                                    RandomReadFile*& file) override;
+
+  StoreResult make_write_file(const std::string& name,
+                              WriteFile*& file) override;
+
+  StoreResult make_dir(const std::string& name) override;
+
+  StoreResult delete_file(const std::string& name) override;
+
+  StoreResult delete_dir(const std::string& name,
+                         bool recursive = false) override;
+
+  StoreResult make_directory_listing(const std::string& name, bool recursive,
+                                     DirectoryListing*& listing) override;
+
+  CacheStats cache_stats();
+
+  /* Deletes least recently used blocks until the cache fits its capacity. */
+  void evict();
+
+ private:
+  friend class DiskCacheRandomReadFile;
+
+  std::string block_path(const std::string& key, uint64_t block);
+
+  /* read_block
+   *
+   * Reads a cached block into data if there is one of exactly size bytes.
+   * Blocks of any other length are deleted.
+   */
+  bool read_block(const std::string& key, uint64_t block, size_t size,
+                  std::vector<uint8_t>& data);
+
+  void write_block(const std::string& key, uint64_t block,
+                   const uint8_t* data, size_t size);
+
+  /* Queues evict on the io_executor unless it is already queued. */
+  void schedule_evict();
+
+  std::unique_ptr<StorageBackend> backend_;
+  const DiskCacheConfig config_;
+  std::atomic<uint64_t> bytes_since_evict_;
+  std::atomic<uint64_t> hits_;
+  std::atomic<uint64_t> misses_;
+  std::atomic<uint64_t> evictions_;
+
+  std::mutex evict_mutex_;
+  std::condition_variable evict_cv_;
+  // Set while an eviction is queued or running on the io_executor
+  bool evicting_;
+};
+}
@@ -0,0 +1,390 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/instrumented_storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+namespace storehouse {
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+typedef std::vector<std::shared_ptr<StorageObserver>> ObserverList;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// Instrumentation
+/* Records calls in the metrics and passes them on to the observers. Shared by
+ * an InstrumentedStorage and everything it opens.
+ */
+class Instrumentation {
+ public:
+  struct Call {
+    StorageOperation operation;
+    Clock::time_point start;
+    // The observers installed when the call started, or null if none were
+    const ObserverList* observers;
+    uint64_t id;
+    // Points into the caller's arguments or the file, both of which outlive
+    // the call
+    const std::string* path;
+    uint64_t offset;
+    uint64_t size;
+    std::string caller;
+  };
+
+  Instrumentation()
+      : metrics(std::make_shared<StorageMetrics>()),
+        observers_(nullptr),
+        next_id_(0) {}
+
+  Call start(StorageOperation operation, const std::string& path,
+             uint64_t offset = 0, uint64_t size = 0) {
+    Call call;
+    call.operation = operation;
+    call.observers = observers_.load(std::memory_order_acquire);
+    call.id = 0;
+    call.path = &path;
+    call.offset = offset;
+    call.size = size;
+    if (call.observers != nullptr) {
+      call.id = next_id_++;
+      call.caller = StorageCallerScope::current();
+      StorageEvent event = {call.id,     operation, path,
+                            call.caller, offset,    size,
+                            StoreResult::Success, 0, Clock::duration::zero()};
+      for (const std::shared_ptr<StorageObserver>& observer :
+           *call.observers) {
+        observer->on_start(event);
+      }
+    }
+    // Started after the observers so their cost is not counted
+    call.start = Clock::now();
+    return call;
+  }
+
+  StoreResult end(const Call& call, StoreResult result, uint64_t bytes = 0) {
+    Clock::duration duration = Clock::now() - call.start;
+    metrics->record(call.operation, result, bytes, duration);
+    if (call.observers != nullptr) {
+      StorageEvent event = {call.id,     call.operation, *call.path,
+                            call.caller, call.offset,    call.size,
+                            result,      bytes,          duration};
+      for (const std::shared_ptr<StorageObserver>& observer :
+           *call.observers) {
+        observer->on_end(event);
+      }
+    }
+    return result;
+  }
+
+  void add_observer(std::shared_ptr<StorageObserver> observer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const ObserverList* current = observers_.load();
+    ObserverList* observers =
+      current != nullptr ? new ObserverList(*current) : new ObserverList;
+    observers->push_back(observer);
+    publish(observers);
+  }
+
+  void remove_observer(const std::shared_ptr<StorageObserver>& observer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const ObserverList* current = observers_.load();
+    if (current == nullptr) {
+      return;
+    }
+    ObserverList* observers = new ObserverList(*current);
+    observers->erase(
+      std::remove(observers->begin(), observers->end(), observer),
+      observers->end());
+    publish(observers);
+  }
+
+  std::shared_ptr<StorageMetrics> metrics;
+
+ private:
+  // Installs observers as the current list; called with mutex_ held
+  void publish(ObserverList* observers) {
+    versions_.emplace_back(observers);
+    observers_.store(observers->empty() ? nullptr : observers,
+                     std::memory_order_release);
+  }
+
+  std::mutex mutex_;
+  // Every list ever installed. Calls in flight may still be using an old
+  // one, and observers change rarely, so none are freed before this is.
+  std::vector<std::unique_ptr<ObserverList>> versions_;
+  std::atomic<const ObserverList*> observers_;
+  std::atomic<uint64_t> next_id_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// InstrumentedRandomReadFile
+class InstrumentedRandomReadFile : public RandomReadFile {
+ public:
+  InstrumentedRandomReadFile(RandomReadFile* file, const std::string& name,
+                             std::shared_ptr<Instrumentation> instrumentation)
+      : file_(file), name_(name), instrumentation_(instrumentation) {}
+
+  using RandomReadFile::read;
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override {
+    auto call =
+      instrumentation_->start(StorageOperation::Read, name_, offset, size);
+    StoreResult result = file_->read(offset, size, data, size_read);
+    return instrumentation_->end(call, result, size_read);
+  }
+
+  void read_async(uint64_t offset, size_t size, uint8_t* data,
+                  ReadCallback callback) override {
+    std::shared_ptr<Instrumentation> instrumentation = instrumentation_;
+    auto call = instrumentation_->start(StorageOperation::ReadAsync, name_,
+                                        offset, size);
+    file_->read_async(offset, size, data, [instrumentation, call, callback](
+                                            StoreResult result,
+                                            size_t size_read) {
+      instrumentation->end(call, result, size_read);
+      callback(result, size_read);
+    });
+  }
+
+  StoreResult read_many(std::vector<ReadRange>& ranges,
+                        size_t max_gap = DEFAULT_READ_MANY_GAP) override {
+    // Reported as the span the ranges cover
+    uint64_t begin = ranges.empty() ? 0 : ranges[0].offset;
+    uint64_t end = begin;
+    for (const ReadRange& range : ranges) {
+      begin = std::min(begin, range.offset);
+      end = std::max(end, range.offset + range.size);
+    }
+    auto call = instrumentation_->start(StorageOperation::ReadMany, name_,
+                                        begin, end - begin);
+    StoreResult result = file_->read_many(ranges, max_gap);
+    uint64_t bytes = 0;
+    for (const ReadRange& range : ranges) {
+      bytes += range.size_read;
+    }
+    return instrumentation_->end(call, result, bytes);
+  }
+
+  StoreResult read_view(uint64_t offset, size_t size,
+                        ReadView& view) override {
+    auto call =
+      instrumentation_->start(StorageOperation::ReadView, name_, offset, size);
+    StoreResult result = file_->read_view(offset, size, view);
+    uint64_t bytes = (result == StoreResult::Success ||
+                      result == StoreResult::EndOfFile)
+                       ? view.size
+                       : 0;
+    return instrumentation_->end(call, result, bytes);
+  }
+
+  StoreResult get_size(uint64_t& size) override {
+    auto call = instrumentation_->start(StorageOperation::GetSize, name_);
+    return instrumentation_->end(call, file_->get_size(size));
+  }
+
+  StoreResult get_etag(std::string& etag) override {
+    return file_->get_etag(etag);
+  }
+
+  const std::string path() override { return file_->path(); }
+
+ private:
+  std::unique_ptr<RandomReadFile> file_;
+  const std::string name_;
+  std::shared_ptr<Instrumentation> instrumentation_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// InstrumentedWriteFile
+class InstrumentedWriteFile : public WriteFile {
+ public:
+  InstrumentedWriteFile(WriteFile* file, const std::string& name,
+                        std::shared_ptr<Instrumentation> instrumentation)
+      : file_(file),
+        name_(name),
+        instrumentation_(instrumentation),
+        appended_(0) {}
+
+  using WriteFile::append;
+
+  StoreResult append(size_t size, const uint8_t* data) override {
+    auto call = instrumentation_->start(StorageOperation::Append, name_,
+                                        appended_, size);
+    StoreResult result = file_->append(size, data);
+    if (result == StoreResult::Success) {
+      appended_ += size;
+    }
+    return instrumentation_->end(
+      call, result, result == StoreResult::Success ? size : 0);
+  }
+
+  StoreResult reserve(uint64_t size) override {
+    auto call =
+      instrumentation_->start(StorageOperation::Reserve, name_, 0, size);
+    return instrumentation_->end(call, file_->reserve(size));
+  }
+
+  StoreResult save() override {
+    auto call =
+      instrumentation_->start(StorageOperation::Save, name_, 0, appended_);
+    return instrumentation_->end(call, file_->save());
+  }
+
+  using WriteFile::save_async;
+
+  void save_async(SaveCallback callback) override {
+    std::shared_ptr<Instrumentation> instrumentation = instrumentation_;
+    auto call = instrumentation_->start(StorageOperation::SaveAsync, name_, 0,
+                                        appended_);
+    file_->save_async([instrumentation, call, callback](StoreResult result) {
+      instrumentation->end(call, result);
+      callback(result);
+    });
+  }
+
+  const std::string path() override { return file_->path(); }
+
+ private:
+  std::unique_ptr<WriteFile> file_;
+  const std::string name_;
+  std::shared_ptr<Instrumentation> instrumentation_;
+  // Bytes appended so far, reported as the offset of the next append
+  uint64_t appended_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// InstrumentedDirectoryListing
+class InstrumentedDirectoryListing : public DirectoryListing {
+ public:
+  InstrumentedDirectoryListing(
+    DirectoryListing* listing, const std::string& name,
+    std::shared_ptr<Instrumentation> instrumentation)
+      : listing_(listing), name_(name), instrumentation_(instrumentation) {}
+
+  StoreResult next_page(std::vector<DirectoryEntry>& entries) override {
+    auto call = instrumentation_->start(StorageOperation::ListPage, name_);
+    return instrumentation_->end(call, listing_->next_page(entries));
+  }
+
+ private:
+  std::unique_ptr<DirectoryListing> listing_;
+  const std::string name_;
+  std::shared_ptr<Instrumentation> instrumentation_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// InstrumentedStorage
+InstrumentedStorage::InstrumentedStorage(StorageBackend* backend)
+    : backend_(backend), instrumentation_(new Instrumentation) {
+  set_retry_policy(backend->retry_policy());
+}
+
+StoreResult InstrumentedStorage::get_file_info(const std::string& name,
+                                               FileInfo& file_info) {
+  auto call = instrumentation_->start(StorageOperation::GetFileInfo, name);
+  return instrumentation_->end(call, backend_->get_file_info(name, file_info));
+}
+
+StoreResult InstrumentedStorage::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  // Reported under a label for the whole batch, so observers matching on
+  // the path do not take it for a call on just the first name
+  const std::string label = "<" + std::to_string(names.size()) + " names>";
+  auto call = instrumentation_->start(StorageOperation::GetFileInfoMany,
+                                      label, 0, names.size());
+  return instrumentation_->end(
+    call, backend_->get_file_info_many(names, file_infos, results));
+}
+
+StoreResult InstrumentedStorage::make_random_read_file(
+  const std::string& name, RandomReadFile*& file) {
+  auto call =
+    instrumentation_->start(StorageOperation::MakeRandomReadFile, name);
+  RandomReadFile* base;
+  StoreResult result = backend_->make_random_read_file(name, base);
+  if (result == StoreResult::Success) {
+    file = new InstrumentedRandomReadFile(base, name, instrumentation_);
+  }
+  return instrumentation_->end(call, result);
+}
+
+StoreResult InstrumentedStorage::make_write_file(const std::string& name,
+                                                 WriteFile*& file) {
+  auto call = instrumentation_->start(StorageOperation::MakeWriteFile, name);
+  WriteFile* base;
+  StoreResult result = backend_->make_write_file(name, base);
+  if (result == StoreResult::Success) {
+    file = new InstrumentedWriteFile(base, name, instrumentation_);
+  }
+  return instrumentation_->end(call, result);
+}
+
+StoreResult InstrumentedStorage::make_dir(const std::string& name) {
+  auto call = instrumentation_->start(StorageOperation::MakeDir, name);
+  return instrumentation_->end(call, backend_->make_dir(name));
+}
+
+StoreResult InstrumentedStorage::delete_file(const std::string& name) {
+  auto call = instrumentation_->start(StorageOperation::DeleteFile, name);
+  return instrumentation_->end(call, backend_->delete_file(name));
+}
+
+StoreResult InstrumentedStorage::delete_dir(const std::string& name,
+                                            bool recursive) {
+  auto call = instrumentation_->start(StorageOperation::DeleteDir, name);
+  return instrumentation_->end(call, backend_->delete_dir(name, recursive));
+}
+
+StoreResult InstrumentedStorage::make_directory_listing(
+  const std::string& name, bool recursive, DirectoryListing*& listing) {
+  auto call =
+    instrumentation_->start(StorageOperation::MakeDirectoryListing, name);
+  DirectoryListing* base;
+  StoreResult result =
+    backend_->make_directory_listing(name, recursive, base);
+  if (result == StoreResult::Success) {
+    listing = new InstrumentedDirectoryListing(base, name, instrumentation_);
+  }
+  return instrumentation_->end(call, result);
+}
+
+MetricsSnapshot InstrumentedStorage::metrics_snapshot() const {
+  MetricsSnapshot snapshot = instrumentation_->metrics->snapshot();
+  snapshot.retries = retry_policy()->stats();
+  return snapshot;
+}
+
+std::shared_ptr<StorageMetrics> InstrumentedStorage::metrics() const {
+  return instrumentation_->metrics;
+}
+
+void InstrumentedStorage::add_observer(
+  std::shared_ptr<StorageObserver> observer) {
+  instrumentation_->add_observer(observer);
+}
+
+void InstrumentedStorage::remove_observer(
+  const std::shared_ptr<StorageObserver>& observer) {
+  instrumentation_->remove_observer(observer);
+}
+}
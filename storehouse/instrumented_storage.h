@@ -0,0 +1,87 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/metrics.h"
+#include "storehouse/storage_backend.h"
+#include "storehouse/storage_observer.h"
+
+#include <memory>
+
+namespace storehouse {
+
+class Instrumentation;
+
+////////////////////////////////////////////////////////////////////////////////
+/// InstrumentedStorage
+/* Wraps another backend and records every call on it, and on the files and
+ * listings it hands out, in a StorageMetrics, and reports the calls to any
+ * installed StorageObservers. make_from_config applies it to configs with
+ * metrics or slow_operation_ms set. Files and listings keep the metrics
+ * alive, so they may be read after the backend is gone.
+ */
+class InstrumentedStorage : public StorageBackend {
+ public:
+  /* Takes ownership of backend. */
+  InstrumentedStorage(StorageBackend* backend);
+
+  StoreResult get_file_info(const std::string& name,
+                            FileInfo& file_info) override;
+
+  StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                 std::vector<FileInfo>& file_infos,
+                                 std::vector<StoreResult>& results) override;
+
+  StoreResult make_random_read_file(const std::string& name,
+                                    RandomReadFile*& file) override;
+
+  StoreResult make_write_file(const std::string& name,
+                              WriteFile*& file) override;
+
+  StoreResult make_dir(const std::string& name) override;
+
+  StoreResult delete_file(const std::string& name) override;
+
+  StoreResult delete_dir(const std::string& name,
+                         bool recursive = false) override;
+
+  StoreResult make_directory_listing(const std::string& name, bool recursive,
+                                     DirectoryListing*& listing) override;
+
+  /* metrics_snapshot
+   *
+   * Operation metrics so far, along with the counts of the retry policy.
+   */
+  MetricsSnapshot metrics_snapshot() const;
+
+  std::shared_ptr<StorageMetrics> metrics() const;
+
+  /* add_observer
+   *
+   * Reports calls to observer from now on, including calls on files and
+   * listings that are already open. Until an observer is added, calls pay
+   * only for one atomic load.
+   */
+  void add_observer(std::shared_ptr<StorageObserver> observer);
+
+  void remove_observer(const std::shared_ptr<StorageObserver>& observer);
+
+ private:
+  std::unique_ptr<StorageBackend> backend_;
+  // Shared with the files and listings
+  std::shared_ptr<Instrumentation> instrumentation_;
+};
+}
@@ -0,0 +1,501 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/memory/memory_storage.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace storehouse {
+
+namespace {
+
+const uint64_t MIN_CHUNK_SIZE = 4096;
+
+// Entries returned by each next_page
+const size_t LISTING_PAGE_SIZE = 1000;
+
+std::atomic<uint64_t> next_version(1);
+
+int64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::system_clock::now().time_since_epoch())
+    .count();
+}
+
+// Names are looked up without a trailing slash, so "dir/" means "dir"
+std::string normalize(const std::string& name) {
+  size_t end = name.find_last_not_of('/');
+  return end == std::string::npos ? "" : name.substr(0, end + 1);
+}
+
+std::string folder_prefix(const std::string& name) {
+  return name.empty() ? "" : name + "/";
+}
+
+// The smallest key after every key under folder_key, which ends in '/'
+std::string past_folder(const std::string& folder_key) {
+  std::string key = folder_key;
+  key.back() = '/' + 1;
+  return key;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryChunk
+/* A fixed buffer appends are copied into. A saved file only covers bytes
+ * that have already been written, and later appends only write past them,
+ * so readers and the writer never touch the same bytes.
+ */
+struct MemoryChunk {
+  MemoryChunk(uint64_t capacity)
+      : data(new uint8_t[capacity]), capacity(capacity) {}
+
+  std::unique_ptr<uint8_t[]> data;
+  const uint64_t capacity;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryFile
+/* The contents of a file as of one save. Every chunk but the last is full. */
+struct MemoryFile {
+  uint64_t size;
+  std::vector<std::shared_ptr<MemoryChunk>> chunks;
+  // Offset in the file of the first byte of each chunk
+  std::vector<uint64_t> chunk_offsets;
+  std::string etag;
+  int64_t mtime;
+
+  size_t chunk_index(uint64_t offset) const {
+    return std::upper_bound(chunk_offsets.begin(), chunk_offsets.end(),
+                            offset) -
+           chunk_offsets.begin() - 1;
+  }
+
+  void copy(uint64_t offset, size_t size, uint8_t* data) const {
+    for (size_t i = chunk_index(offset); size > 0; ++i) {
+      uint64_t start = offset - chunk_offsets[i];
+      size_t n = std::min((uint64_t)size, chunks[i]->capacity - start);
+      memcpy(data, chunks[i]->data.get() + start, n);
+      offset += n;
+      data += n;
+      size -= n;
+    }
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryFiles
+class MemoryFiles {
+ public:
+  struct Shard {
+    std::mutex mutex;
+    // Folders made with make_dir are kept under their name and a trailing
+    // '/', with no file
+    std::map<std::string, std::shared_ptr<const MemoryFile>> files;
+  };
+
+  MemoryFiles(uint32_t num_shards) : shards(std::max(num_shards, 1u)) {}
+
+  Shard& shard_for(const std::string& key) {
+    return shards[std::hash<std::string>()(key) % shards.size()];
+  }
+
+  std::shared_ptr<const MemoryFile> find(const std::string& name) {
+    Shard& shard = shard_for(name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.files.find(name);
+    return it == shard.files.end() ? nullptr : it->second;
+  }
+
+  // Whether any file or folder has a name starting with prefix
+  bool has_prefix(const std::string& prefix) {
+    for (Shard& shard : shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.files.lower_bound(prefix);
+      if (it != shard.files.end() &&
+          it->first.compare(0, prefix.size(), prefix) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void publish(const std::string& name,
+               std::shared_ptr<const MemoryFile> file) {
+    Shard& shard = shard_for(name);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.files[name] = file;
+  }
+
+  std::vector<Shard> shards;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryRandomReadFile
+class MemoryRandomReadFile : public RandomReadFile {
+ public:
+  MemoryRandomReadFile(const std::string& name,
+                       std::shared_ptr<const MemoryFile> file)
+      : name_(name), file_(file) {}
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override {
+    size_read = available(offset, size);
+    file_->copy(offset, size_read, data);
+    return size_read < size ? StoreResult::EndOfFile : StoreResult::Success;
+  }
+
+  StoreResult read_many(std::vector<ReadRange>& ranges,
+                        size_t max_gap = DEFAULT_READ_MANY_GAP) override {
+    for (ReadRange& range : ranges) {
+      range.result =
+        read(range.offset, range.size, range.data, range.size_read);
+    }
+    return read_many_result(ranges);
+  }
+
+  StoreResult read_view(uint64_t offset, size_t size,
+                        ReadView& view) override {
+    view.size = available(offset, size);
+    if (view.size == 0) {
+      view.data = nullptr;
+      view.holder.reset();
+    } else {
+      // Only ranges that span chunks need copying into one buffer
+      size_t i = file_->chunk_index(offset);
+      uint64_t start = offset - file_->chunk_offsets[i];
+      if (start + view.size > file_->chunks[i]->capacity) {
+        return RandomReadFile::read_view(offset, size, view);
+      }
+      view.data = file_->chunks[i]->data.get() + start;
+      view.holder = file_->chunks[i];
+    }
+    return view.size < size ? StoreResult::EndOfFile : StoreResult::Success;
+  }
+
+  StoreResult get_size(uint64_t& size) override {
+    size = file_->size;
+    return StoreResult::Success;
+  }
+
+  StoreResult get_etag(std::string& etag) override {
+    etag = file_->etag;
+    return StoreResult::Success;
+  }
+
+  const std::string path() override { return name_; }
+
+ private:
+  size_t available(uint64_t offset, size_t size) {
+    return offset < file_->size ? std::min((uint64_t)size, file_->size - offset)
+                                : 0;
+  }
+
+  const std::string name_;
+  const std::shared_ptr<const MemoryFile> file_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryWriteFile
+class MemoryWriteFile : public WriteFile {
+ public:
+  MemoryWriteFile(const std::string& name, std::shared_ptr<MemoryFiles> files,
+                  uint64_t max_chunk_size)
+      : name_(name),
+        files_(files),
+        max_chunk_size_(std::max(max_chunk_size, MIN_CHUNK_SIZE)) {}
+
+  ~MemoryWriteFile() {
+    if (unsaved_) {
+      save();
+    }
+  }
+
+  StoreResult append(size_t size, const uint8_t* data) override {
+    while (size > 0) {
+      if (chunks_.empty() || room() == 0) {
+        add_chunk();
+      }
+      size_t n = std::min((uint64_t)size, room());
+      memcpy(chunks_.back()->data.get() + (size_ - chunk_offsets_.back()),
+             data, n);
+      size_ += n;
+      data += n;
+      size -= n;
+    }
+    unsaved_ = true;
+    return StoreResult::Success;
+  }
+
+  StoreResult reserve(uint64_t size) override {
+    reserved_ = std::max(reserved_, size);
+    return StoreResult::Success;
+  }
+
+  StoreResult save() override {
+    std::shared_ptr<MemoryFile> file(new MemoryFile);
+    file->size = size_;
+    file->chunks = chunks_;
+    file->chunk_offsets = chunk_offsets_;
+    file->etag = std::to_string(next_version++);
+    file->mtime = now_ns();
+    files_->publish(name_, file);
+    unsaved_ = false;
+    return StoreResult::Success;
+  }
+
+  const std::string path() override { return name_; }
+
+ private:
+  uint64_t capacity() const {
+    return chunks_.empty() ? 0
+                           : chunk_offsets_.back() + chunks_.back()->capacity;
+  }
+
+  uint64_t room() const { return capacity() - size_; }
+
+  // Chunks double with the file, and a reservation is made in one chunk
+  void add_chunk() {
+    uint64_t offset = capacity();
+    uint64_t chunk_size =
+      std::min(std::max(offset, MIN_CHUNK_SIZE), max_chunk_size_);
+    if (reserved_ > offset) {
+      chunk_size = std::max(chunk_size, reserved_ - offset);
+    }
+    chunks_.emplace_back(new MemoryChunk(chunk_size));
+    chunk_offsets_.push_back(offset);
+  }
+
+  const std::string name_;
+  const std::shared_ptr<MemoryFiles> files_;
+  const uint64_t max_chunk_size_;
+  std::vector<std::shared_ptr<MemoryChunk>> chunks_;
+  std::vector<uint64_t> chunk_offsets_;
+  uint64_t size_ = 0;
+  uint64_t reserved_ = 0;
+  // A new file is created by its first save even if nothing was appended
+  bool unsaved_ = true;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryDirectoryListing
+/* Walks every shard in name order from where the previous page ended and
+ * merges what they hold, so pages stay consistent while files are added or
+ * removed elsewhere in the folder.
+ */
+class MemoryDirectoryListing : public DirectoryListing {
+ public:
+  MemoryDirectoryListing(std::shared_ptr<MemoryFiles> files,
+                         const std::string& prefix, bool recursive)
+      : files_(files), prefix_(prefix), recursive_(recursive), next_(prefix) {}
+
+  StoreResult next_page(std::vector<DirectoryEntry>& entries) override {
+    entries.clear();
+    // Keyed like the files themselves, with folders ending in '/', so the
+    // merged order matches the order of each shard
+    std::map<std::string, std::shared_ptr<const MemoryFile>> merged;
+    for (MemoryFiles::Shard& shard : files_->shards) {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      size_t taken = 0;
+      auto it = shard.files.lower_bound(next_);
+      while (it != shard.files.end() && taken <= LISTING_PAGE_SIZE &&
+             it->first.compare(0, prefix_.size(), prefix_) == 0) {
+        const std::string& key = it->first;
+        size_t slash = key.find('/', prefix_.size());
+        if (recursive_ || slash == std::string::npos) {
+          // Folder markers are not files
+          if (key.back() != '/') {
+            merged.emplace(key, it->second);
+            taken++;
+          }
+          ++it;
+        } else {
+          std::string folder = key.substr(0, slash + 1);
+          merged.emplace(folder, nullptr);
+          taken++;
+          it = shard.files.lower_bound(past_folder(folder));
+        }
+      }
+    }
+
+    bool more = merged.size() > LISTING_PAGE_SIZE;
+    for (auto& entry : merged) {
+      if (entries.size() == LISTING_PAGE_SIZE) {
+        break;
+      }
+      entries.emplace_back();
+      DirectoryEntry& listed = entries.back();
+      listed.info.file_exists = true;
+      if (entry.second == nullptr) {
+        listed.name = entry.first.substr(0, entry.first.size() - 1);
+        listed.info.size = 0;
+        listed.info.file_is_folder = true;
+        listed.info.mtime = 0;
+        next_ = past_folder(entry.first);
+      } else {
+        listed.name = entry.first;
+        listed.info.size = entry.second->size;
+        listed.info.file_is_folder = false;
+        listed.info.etag = entry.second->etag;
+        listed.info.mtime = entry.second->mtime;
+        next_ = entry.first + '\0';
+      }
+    }
+    return more ? StoreResult::Success : StoreResult::EndOfFile;
+  }
+
+ private:
+  const std::shared_ptr<MemoryFiles> files_;
+  const std::string prefix_;
+  const bool recursive_;
+  // Smallest key the next page may start at
+  std::string next_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryStorage
+MemoryStorage::MemoryStorage(MemoryConfig config)
+    : config_(config), files_(new MemoryFiles(config.shards)) {}
+
+MemoryStorage::~MemoryStorage() {}
+
+StoreResult MemoryStorage::get_file_info(const std::string& name,
+                                         FileInfo& file_info) {
+  std::string key = normalize(name);
+  std::shared_ptr<const MemoryFile> file = files_->find(key);
+  file_info.etag.clear();
+  if (file != nullptr) {
+    file_info.size = file->size;
+    file_info.file_exists = true;
+    file_info.file_is_folder = false;
+    file_info.etag = file->etag;
+    file_info.mtime = file->mtime;
+    return StoreResult::Success;
+  }
+  file_info.size = 0;
+  file_info.mtime = 0;
+  file_info.file_is_folder = files_->has_prefix(folder_prefix(key));
+  file_info.file_exists = file_info.file_is_folder;
+  return file_info.file_exists ? StoreResult::Success
+                               : StoreResult::FileDoesNotExist;
+}
+
+StoreResult MemoryStorage::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  // Lookups are too cheap to be worth spreading over the io_executor
+  file_infos.assign(names.size(), FileInfo());
+  results.assign(names.size(), StoreResult::Success);
+  for (size_t i = 0; i < names.size(); ++i) {
+    results[i] = get_file_info(names[i], file_infos[i]);
+  }
+  return file_info_many_result(results);
+}
+
+StoreResult MemoryStorage::make_random_read_file(const std::string& name,
+                                                 RandomReadFile*& file) {
+  std::shared_ptr<const MemoryFile> contents = files_->find(normalize(name));
+  if (contents == nullptr) {
+    return StoreResult::FileDoesNotExist;
+  }
+  file = new MemoryRandomReadFile(name, contents);
+  return StoreResult::Success;
+}
+
+StoreResult MemoryStorage::make_write_file(const std::string& name,
+                                           WriteFile*& file) {
+  std::string key = normalize(name);
+  if (key.empty()) {
+    return StoreResult::SaveFailure;
+  }
+  file = new MemoryWriteFile(key, files_, config_.max_chunk_size);
+  return StoreResult::Success;
+}
+
+StoreResult MemoryStorage::make_dir(const std::string& name) {
+  std::string key = normalize(name);
+  if (key.empty() || files_->find(key) != nullptr ||
+      files_->has_prefix(key + "/")) {
+    return StoreResult::MkDirFailure;
+  }
+  files_->publish(key + "/", nullptr);
+  return StoreResult::Success;
+}
+
+StoreResult MemoryStorage::delete_file(const std::string& name) {
+  std::string key = normalize(name);
+  MemoryFiles::Shard& shard = files_->shard_for(key);
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  if (key.empty() || shard.files.erase(key) == 0) {
+    return StoreResult::FileDoesNotExist;
+  }
+  return StoreResult::Success;
+}
+
+StoreResult MemoryStorage::delete_dir(const std::string& name,
+                                      bool recursive) {
+  std::string prefix = folder_prefix(normalize(name));
+  if (!recursive) {
+    // Only an empty folder made with make_dir can be removed. Every shard
+    // stays locked until it is, so no file can be added to it in between.
+    // Nothing else holds two shard locks, and these are taken in order.
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (MemoryFiles::Shard& shard : files_->shards) {
+      locks.emplace_back(shard.mutex);
+      auto it = shard.files.lower_bound(prefix);
+      if (it != shard.files.end() && it->first == prefix) {
+        ++it;
+      }
+      if (it != shard.files.end() &&
+          it->first.compare(0, prefix.size(), prefix) == 0) {
+        return StoreResult::RemoveFailure;
+      }
+    }
+    MemoryFiles::Shard& shard = files_->shard_for(prefix);
+    if (prefix.empty() || shard.files.erase(prefix) == 0) {
+      return StoreResult::RemoveFailure;
+    }
+    return StoreResult::Success;
+  }
+
+  bool removed = false;
+  for (MemoryFiles::Shard& shard : files_->shards) {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto begin = shard.files.lower_bound(prefix);
+    auto end = begin;
+    while (end != shard.files.end() &&
+           end->first.compare(0, prefix.size(), prefix) == 0) {
+      ++end;
+    }
+    removed = removed || begin != end;
+    shard.files.erase(begin, end);
+  }
+  return removed ? StoreResult::Success : StoreResult::RemoveFailure;
+}
+
+StoreResult MemoryStorage::make_directory_listing(
+  const std::string& name, bool recursive, DirectoryListing*& listing) {
+  listing = new MemoryDirectoryListing(
+    files_, folder_prefix(normalize(name)), recursive);
+  return StoreResult::Success;
+}
+}
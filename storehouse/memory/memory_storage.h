@@ -0,0 +1,87 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/storage_backend.h"
+#include "storehouse/storage_config.h"
+
+#include <memory>
+#include <vector>
+
+namespace storehouse {
+
+struct MemoryConfig : public StorageConfig {
+  // Files are spread over this many independently locked maps by the hash
+  // of their name
+  uint32_t shards = 16;
+  // Appends fill chunks that start at 4KB and double with the size of the
+  // file up to this size, so a file never moves once written
+  uint64_t max_chunk_size = 1024 * 1024;
+};
+
+class MemoryFiles;
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryStorage
+/* Keeps files in memory for as long as the backend lives, as a scratch tier
+ * for intermediate results and as a baseline for the cost of the rest of the
+ * stack. Names are split into folders at '/' like on the other backends;
+ * folders exist while they hold files or after make_dir.
+ *
+ * Saved contents are immutable and reference counted, so readers take a
+ * snapshot of the file as of when they opened it, read_view hands out
+ * pointers into it, and neither ever waits for writers.
+ */
+class MemoryStorage : public StorageBackend {
+ public:
+  MemoryStorage(MemoryConfig config);
+
+  ~MemoryStorage();
+
+  StoreResult get_file_info(const std::string& name,
+                            FileInfo& file_info) override;
+
+  StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                 std::vector<FileInfo>& file_infos,
+                                 std::vector<StoreResult>& results) override;
+
+  StoreResult make_random_read_file(const std::string& name,
+                                    RandomReadFile*& file) override;
+
+  /* make_write_file
+   *
+   * The file appears when it is first saved, or when the handle is
+   * destroyed, and replaces whatever was at name before.
+   */
+  StoreResult make_write_file(const std::string& name,
+                              WriteFile*& file) override;
+
+  StoreResult make_dir(const std::string& name) override;
+
+  StoreResult delete_file(const std::string& name) override;
+
+  StoreResult delete_dir(const std::string& name,
+                         bool recursive = false) override;
+
+  StoreResult make_directory_listing(const std::string& name, bool recursive,
+                                     DirectoryListing*& listing) override;
+
+ private:
+  const MemoryConfig config_;
+  // Shared with write files and listings, which may outlive the backend
+  std::shared_ptr<MemoryFiles> files_;
+};
+}
@@ -0,0 +1,268 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/metrics.h"
+#include "storehouse/storage_backend.h"
+
+#include <algorithm>
+#include <sstream>
+
+namespace storehouse {
+
+namespace {
+
+const size_t SUB_BUCKET_BITS = 3;
+const size_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+// Spreads threads over the shards round robin, in the order they first
+// record something
+size_t shard_index(size_t num_shards) {
+  static std::atomic<size_t> next_shard(0);
+  static thread_local size_t shard = next_shard++;
+  return shard % num_shards;
+}
+
+void write_label(std::ostream& out, const std::string& name,
+                 const std::string& value) {
+  out << name << "=\"" << value << "\"";
+}
+
+}
+
+const size_t LatencyHistogramSnapshot::NUM_BUCKETS;
+const size_t StorageMetrics::NUM_SHARDS;
+const size_t StorageMetrics::NUM_RESULTS;
+
+static_assert((size_t)StoreResult::MkDirFailure + 1 == 9,
+              "StorageMetrics::NUM_RESULTS must match StoreResult");
+
+std::string storage_operation_to_string(StorageOperation operation) {
+  switch (operation) {
+    case StorageOperation::GetFileInfo:
+      return "get_file_info";
+    case StorageOperation::GetFileInfoMany:
+      return "get_file_info_many";
+    case StorageOperation::MakeRandomReadFile:
+      return "make_random_read_file";
+    case StorageOperation::MakeWriteFile:
+      return "make_write_file";
+    case StorageOperation::MakeDir:
+      return "make_dir";
+    case StorageOperation::DeleteFile:
+      return "delete_file";
+    case StorageOperation::DeleteDir:
+      return "delete_dir";
+    case StorageOperation::MakeDirectoryListing:
+      return "make_directory_listing";
+    case StorageOperation::ListPage:
+      return "list_page";
+    case StorageOperation::Read:
+      return "read";
+    case StorageOperation::ReadAsync:
+      return "read_async";
+    case StorageOperation::ReadMany:
+      return "read_many";
+    case StorageOperation::ReadView:
+      return "read_view";
+    case StorageOperation::GetSize:
+      return "get_size";
+    case StorageOperation::Append:
+      return "append";
+    case StorageOperation::Reserve:
+      return "reserve";
+    case StorageOperation::Save:
+      return "save";
+    case StorageOperation::SaveAsync:
+      return "save_async";
+  }
+  return "<Undefined>";
+}
+
+size_t LatencyHistogramSnapshot::bucket_index(uint64_t latency_us) {
+  if (latency_us < SUB_BUCKETS) {
+    return latency_us;
+  }
+  size_t exponent = 63 - __builtin_clzll(latency_us);
+  size_t sub_bucket =
+    (latency_us >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  size_t bucket =
+    SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS + sub_bucket;
+  return std::min(bucket, NUM_BUCKETS - 1);
+}
+
+uint64_t LatencyHistogramSnapshot::bucket_lower_bound_us(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  size_t shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+  size_t sub_bucket = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+  return (uint64_t)(SUB_BUCKETS + sub_bucket) << shift;
+}
+
+uint64_t LatencyHistogramSnapshot::percentile_us(double q) const {
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t rank = std::max((uint64_t)1, (uint64_t)(q * count + 0.5));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < buckets.size(); ++i) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return i + 1 < NUM_BUCKETS ? bucket_lower_bound_us(i + 1)
+                                 : bucket_lower_bound_us(i);
+    }
+  }
+  return bucket_lower_bound_us(NUM_BUCKETS - 1);
+}
+
+StorageMetrics::StorageMetrics() {
+  for (size_t i = 0; i < NUM_STORAGE_OPERATIONS; ++i) {
+    // Value-initialized, so every counter starts at zero
+    shards_[i] = std::vector<Shard>(NUM_SHARDS);
+  }
+}
+
+void StorageMetrics::record(StorageOperation operation, StoreResult result,
+                            uint64_t bytes,
+                            std::chrono::steady_clock::duration latency) {
+  uint64_t latency_us =
+    std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+  Shard& shard = shards_[(size_t)operation][shard_index(NUM_SHARDS)];
+  shard.results[(size_t)result].fetch_add(1, std::memory_order_relaxed);
+  if (bytes > 0) {
+    shard.bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  shard.sum_us.fetch_add(latency_us, std::memory_order_relaxed);
+  shard.buckets[LatencyHistogramSnapshot::bucket_index(latency_us)].fetch_add(
+    1, std::memory_order_relaxed);
+}
+
+MetricsSnapshot StorageMetrics::snapshot() const {
+  MetricsSnapshot snapshot;
+  snapshot.retries = RetryStats();
+  for (size_t i = 0; i < NUM_STORAGE_OPERATIONS; ++i) {
+    OperationMetricsSnapshot op;
+    op.operation = (StorageOperation)i;
+    op.calls = 0;
+    op.bytes = 0;
+    op.latency.count = 0;
+    op.latency.sum_us = 0;
+    op.latency.buckets.assign(LatencyHistogramSnapshot::NUM_BUCKETS, 0);
+    uint64_t results[NUM_RESULTS] = {};
+    for (const Shard& shard : shards_[i]) {
+      for (size_t r = 0; r < NUM_RESULTS; ++r) {
+        results[r] += shard.results[r].load(std::memory_order_relaxed);
+      }
+      op.bytes += shard.bytes.load(std::memory_order_relaxed);
+      op.latency.sum_us += shard.sum_us.load(std::memory_order_relaxed);
+      for (size_t b = 0; b < LatencyHistogramSnapshot::NUM_BUCKETS; ++b) {
+        op.latency.buckets[b] +=
+          shard.buckets[b].load(std::memory_order_relaxed);
+      }
+    }
+    for (size_t r = 0; r < NUM_RESULTS; ++r) {
+      if (results[r] > 0) {
+        op.results[store_result_to_string((StoreResult)r)] = results[r];
+        op.calls += results[r];
+      }
+    }
+    if (op.calls == 0) {
+      continue;
+    }
+    // The shards are read one at a time while others may still record, so
+    // count the histogram itself rather than trusting calls to match it
+    for (uint64_t bucket : op.latency.buckets) {
+      op.latency.count += bucket;
+    }
+    snapshot.operations.push_back(op);
+  }
+  return snapshot;
+}
+
+std::string format_metrics_text(const MetricsSnapshot& snapshot,
+                                const std::string& prefix) {
+  std::ostringstream out;
+  out.precision(12);
+
+  std::string name = prefix + "_operations_total";
+  out << "# HELP " << name << " Storage operations by result.\n";
+  out << "# TYPE " << name << " counter\n";
+  for (const OperationMetricsSnapshot& op : snapshot.operations) {
+    for (const auto& kv : op.results) {
+      out << name << "{";
+      write_label(out, "operation", storage_operation_to_string(op.operation));
+      out << ",";
+      write_label(out, "result", kv.first);
+      out << "} " << kv.second << "\n";
+    }
+  }
+
+  name = prefix + "_bytes_total";
+  out << "# HELP " << name << " Bytes read or written.\n";
+  out << "# TYPE " << name << " counter\n";
+  for (const OperationMetricsSnapshot& op : snapshot.operations) {
+    if (op.bytes == 0) {
+      continue;
+    }
+    out << name << "{";
+    write_label(out, "operation", storage_operation_to_string(op.operation));
+    out << "} " << op.bytes << "\n";
+  }
+
+  // Buckets are exported at every other power of two from 16us, which are
+  // all bucket boundaries, so the cumulative counts are exact
+  name = prefix + "_operation_latency_seconds";
+  out << "# HELP " << name << " Storage operation latency.\n";
+  out << "# TYPE " << name << " histogram\n";
+  for (const OperationMetricsSnapshot& op : snapshot.operations) {
+    std::string operation = storage_operation_to_string(op.operation);
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (uint64_t bound_us = 16; bound_us <= (1 << 26); bound_us *= 4) {
+      size_t end = LatencyHistogramSnapshot::bucket_index(bound_us);
+      for (; bucket < end; ++bucket) {
+        cumulative += op.latency.buckets[bucket];
+      }
+      out << name << "_bucket{";
+      write_label(out, "operation", operation);
+      out << ",le=\"" << bound_us / 1e6 << "\"} " << cumulative << "\n";
+    }
+    out << name << "_bucket{";
+    write_label(out, "operation", operation);
+    out << ",le=\"+Inf\"} " << op.latency.count << "\n";
+    out << name << "_sum{";
+    write_label(out, "operation", operation);
+    out << "} " << op.latency.sum_us / 1e6 << "\n";
+    out << name << "_count{";
+    write_label(out, "operation", operation);
+    out << "} " << op.latency.count << "\n";
+  }
+
+  const RetryStats& retries = snapshot.retries;
+  std::pair<const char*, uint64_t> retry_counters[] = {
+    {"_retry_calls_total", retries.calls},
+    {"_retries_total", retries.retries},
+    {"_retry_recovered_total", retries.recovered},
+    {"_retry_exhausted_total", retries.exhausted},
+    {"_retry_budget_rejections_total", retries.budget_rejections},
+  };
+  for (const auto& counter : retry_counters) {
+    name = prefix + counter.first;
+    out << "# TYPE " << name << " counter\n";
+    out << name << " " << counter.second << "\n";
+  }
+  return out.str();
+}
+}
@@ -0,0 +1,152 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/retry_policy.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace storehouse {
+
+enum class StoreResult;
+
+////////////////////////////////////////////////////////////////////////////////
+/// StorageOperation
+enum class StorageOperation {
+  // StorageBackend
+  GetFileInfo,
+  GetFileInfoMany,
+  MakeRandomReadFile,
+  MakeWriteFile,
+  MakeDir,
+  DeleteFile,
+  DeleteDir,
+  MakeDirectoryListing,
+  // DirectoryListing
+  ListPage,
+  // RandomReadFile
+  Read,
+  ReadAsync,
+  ReadMany,
+  ReadView,
+  GetSize,
+  // WriteFile
+  Append,
+  Reserve,
+  Save,
+  SaveAsync,
+};
+
+const size_t NUM_STORAGE_OPERATIONS = (size_t)StorageOperation::SaveAsync + 1;
+
+std::string storage_operation_to_string(StorageOperation operation);
+
+////////////////////////////////////////////////////////////////////////////////
+/// LatencyHistogramSnapshot
+/* Latencies in microseconds, bucketed log-linearly: below 8us every value
+ * has its own bucket, above it each power of two is split into 8 buckets, so
+ * a bucket's bounds are within 12.5% of each other. Values past about 71
+ * minutes land in the last bucket.
+ */
+struct LatencyHistogramSnapshot {
+  static const size_t NUM_BUCKETS = 8 + 29 * 8;
+
+  static size_t bucket_index(uint64_t latency_us);
+
+  // Smallest latency counted in bucket
+  static uint64_t bucket_lower_bound_us(size_t bucket);
+
+  /* percentile_us
+   *
+   * Upper bound of the bucket holding the q-th quantile, for q between 0
+   * and 1, or 0 if nothing was recorded.
+   */
+  uint64_t percentile_us(double q) const;
+
+  uint64_t count;
+  uint64_t sum_us;
+  std::vector<uint64_t> buckets;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// OperationMetricsSnapshot
+struct OperationMetricsSnapshot {
+  StorageOperation operation;
+  uint64_t calls;
+  // Bytes read or written, for the operations that move data
+  uint64_t bytes;
+  // Calls by store_result_to_string of their result; results never seen are
+  // left out
+  std::map<std::string, uint64_t> results;
+  LatencyHistogramSnapshot latency;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// MetricsSnapshot
+struct MetricsSnapshot {
+  // Only operations that were called at least once
+  std::vector<OperationMetricsSnapshot> operations;
+  RetryStats retries;
+};
+
+/* format_metrics_text
+ *
+ * Renders a snapshot in the Prometheus text exposition format, with every
+ * metric name starting with prefix.
+ */
+std::string format_metrics_text(const MetricsSnapshot& snapshot,
+                                const std::string& prefix = "storehouse");
+
+////////////////////////////////////////////////////////////////////////////////
+/// StorageMetrics
+/* Counts, result breakdowns, bytes and latency histograms for every
+ * StorageOperation. Recording takes a few relaxed atomic increments on a
+ * shard picked per thread, so concurrent callers rarely share a cache line;
+ * snapshot sums the shards.
+ */
+class StorageMetrics {
+ public:
+  StorageMetrics();
+
+  void record(StorageOperation operation, StoreResult result, uint64_t bytes,
+              std::chrono::steady_clock::duration latency);
+
+  /* snapshot
+   *
+   * Retry counts are left at zero; they belong to the backend's
+   * RetryPolicy.
+   */
+  MetricsSnapshot snapshot() const;
+
+ private:
+  static const size_t NUM_SHARDS = 8;
+  static const size_t NUM_RESULTS = 9;
+
+  struct alignas(64) Shard {
+    std::atomic<uint64_t> results[NUM_RESULTS];
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> sum_us;
+    std::atomic<uint64_t> buckets[LatencyHistogramSnapshot::NUM_BUCKETS];
+  };
+
+  std::vector<Shard> shards_[NUM_STORAGE_OPERATIONS];
+};
+}
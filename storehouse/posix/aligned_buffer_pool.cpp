@@ -0,0 +1,77 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/posix/aligned_buffer_pool.h"
+
+#include <cstdlib>
+
+namespace storehouse {
+
+AlignedBufferPool::AlignedBufferPool(size_t alignment, size_t buffer_size,
+                                     size_t max_cached)
+    : alignment_(alignment),
+      buffer_size_((buffer_size + alignment - 1) / alignment * alignment),
+      max_cached_(max_cached) {}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  for (uint8_t* buffer : free_) {
+    free(buffer);
+  }
+}
+
+std::shared_ptr<uint8_t> AlignedBufferPool::acquire(size_t size) {
+  if (size > buffer_size_) {
+    void* buffer;
+    size_t rounded = (size + alignment_ - 1) / alignment_ * alignment_;
+    if (posix_memalign(&buffer, alignment_, rounded) != 0) {
+      return nullptr;
+    }
+    return std::shared_ptr<uint8_t>(static_cast<uint8_t*>(buffer), free);
+  }
+
+  uint8_t* buffer = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      buffer = free_.back();
+      free_.pop_back();
+    }
+  }
+  if (buffer == nullptr) {
+    void* allocated;
+    if (posix_memalign(&allocated, alignment_, buffer_size_) != 0) {
+      return nullptr;
+    }
+    buffer = static_cast<uint8_t*>(allocated);
+  }
+  std::shared_ptr<AlignedBufferPool> pool = shared_from_this();
+  return std::shared_ptr<uint8_t>(
+    buffer, [pool](uint8_t* buffer) { pool->release(buffer); });
+}
+
+bool AlignedBufferPool::valid(size_t alignment, size_t buffer_size) {
+  return alignment > 0 && (alignment & (alignment - 1)) == 0 &&
+         buffer_size > 0 && buffer_size % alignment == 0;
+}
+
+void AlignedBufferPool::release(uint8_t* buffer) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_.size() < max_cached_) {
+    free_.push_back(buffer);
+  } else {
+    free(buffer);
+  }
+}
+}
@@ -0,0 +1,70 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// AlignedBufferPool
+/* Hands out buffers aligned for O_DIRECT I/O. Buffers of the standard size
+ * are kept for reuse when released; larger requests are allocated to fit
+ * and freed on release. Buffers keep the pool alive, so they may outlive
+ * its owner.
+ */
+class AlignedBufferPool
+  : public std::enable_shared_from_this<AlignedBufferPool> {
+ public:
+  /* Requires valid(alignment, buffer_size). */
+  AlignedBufferPool(size_t alignment, size_t buffer_size,
+                    size_t max_cached = 16);
+
+  ~AlignedBufferPool();
+
+  /* acquire
+   *
+   * Returns a buffer of at least size bytes, or nullptr if it could not be
+   * allocated. The buffer goes back to the pool when the last copy of the
+   * pointer is released.
+   */
+  std::shared_ptr<uint8_t> acquire(size_t size);
+
+  size_t alignment() const { return alignment_; }
+
+  size_t buffer_size() const { return buffer_size_; }
+
+  /* valid
+   *
+   * Whether alignment is a power of two and buffer_size a non-zero multiple
+   * of it.
+   */
+  static bool valid(size_t alignment, size_t buffer_size);
+
+ private:
+  void release(uint8_t* buffer);
+
+  const size_t alignment_;
+  const size_t buffer_size_;
+  const size_t max_cached_;
+
+  std::mutex mutex_;
+  std::vector<uint8_t*> free_;
+};
+}
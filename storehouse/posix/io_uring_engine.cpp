@@ -0,0 +1,508 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/posix/io_uring_engine.h"
+
+#include <glog/logging.h>
+
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_OFF_SQES) && defined(__NR_io_uring_setup)
+#define STOREHOUSE_HAVE_IO_URING 1
+#endif
+
+namespace storehouse {
+
+#ifdef STOREHOUSE_HAVE_IO_URING
+
+namespace {
+
+int io_uring_setup(uint32_t entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int io_uring_enter(int ring_fd, uint32_t to_submit, uint32_t min_complete,
+                   uint32_t flags) {
+  return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags,
+                 nullptr, 0);
+}
+
+int io_uring_register(int ring_fd, uint32_t opcode, const void* arg,
+                      uint32_t nr_args) {
+  return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+bool retryable(int error) {
+  return error == EINTR || error == EAGAIN || error == EBUSY;
+}
+
+// Set on each reaper thread to the engine it serves, and to the completions
+// it has taken from the queue but whose callbacks it has not yet run
+thread_local IoUringEngine* reaper_engine = nullptr;
+thread_local std::vector<std::pair<uint64_t, int>>* deferred_completions =
+  nullptr;
+
+}
+
+struct IoUringEngine::Operation {
+  std::vector<struct iovec> iov;
+  Completion completion;
+};
+
+IoUringEngine* IoUringEngine::make(const IoUringOptions& options) {
+  IoUringEngine* engine = new IoUringEngine(options);
+  if (!engine->setup()) {
+    delete engine;
+    return nullptr;
+  }
+  return engine;
+}
+
+IoUringEngine::IoUringEngine(const IoUringOptions& options)
+    : options_(options),
+      ring_fd_(-1),
+      sq_ring_(MAP_FAILED),
+      sq_ring_size_(0),
+      cq_ring_(MAP_FAILED),
+      cq_ring_size_(0),
+      sqes_(MAP_FAILED),
+      sqes_size_(0),
+      completion_fd_(-1),
+      stop_fd_(-1),
+      inflight_(0),
+      files_registered_(false),
+      buffers_(nullptr),
+      error_(0),
+      stopping_(false) {}
+
+IoUringEngine::~IoUringEngine() {
+  if (!reapers_.empty()) {
+    {
+      std::unique_lock<std::mutex> lock(slot_mutex_);
+      slot_cv_.wait(lock, [this] { return inflight_ == 0; });
+    }
+    // The stop descriptor stays readable, so it wakes every reaper at once
+    stopping_ = true;
+    uint64_t one = 1;
+    PLOG_IF(ERROR, write(stop_fd_, &one, sizeof(one)) != sizeof(one))
+      << "Could not stop the io_uring reapers";
+    for (std::thread& reaper : reapers_) {
+      reaper.join();
+    }
+  }
+  if (sqes_ != MAP_FAILED) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    munmap(cq_ring_, cq_ring_size_);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    munmap(sq_ring_, sq_ring_size_);
+  }
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+  if (completion_fd_ >= 0) {
+    close(completion_fd_);
+  }
+  if (stop_fd_ >= 0) {
+    close(stop_fd_);
+  }
+  free(buffers_);
+}
+
+bool IoUringEngine::setup() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = io_uring_setup(options_.queue_depth, &params);
+  if (ring_fd_ < 0) {
+    LOG(WARNING) << "io_uring is not available: " << strerror(errno);
+    return false;
+  }
+
+  sq_entries_ = params.sq_entries;
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cq_ring_size_ =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    LOG(WARNING) << "Could not map io_uring queues: " << strerror(errno);
+    return false;
+  }
+  cq_ring_ = single_mmap
+               ? sq_ring_
+               : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (cq_ring_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+    LOG(WARNING) << "Could not map io_uring queues: " << strerror(errno);
+    return false;
+  }
+
+  uint8_t* sq = static_cast<uint8_t*>(sq_ring_);
+  sq_head_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.head);
+  sq_tail_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+  uint8_t* cq = static_cast<uint8_t*>(cq_ring_);
+  cq_head_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+
+  // Reapers sleep in poll on these rather than in io_uring_enter, so
+  // shutting down can wake all of them without submitting anything
+  completion_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  stop_fd_ = eventfd(0, EFD_CLOEXEC);
+  if (completion_fd_ < 0 || stop_fd_ < 0 ||
+      io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &completion_fd_,
+                        1) != 0) {
+    LOG(WARNING) << "Could not register an io_uring eventfd: "
+                 << strerror(errno);
+    return false;
+  }
+
+  // Both registrations are optimizations; requests work without them
+  std::vector<int> files(options_.max_registered_files, -1);
+  if (!files.empty() &&
+      io_uring_register(ring_fd_, IORING_REGISTER_FILES, files.data(),
+                        files.size()) == 0) {
+    files_registered_ = true;
+    file_slots_used_.resize(files.size(), false);
+  }
+
+  size_t buffers_size =
+    (size_t)options_.fixed_buffer_count * options_.fixed_buffer_size;
+  if (buffers_size > 0 &&
+      posix_memalign(reinterpret_cast<void**>(&buffers_), 4096,
+                     buffers_size) == 0) {
+    std::vector<struct iovec> iov(options_.fixed_buffer_count);
+    for (size_t i = 0; i < iov.size(); ++i) {
+      iov[i].iov_base = buffers_ + i * options_.fixed_buffer_size;
+      iov[i].iov_len = options_.fixed_buffer_size;
+    }
+    if (io_uring_register(ring_fd_, IORING_REGISTER_BUFFERS, iov.data(),
+                          iov.size()) == 0) {
+      for (int i = iov.size() - 1; i >= 0; --i) {
+        free_buffers_.push_back(i);
+      }
+    } else {
+      VLOG(1) << "Could not register io_uring buffers: " << strerror(errno);
+      free(buffers_);
+      buffers_ = nullptr;
+    }
+  }
+
+  uint32_t reapers = std::max(options_.reaper_threads, 1u);
+  for (uint32_t i = 0; i < reapers; ++i) {
+    reapers_.emplace_back(&IoUringEngine::reap, this);
+  }
+  return true;
+}
+
+void IoUringEngine::submit(std::vector<Request>& requests) {
+  std::vector<std::pair<uint64_t, int>> failed;
+  size_t next = 0;
+  while (next < requests.size()) {
+    size_t count = acquire_slots(requests.size() - next);
+    if (count == 0) {
+      break;
+    }
+
+    std::lock_guard<std::mutex> lock(submit_mutex_);
+    uint32_t tail = *sq_tail_;
+    for (size_t i = next; i < next + count; ++i) {
+      Request& request = requests[i];
+      uint32_t index = tail & sq_mask_;
+      struct io_uring_sqe* sqe =
+        static_cast<struct io_uring_sqe*>(sqes_) + index;
+      memset(sqe, 0, sizeof(*sqe));
+
+      if (request.fd < 0) {
+        // Wakes a reaper without completing anything
+        sqe->opcode = IORING_OP_NOP;
+      } else {
+        Operation* operation = new Operation;
+        operation->iov.swap(request.iov);
+        operation->completion = std::move(request.completion);
+        if (request.buffer_index >= 0) {
+          sqe->opcode =
+            request.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+          sqe->addr = reinterpret_cast<uint64_t>(operation->iov[0].iov_base);
+          sqe->len = operation->iov[0].iov_len;
+          sqe->buf_index = request.buffer_index;
+        } else {
+          sqe->opcode = request.write ? IORING_OP_WRITEV : IORING_OP_READV;
+          sqe->addr = reinterpret_cast<uint64_t>(operation->iov.data());
+          sqe->len = operation->iov.size();
+        }
+        if (request.file_index >= 0) {
+          sqe->fd = request.file_index;
+          sqe->flags |= IOSQE_FIXED_FILE;
+        } else {
+          sqe->fd = request.fd;
+        }
+        sqe->off = request.offset;
+        sqe->user_data = reinterpret_cast<uint64_t>(operation);
+      }
+      sq_array_[index] = index;
+      ++tail;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    int error = enter(count);
+    if (error != 0) {
+      // The kernel has not looked at the entries past its head, so they are
+      // taken back and failed. Those it did consume still complete.
+      uint32_t head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+      for (uint32_t i = head; i != tail; ++i) {
+        const struct io_uring_sqe& sqe =
+          static_cast<struct io_uring_sqe*>(sqes_)[sq_array_[i & sq_mask_]];
+        failed.emplace_back(sqe.user_data, -error);
+      }
+      __atomic_store_n(sq_tail_, head, __ATOMIC_RELEASE);
+      release_slots(tail - head);
+      fail(error);
+    }
+    next += count;
+  }
+
+  for (; next < requests.size(); ++next) {
+    Request& request = requests[next];
+    if (request.fd >= 0) {
+      Operation* operation = new Operation;
+      operation->completion = std::move(request.completion);
+      failed.emplace_back(reinterpret_cast<uint64_t>(operation), -error_);
+    }
+  }
+  if (reaper_engine == this) {
+    deferred_completions->insert(deferred_completions->end(), failed.begin(),
+                                 failed.end());
+  } else {
+    run_completions(failed);
+  }
+}
+
+size_t IoUringEngine::acquire_slots(size_t wanted) {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(slot_mutex_);
+      if (reaper_engine != this) {
+        slot_cv_.wait(lock,
+                      [this] { return inflight_ < sq_entries_ || failed(); });
+      }
+      if (failed()) {
+        return 0;
+      }
+      if (inflight_ < sq_entries_) {
+        size_t count = std::min(wanted, sq_entries_ - inflight_);
+        inflight_ += count;
+        return count;
+      }
+    }
+    // A completion that submits more requests while the queue is full would
+    // wait on its own reaper forever, so it frees slots itself. The
+    // callbacks of what it takes run on its reaper once it returns.
+    wait_for_completions();
+    take_ready(*deferred_completions);
+  }
+}
+
+void IoUringEngine::release_slots(size_t count) {
+  std::lock_guard<std::mutex> lock(slot_mutex_);
+  inflight_ -= count;
+  slot_cv_.notify_all();
+}
+
+int IoUringEngine::enter(size_t to_submit) {
+  while (to_submit > 0) {
+    int submitted = io_uring_enter(ring_fd_, to_submit, 0, 0);
+    if (submitted < 0) {
+      if (!retryable(errno)) {
+        return errno;
+      }
+      continue;
+    }
+    to_submit -= submitted;
+  }
+  return 0;
+}
+
+void IoUringEngine::fail(int error) {
+  std::lock_guard<std::mutex> lock(slot_mutex_);
+  if (error_ == 0) {
+    LOG(ERROR) << "io_uring_enter failed, falling back to pread: "
+               << strerror(error);
+    error_ = error;
+  }
+  slot_cv_.notify_all();
+}
+
+void IoUringEngine::wait_for_completions() {
+  struct pollfd fds[2] = {{completion_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+  if (poll(fds, 2, -1) < 0) {
+    PLOG_IF(WARNING, errno != EINTR) << "Could not wait for io_uring";
+    return;
+  }
+  if (fds[0].revents & POLLIN) {
+    // Reset before the queue is read, so a completion that arrives after
+    // that signals again. Another reaper may have reset it first.
+    uint64_t count;
+    ssize_t drained = read(completion_fd_, &count, sizeof(count));
+    (void)drained;
+  }
+}
+
+void IoUringEngine::take_ready(
+  std::vector<std::pair<uint64_t, int>>& completed) {
+  size_t count;
+  {
+    std::lock_guard<std::mutex> lock(reap_mutex_);
+    uint32_t head = *cq_head_;
+    uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe& cqe =
+        static_cast<struct io_uring_cqe*>(cqes_)[head & cq_mask_];
+      completed.emplace_back(cqe.user_data, cqe.res);
+    }
+    count = head - *cq_head_;
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  // The entries have left the completion queue, so their slots are free
+  // before the callbacks run
+  if (count > 0) {
+    release_slots(count);
+  }
+}
+
+void IoUringEngine::run_completions(
+  const std::vector<std::pair<uint64_t, int>>& completed) {
+  for (const std::pair<uint64_t, int>& entry : completed) {
+    Operation* operation = reinterpret_cast<Operation*>(entry.first);
+    if (operation != nullptr) {
+      operation->completion(entry.second);
+      delete operation;
+    }
+  }
+}
+
+void IoUringEngine::reap() {
+  std::vector<std::pair<uint64_t, int>> deferred;
+  reaper_engine = this;
+  deferred_completions = &deferred;
+  while (!stopping_) {
+    wait_for_completions();
+    std::vector<std::pair<uint64_t, int>> completed;
+    take_ready(completed);
+    run_completions(completed);
+    // Left by callbacks that had to wait for slots
+    while (!deferred.empty()) {
+      completed.clear();
+      completed.swap(deferred);
+      run_completions(completed);
+    }
+  }
+}
+
+int IoUringEngine::register_file(int fd) {
+  std::lock_guard<std::mutex> lock(files_mutex_);
+  if (!files_registered_) {
+    return -1;
+  }
+  auto it = std::find(file_slots_used_.begin(), file_slots_used_.end(), false);
+  if (it == file_slots_used_.end()) {
+    return -1;
+  }
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = it - file_slots_used_.begin();
+  update.fds = reinterpret_cast<uint64_t>(&fd);
+  if (io_uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) !=
+      1) {
+    return -1;
+  }
+  *it = true;
+  return update.offset;
+}
+
+void IoUringEngine::unregister_file(int file_index) {
+  std::lock_guard<std::mutex> lock(files_mutex_);
+  int fd = -1;
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = file_index;
+  update.fds = reinterpret_cast<uint64_t>(&fd);
+  io_uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  file_slots_used_[file_index] = false;
+}
+
+int IoUringEngine::acquire_buffer(uint8_t*& data) {
+  std::lock_guard<std::mutex> lock(buffers_mutex_);
+  if (free_buffers_.empty()) {
+    return -1;
+  }
+  int buffer_index = free_buffers_.back();
+  free_buffers_.pop_back();
+  data = buffers_ + (size_t)buffer_index * options_.fixed_buffer_size;
+  return buffer_index;
+}
+
+void IoUringEngine::release_buffer(int buffer_index) {
+  std::lock_guard<std::mutex> lock(buffers_mutex_);
+  free_buffers_.push_back(buffer_index);
+}
+
+#else
+
+IoUringEngine* IoUringEngine::make(const IoUringOptions& options) {
+  LOG(WARNING) << "io_uring is not available: built without kernel headers";
+  return nullptr;
+}
+
+IoUringEngine::~IoUringEngine() {}
+
+void IoUringEngine::submit(std::vector<Request>& requests) {}
+
+int IoUringEngine::register_file(int fd) { return -1; }
+
+void IoUringEngine::unregister_file(int file_index) {}
+
+int IoUringEngine::acquire_buffer(uint8_t*& data) { return -1; }
+
+void IoUringEngine::release_buffer(int buffer_index) {}
+
+#endif
+}
@@ -0,0 +1,183 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace storehouse {
+
+struct IoUringOptions {
+  // Submission queue size, which bounds the number of requests in flight
+  uint32_t queue_depth = 128;
+  uint32_t reaper_threads = 1;
+  // Registered buffers lent out by acquire_buffer
+  uint32_t fixed_buffer_count = 32;
+  size_t fixed_buffer_size = 1024 * 1024;
+  uint32_t max_registered_files = 1024;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// IoUringEngine
+//
+// Drives one io_uring instance through the raw system calls. Requests are
+// copied into the submission queue in batches, each batch entered with a
+// single io_uring_enter, and completions are delivered on the reaper threads.
+// If the kernel rejects a submission outright, the engine stops submitting and
+// fails the requests it still holds, so callers can fall back to pread.
+class IoUringEngine {
+ public:
+  // Receives the number of bytes transferred, or a negative errno
+  typedef std::function<void(int result)> Completion;
+
+  struct Request {
+    bool write = false;
+    // A request with no descriptor is submitted as a no-op
+    int fd = -1;
+    // Slot from register_file, or -1 to use fd directly
+    int file_index = -1;
+    uint64_t offset = 0;
+    // Copied on submit, so the array need not outlive the call. The memory
+    // it points to must stay valid until completion.
+    std::vector<struct iovec> iov;
+    // Index from acquire_buffer when iov is a single range inside that
+    // buffer, or -1
+    int buffer_index = -1;
+    Completion completion;
+  };
+
+  /* make
+   *
+   * Returns nullptr if the running kernel does not support io_uring, or it
+   * has been disabled, so callers can fall back to synchronous I/O.
+   */
+  static IoUringEngine* make(const IoUringOptions& options);
+
+  ~IoUringEngine();
+
+  /* submit
+   *
+   * Queues every request and enters them, blocking only while the queue is
+   * full.
+   */
+  void submit(std::vector<Request>& requests);
+
+  /* register_file
+   *
+   * Adds fd to the registered file table so requests can skip the per-I/O
+   * descriptor lookup. Returns the slot, or -1 if the table is full or the
+   * kernel does not support updating it.
+   */
+  int register_file(int fd);
+
+  void unregister_file(int file_index);
+
+  /* acquire_buffer
+   *
+   * Lends out one of the registered buffers, each fixed_buffer_size bytes.
+   * Returns -1 if none are free.
+   */
+  int acquire_buffer(uint8_t*& data);
+
+  void release_buffer(int buffer_index);
+
+  size_t buffer_size() const { return options_.fixed_buffer_size; }
+
+  /* failed
+   *
+   * Whether io_uring_enter has failed with an error that retrying cannot
+   * fix. From then on every request submitted completes at once with that
+   * negative errno, as do those queued but not yet handed to the kernel.
+   */
+  bool failed() const { return error_ != 0; }
+
+ private:
+  struct Operation;
+
+  IoUringEngine(const IoUringOptions& options);
+
+  bool setup();
+
+  size_t acquire_slots(size_t wanted);
+
+  void release_slots(size_t count);
+
+  // Returns 0, or the errno that retrying cannot fix
+  int enter(size_t to_submit);
+
+  void fail(int error);
+
+  void wait_for_completions();
+
+  // Takes every completion that has arrived off the queue, freeing its slot
+  void take_ready(std::vector<std::pair<uint64_t, int>>& completed);
+
+  void run_completions(const std::vector<std::pair<uint64_t, int>>& completed);
+
+  void reap();
+
+  const IoUringOptions options_;
+  int ring_fd_;
+
+  void* sq_ring_;
+  size_t sq_ring_size_;
+  void* cq_ring_;
+  size_t cq_ring_size_;
+  void* sqes_;
+  size_t sqes_size_;
+  uint32_t* sq_head_;
+  uint32_t* sq_tail_;
+  uint32_t sq_mask_;
+  uint32_t* sq_array_;
+  uint32_t sq_entries_;
+  uint32_t* cq_head_;
+  uint32_t* cq_tail_;
+  uint32_t cq_mask_;
+  void* cqes_;
+  // Signalled by the kernel on each completion, and once at shutdown
+  int completion_fd_;
+  int stop_fd_;
+
+  std::mutex submit_mutex_;
+  std::mutex reap_mutex_;
+
+  // Requests in flight, kept below the submission queue size so the
+  // completion queue cannot overflow
+  std::mutex slot_mutex_;
+  std::condition_variable slot_cv_;
+  size_t inflight_;
+
+  std::mutex files_mutex_;
+  bool files_registered_;
+  std::vector<bool> file_slots_used_;
+
+  std::mutex buffers_mutex_;
+  uint8_t* buffers_;
+  std::vector<int> free_buffers_;
+
+  // Set once, from 0 to the errno that made the engine give up
+  std::atomic<int> error_;
+  std::atomic<bool> stopping_;
+  std::vector<std::thread> reapers_;
+};
+}
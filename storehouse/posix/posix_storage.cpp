@@ -14,15 +14,32 @@
  */
 
 #include "storehouse/posix/posix_storage.h"
+#include "storehouse/posix/aligned_buffer_pool.h"
+#include "storehouse/posix/io_uring_engine.h"
+#include "storehouse/thread_pool.h"
 #include "storehouse/util.h"
 
 #include <glog/logging.h>
 
-#include <ftw.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <cstdlib>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
 
 namespace storehouse {
 
@@ -30,58 +47,285 @@ namespace storehouse {
 /// PosixRandomReadFile
 class PosixRandomReadFile : public RandomReadFile {
  public:
-  PosixRandomReadFile(const std::string& file_path) : file_path_(file_path) {
-    fp_ = fopen(file_path.c_str(), "r");
-    if (fp_ == NULL) {
+  PosixRandomReadFile(const std::string& file_path,
+                      IoUringEngine* engine = nullptr,
+                      std::shared_ptr<AlignedBufferPool> direct_pool = nullptr)
+      : file_path_(file_path),
+        engine_(engine),
+        file_index_(-1),
+        direct_pool_(direct_pool) {
+    int flags = O_RDONLY | O_CLOEXEC;
+    fd_ = open(file_path.c_str(), flags | (direct_pool_ ? O_DIRECT : 0));
+    if (fd_ < 0 && direct_pool_ && errno == EINVAL) {
+      LOG(WARNING) << "PosixRandomReadFile: " << file_path.c_str()
+                   << " does not support O_DIRECT, reading through the page "
+                   << "cache";
+      direct_pool_.reset();
+      fd_ = open(file_path.c_str(), flags);
+    }
+    if (fd_ < 0) {
       LOG(ERROR) << "Error opening file: " << strerror(errno);
+      engine_ = nullptr;
+    } else if (engine_ != nullptr) {
+      file_index_ = engine_->register_file(fd_);
     }
-    position_ = 0;
   }
 
   ~PosixRandomReadFile() {
-    if (fp_ != NULL) {
-      fclose(fp_);
+    if (file_index_ >= 0) {
+      engine_->unregister_file(file_index_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
     }
   }
 
+  // pread carries its own offset, so concurrent readers can share the
+  // descriptor without any locking. A single blocking read gains nothing
+  // from io_uring, so it always takes this path.
   StoreResult read(uint64_t offset, size_t size, uint8_t* data,
                    size_t& size_read) override {
-    if (fp_ == NULL) {
+    size_read = 0;
+    if (fd_ < 0) {
       return StoreResult::ReadFailure;
     }
 
-    if (position_ != offset) {
-      if (fseek(fp_, offset, SEEK_SET) != 0) {
-        LOG_IF(FATAL, ferror(fp_))
-          << "PosixRandomReadFile: Error in seeking file " << file_path_.c_str()
-          << " to position " << offset;
+    ssize_t result;
+    if (direct_pool_ != nullptr) {
+      result = pread_direct(offset, size, data);
+    } else {
+      struct iovec iov = {data, size};
+      result = preadv_fully(&iov, 1, offset);
+    }
+    size_read = result < 0 ? 0 : result;
+    return read_result(offset, size, result);
+  }
+
+  void read_async(uint64_t offset, size_t size, uint8_t* data,
+                  ReadCallback callback) override {
+    if (engine_ == nullptr || engine_->failed()) {
+      RandomReadFile::read_async(offset, size, data, callback);
+    } else if (direct_pool_ != nullptr) {
+      read_async_direct(offset, size, data, callback);
+    } else {
+      read_async_from(offset, size, data, 0, callback);
+    }
+  }
+
+  StoreResult read_many(std::vector<ReadRange>& ranges,
+                        size_t max_gap = DEFAULT_READ_MANY_GAP) override {
+    if (fd_ < 0) {
+      for (ReadRange& range : ranges) {
+        range.size_read = 0;
+        range.result = StoreResult::ReadFailure;
       }
-      position_ = offset;
+      return StoreResult::ReadFailure;
     }
 
-    size_read = fread(data, sizeof(uint8_t), size, fp_);
-    position_ += size_read;
+    // Point an iovec at each range in file order, sending the bytes between
+    // ranges to a shared scratch buffer, so one preadv serves them all.
+    // Overlapping ranges cannot share bytes that way, and direct I/O needs
+    // aligned buffers, so those are read whole into a copy buffer instead.
+    std::vector<CoalescedRange> merged_ranges =
+      coalesce_read_ranges(ranges, max_gap);
+    std::vector<bool> copy(merged_ranges.size(), direct_pool_ != nullptr);
+    size_t gap_size = 0;
+    for (size_t i = 0; i < merged_ranges.size(); ++i) {
+      uint64_t position = merged_ranges[i].offset;
+      for (size_t index : merged_ranges[i].members) {
+        const ReadRange& range = ranges[index];
+        if (range.offset < position) {
+          copy[i] = true;
+          break;
+        }
+        gap_size = std::max(gap_size, (size_t)(range.offset - position));
+        position = range.offset + range.size;
+      }
+    }
 
-    LOG_IF(FATAL, ferror(fp_))
-      << "PosixRandomReadFile: Error in reading file " << file_path_.c_str()
-      << " at position " << offset << ", "
-      << "size " << size << ".";
+    std::vector<uint8_t> gap_buffer(gap_size);
+    std::vector<std::vector<struct iovec>> iovs(merged_ranges.size());
+    std::vector<std::shared_ptr<uint8_t>> copy_buffers(merged_ranges.size());
+    std::vector<uint64_t> read_offsets(merged_ranges.size());
+    std::vector<ssize_t> results(merged_ranges.size(), 0);
+    for (size_t i = 0; i < merged_ranges.size(); ++i) {
+      const CoalescedRange& merged = merged_ranges[i];
+      std::vector<struct iovec>& iov = iovs[i];
+      uint64_t position = merged.offset;
+      for (size_t index : merged.members) {
+        if (copy[i]) {
+          break;
+        }
+        const ReadRange& range = ranges[index];
+        if (range.offset > position) {
+          iov.push_back({gap_buffer.data(), (size_t)(range.offset - position)});
+        }
+        iov.push_back({range.data, range.size});
+        position = range.offset + range.size;
+      }
+      read_offsets[i] = merged.offset;
+      if (copy[i] || iov.size() > IOV_MAX) {
+        copy[i] = true;
+        size_t length = merged.size;
+        if (direct_pool_ != nullptr) {
+          read_offsets[i] = align_down(merged.offset);
+          length = align_up(merged.offset + merged.size) - read_offsets[i];
+          copy_buffers[i] = direct_pool_->acquire(length);
+        } else {
+          copy_buffers[i].reset(new uint8_t[length],
+                                std::default_delete<uint8_t[]>());
+        }
+        if (copy_buffers[i] == nullptr) {
+          results[i] = -ENOMEM;
+          iov.clear();
+        } else {
+          iov.assign(1, {copy_buffers[i].get(), length});
+        }
+      }
+    }
 
-    if (feof(fp_)) {
-      return StoreResult::EndOfFile;
-    } else {
-      return StoreResult::Success;
+    bool use_engine = engine_ != nullptr && !engine_->failed();
+    if (use_engine) {
+      // Every merged range goes to the kernel in one submission
+      std::mutex mutex;
+      std::condition_variable cv;
+      size_t outstanding = 0;
+      std::vector<IoUringEngine::Request> requests;
+      for (size_t i = 0; i < merged_ranges.size(); ++i) {
+        if (iovs[i].empty()) {
+          continue;
+        }
+        requests.emplace_back();
+        IoUringEngine::Request& request = requests.back();
+        request.fd = fd_;
+        request.file_index = file_index_;
+        request.offset = read_offsets[i];
+        request.iov = iovs[i];
+        request.completion = [&, i](int result) {
+          std::lock_guard<std::mutex> lock(mutex);
+          results[i] = result;
+          if (--outstanding == 0) {
+            cv.notify_one();
+          }
+        };
+        ++outstanding;
+      }
+      engine_->submit(requests);
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&] { return outstanding == 0; });
+    }
+
+    for (size_t i = 0; i < merged_ranges.size(); ++i) {
+      const CoalescedRange& merged = merged_ranges[i];
+      size_t length = 0;
+      for (const struct iovec& iov : iovs[i]) {
+        length += iov.iov_len;
+      }
+      // Requests a failed engine gave back are read here instead
+      if (!iovs[i].empty() &&
+          (!use_engine || (results[i] < 0 && engine_->failed()))) {
+        results[i] =
+          preadv_fully(iovs[i].data(), iovs[i].size(), read_offsets[i]);
+      } else if (results[i] > 0 && (size_t)results[i] < length) {
+        // Short reads are allowed to stop anywhere, so finish the rest here
+        results[i] = preadv_fully(iovs[i].data(), iovs[i].size(),
+                                  read_offsets[i], results[i]);
+      }
+      if (results[i] < 0) {
+        read_result(merged.offset, merged.size, results[i]);
+        complete_coalesced_range(merged, ranges, StoreResult::ReadFailure, 0);
+        continue;
+      }
+
+      // Bytes of the merged range itself, which a direct read may start
+      // before
+      uint64_t lead = merged.offset - read_offsets[i];
+      size_t size_read =
+        results[i] > (ssize_t)lead
+          ? std::min((uint64_t)merged.size, (uint64_t)results[i] - lead)
+          : 0;
+      if (copy[i]) {
+        for (size_t index : merged.members) {
+          ReadRange& range = ranges[index];
+          uint64_t start = range.offset - merged.offset;
+          if (start < size_read) {
+            memcpy(range.data, copy_buffers[i].get() + lead + start,
+                   std::min((uint64_t)range.size, size_read - start));
+          }
+        }
+      }
+      complete_coalesced_range(merged, ranges, StoreResult::Success,
+                               size_read);
+    }
+    return read_many_result(ranges);
+  }
+
+  StoreResult read_view(uint64_t offset, size_t size,
+                        ReadView& view) override {
+    if (direct_pool_ != nullptr) {
+      // The view points into the aligned buffer the read landed in
+      uint64_t start = align_down(offset);
+      size_t length = align_up(offset + size) - start;
+      std::shared_ptr<uint8_t> buffer = direct_pool_->acquire(length);
+      if (buffer == nullptr) {
+        return read_result(offset, size, -ENOMEM);
+      }
+      struct iovec iov = {buffer.get(), length};
+      ssize_t result = preadv_fully(&iov, 1, start);
+      size_t lead = offset - start;
+      view.data = buffer.get() + lead;
+      view.size = result > (ssize_t)lead
+                    ? std::min((uint64_t)size, (uint64_t)result - lead)
+                    : 0;
+      view.holder = buffer;
+      return read_result(offset, size, result < 0 ? result : view.size);
     }
+
+    // Reads that fit are served into one of the engine's registered buffers,
+    // which the view hands back when it is released
+    uint8_t* buffer;
+    int buffer_index = -1;
+    if (engine_ == nullptr || engine_->failed() ||
+        size > engine_->buffer_size() ||
+        (buffer_index = engine_->acquire_buffer(buffer)) < 0) {
+      return RandomReadFile::read_view(offset, size, view);
+    }
+
+    auto done = std::make_shared<std::promise<int>>();
+    std::vector<IoUringEngine::Request> requests(1);
+    requests[0].fd = fd_;
+    requests[0].file_index = file_index_;
+    requests[0].offset = offset;
+    requests[0].iov.assign(1, {buffer, size});
+    requests[0].buffer_index = buffer_index;
+    requests[0].completion = [done](int result) { done->set_value(result); };
+    std::future<int> result_future = done->get_future();
+    engine_->submit(requests);
+    ssize_t result = result_future.get();
+    if ((result > 0 && (size_t)result < size) ||
+        (result < 0 && engine_->failed())) {
+      struct iovec iov = {buffer, size};
+      result = preadv_fully(&iov, 1, offset, std::max(result, (ssize_t)0));
+    }
+
+    IoUringEngine* engine = engine_;
+    view.data = buffer;
+    view.size = result < 0 ? 0 : result;
+    view.holder = std::shared_ptr<const void>(
+      buffer,
+      [engine, buffer_index](const void*) {
+        engine->release_buffer(buffer_index);
+      });
+    return read_result(offset, size, result);
   }
 
   StoreResult get_size(uint64_t& size) override {
-    if (fp_ == NULL) {
+    if (fd_ < 0) {
       return StoreResult::ReadFailure;
     }
 
-    int fd = fileno(fp_);
     struct stat stat_buf;
-    int rc = fstat(fd, &stat_buf);
+    int rc = fstat(fd_, &stat_buf);
     if (rc == 0) {
       size = stat_buf.st_size;
       return StoreResult::Success;
@@ -93,75 +337,936 @@ class PosixRandomReadFile : public RandomReadFile {
   const std::string path() override { return file_path_; }
 
  private:
+  uint64_t align_down(uint64_t offset) const {
+    size_t alignment = direct_pool_->alignment();
+    return offset / alignment * alignment;
+  }
+
+  uint64_t align_up(uint64_t offset) const {
+    size_t alignment = direct_pool_->alignment();
+    return (offset + alignment - 1) / alignment * alignment;
+  }
+
+  // Reads into iov starting done bytes in, until it is full or the file ends.
+  // Returns the total read, or a negative errno.
+  ssize_t preadv_fully(const struct iovec* iov, int iovcnt, uint64_t offset,
+                       size_t done = 0) {
+    std::vector<struct iovec> remaining(iov, iov + iovcnt);
+    size_t skip = done;
+    while (true) {
+      // Direct reads only stop short of an alignment boundary at the end of
+      // the file, and cannot be continued from there
+      if (direct_pool_ != nullptr &&
+          (offset + done) % direct_pool_->alignment() != 0) {
+        return done;
+      }
+      while (!remaining.empty() && skip >= remaining.front().iov_len) {
+        skip -= remaining.front().iov_len;
+        remaining.erase(remaining.begin());
+      }
+      if (remaining.empty()) {
+        return done;
+      }
+      remaining.front().iov_base =
+        static_cast<uint8_t*>(remaining.front().iov_base) + skip;
+      remaining.front().iov_len -= skip;
+
+      ssize_t n = preadv(fd_, remaining.data(),
+                         std::min(remaining.size(), (size_t)IOV_MAX),
+                         offset + done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          skip = 0;
+          continue;
+        }
+        return -errno;
+      }
+      if (n == 0) {
+        return done;
+      }
+      done += n;
+      skip = n;
+    }
+  }
+
+  // Reads through aligned buffers from the pool, a buffer at a time, unless
+  // the caller's buffer and range are already aligned
+  ssize_t pread_direct(uint64_t offset, size_t size, uint8_t* data) {
+    size_t alignment = direct_pool_->alignment();
+    if (offset % alignment == 0 && size % alignment == 0 &&
+        reinterpret_cast<uintptr_t>(data) % alignment == 0) {
+      struct iovec iov = {data, size};
+      return preadv_fully(&iov, 1, offset);
+    }
+
+    std::shared_ptr<uint8_t> buffer =
+      direct_pool_->acquire(direct_pool_->buffer_size());
+    if (buffer == nullptr) {
+      return -ENOMEM;
+    }
+    size_t done = 0;
+    while (done < size) {
+      uint64_t start = align_down(offset + done);
+      size_t lead = offset + done - start;
+      size_t length = std::min((uint64_t)direct_pool_->buffer_size(),
+                               align_up(offset + size) - start);
+      struct iovec iov = {buffer.get(), length};
+      ssize_t n = preadv_fully(&iov, 1, start);
+      if (n < 0) {
+        return n;
+      }
+      if ((size_t)n <= lead) {
+        break;
+      }
+      size_t copied = std::min(n - lead, size - done);
+      memcpy(data + done, buffer.get() + lead, copied);
+      done += copied;
+      if ((size_t)n < length) {
+        break;
+      }
+    }
+    return done;
+  }
+
+  void read_async_direct(uint64_t offset, size_t size, uint8_t* data,
+                         ReadCallback callback) {
+    uint64_t start = align_down(offset);
+    size_t length = align_up(offset + size) - start;
+    std::shared_ptr<uint8_t> buffer = direct_pool_->acquire(length);
+    if (buffer == nullptr) {
+      callback(read_result(offset, size, -ENOMEM), 0);
+      return;
+    }
+
+    std::vector<IoUringEngine::Request> requests(1);
+    requests[0].fd = fd_;
+    requests[0].file_index = file_index_;
+    requests[0].offset = start;
+    requests[0].iov.assign(1, {buffer.get(), length});
+    requests[0].completion = [this, offset, size, data, start, length, buffer,
+                              callback](int result) {
+      ssize_t total = result;
+      if ((result > 0 && (size_t)result < length) ||
+          (result < 0 && engine_->failed())) {
+        struct iovec iov = {buffer.get(), length};
+        total = preadv_fully(&iov, 1, start, std::max(result, 0));
+      }
+      size_t lead = offset - start;
+      size_t size_read =
+        total > (ssize_t)lead ? std::min(size, (size_t)(total - lead)) : 0;
+      memcpy(data, buffer.get() + lead, size_read);
+      callback(read_result(offset, size, total < 0 ? total : size_read),
+               size_read);
+    };
+    engine_->submit(requests);
+  }
+
+  StoreResult read_result(uint64_t offset, size_t size, ssize_t result) {
+    if (result < 0) {
+      LOG(ERROR) << "PosixRandomReadFile: Error in reading file "
+                 << file_path_.c_str() << " at position " << offset
+                 << ", size " << size << ": " << strerror(-result);
+      return StoreResult::ReadFailure;
+    }
+    return (size_t)result < size ? StoreResult::EndOfFile
+                                 : StoreResult::Success;
+  }
+
+  void read_async_from(uint64_t offset, size_t size, uint8_t* data,
+                       size_t done, ReadCallback callback) {
+    std::vector<IoUringEngine::Request> requests(1);
+    requests[0].fd = fd_;
+    requests[0].file_index = file_index_;
+    requests[0].offset = offset + done;
+    requests[0].iov.assign(1, {data + done, size - done});
+    requests[0].completion = [this, offset, size, data, done,
+                              callback](int result) {
+      // Short reads are allowed to stop anywhere, so carry on until the
+      // kernel reports the end of the file
+      if (result > 0 && done + result < size) {
+        read_async_from(offset, size, data, done + result, callback);
+        return;
+      }
+      if (result < 0 && engine_->failed()) {
+        struct iovec iov = {data, size};
+        ssize_t total = preadv_fully(&iov, 1, offset, done);
+        callback(read_result(offset, size, total), total < 0 ? 0 : total);
+        return;
+      }
+      ssize_t total = result < 0 ? result : done + result;
+      callback(read_result(offset, size, total), result < 0 ? 0 : total);
+    };
+    engine_->submit(requests);
+  }
+
   const std::string file_path_;
-  FILE* fp_;
-  int position_;
+  int fd_;
+  IoUringEngine* engine_;
+  int file_index_;
+  // Set when the file was opened with O_DIRECT
+  std::shared_ptr<AlignedBufferPool> direct_pool_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// FileMapping
+namespace {
+
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// A read-only mapping of a whole file. Views hold a reference to it, so it is
+// only unmapped once the file and every view into it are gone.
+struct FileMapping {
+  ~FileMapping() {
+    if (data != nullptr) {
+      munmap(const_cast<uint8_t*>(data), size);
+    }
+  }
+
+  const uint8_t* data = nullptr;
+  size_t size = 0;
+};
+
+int madvise_flag(MmapAdvice advice) {
+  switch (advice) {
+    case MmapAdvice::Normal:
+      return MADV_NORMAL;
+    case MmapAdvice::Sequential:
+      return MADV_SEQUENTIAL;
+    case MmapAdvice::Random:
+      return MADV_RANDOM;
+    case MmapAdvice::WillNeed:
+      return MADV_WILLNEED;
+  }
+  return MADV_NORMAL;
+}
+
+// Maps at a 2MB boundary by reserving an oversized region and placing the
+// file mapping inside it, so the kernel can back it with huge pages
+void* mmap_huge_aligned(int fd, size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t reserved_size = size + HUGE_PAGE_SIZE;
+  void* reserved = mmap(nullptr, reserved_size, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(reserved);
+  uintptr_t aligned = (start + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  void* address = mmap(reinterpret_cast<void*>(aligned), size, PROT_READ,
+                       MAP_SHARED | MAP_FIXED, fd, 0);
+  if (address == MAP_FAILED) {
+    munmap(reserved, reserved_size);
+    return MAP_FAILED;
+  }
+  uintptr_t end = aligned + (size + page_size - 1) / page_size * page_size;
+  if (aligned > start) {
+    munmap(reserved, aligned - start);
+  }
+  if (start + reserved_size > end) {
+    munmap(reinterpret_cast<void*>(end), start + reserved_size - end);
+  }
+#ifdef MADV_HUGEPAGE
+  // Fails harmlessly where the filesystem has no huge page support
+  madvise(address, size, MADV_HUGEPAGE);
+#endif
+  return address;
+}
+
+StoreResult map_file(const std::string& file_path, const PosixConfig& config,
+                     std::shared_ptr<FileMapping>& mapping) {
+  int fd = open(file_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG(ERROR) << "Error opening file: " << strerror(errno);
+    return StoreResult::ReadFailure;
+  }
+  struct stat stat_buf;
+  if (fstat(fd, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+    close(fd);
+    return StoreResult::ReadFailure;
+  }
+
+  mapping.reset(new FileMapping);
+  size_t size = stat_buf.st_size;
+  if (size > 0) {
+    void* address = config.mmap_huge_pages
+                      ? mmap_huge_aligned(fd, size)
+                      : mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+      LOG(WARNING) << "Error mapping file " << file_path << ": "
+                   << strerror(errno);
+      close(fd);
+      mapping.reset();
+      return StoreResult::ReadFailure;
+    }
+    madvise(address, size, madvise_flag(config.mmap_advice));
+    mapping->data = static_cast<const uint8_t*>(address);
+    mapping->size = size;
+  }
+  close(fd);
+  return StoreResult::Success;
+}
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+/// PosixMappedRandomReadFile
+class PosixMappedRandomReadFile : public RandomReadFile {
+ public:
+  PosixMappedRandomReadFile(const std::string& file_path,
+                            std::shared_ptr<FileMapping> mapping)
+      : file_path_(file_path), mapping_(mapping) {}
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override {
+    const uint8_t* source;
+    StoreResult result = locate(offset, size, source, size_read);
+    if (size_read > 0) {
+      memcpy(data, source, size_read);
+    }
+    return result;
+  }
+
+  StoreResult read_many(std::vector<ReadRange>& ranges,
+                        size_t max_gap = DEFAULT_READ_MANY_GAP) override {
+    // Every range is a memcpy, so there is nothing to merge or overlap
+    for (ReadRange& range : ranges) {
+      range.result =
+        read(range.offset, range.size, range.data, range.size_read);
+    }
+    return read_many_result(ranges);
+  }
+
+  StoreResult read_view(uint64_t offset, size_t size,
+                        ReadView& view) override {
+    StoreResult result = locate(offset, size, view.data, view.size);
+    view.holder = mapping_;
+    return result;
+  }
+
+  StoreResult get_size(uint64_t& size) override {
+    size = mapping_->size;
+    return StoreResult::Success;
+  }
+
+  const std::string path() override { return file_path_; }
+
+ private:
+  StoreResult locate(uint64_t offset, size_t size, const uint8_t*& data,
+                     size_t& size_read) {
+    data = mapping_->data;
+    size_read = 0;
+    if (offset < mapping_->size) {
+      data += offset;
+      size_read = std::min((uint64_t)size, mapping_->size - offset);
+    }
+    return size_read < size ? StoreResult::EndOfFile : StoreResult::Success;
+  }
+
+  const std::string file_path_;
+  std::shared_ptr<FileMapping> mapping_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 /// PosixWriteFile
+namespace {
+
+std::atomic<uint64_t> temp_file_counter(0);
+
+// A hidden name next to file_path, so the rename on save stays within one
+// filesystem. Files left by a writer that crashed stay behind; see
+// PosixConfig::atomic_save.
+std::string temp_path_for(const std::string& file_path) {
+  size_t slash = file_path.rfind('/');
+  std::string directory =
+    slash == std::string::npos ? "" : file_path.substr(0, slash + 1);
+  std::string base =
+    slash == std::string::npos ? file_path : file_path.substr(slash + 1);
+  return directory + "." + base + ".tmp." + std::to_string(getpid()) + "." +
+         std::to_string(temp_file_counter++);
+}
+
+int fsync_directory(const std::string& file_path) {
+  size_t slash = file_path.rfind('/');
+  std::string directory =
+    slash == std::string::npos ? "." : file_path.substr(0, slash + 1);
+  int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  int rc = fsync(fd);
+  close(fd);
+  return rc;
+}
+
+// Copies the first length bytes of one file into another, inside the kernel
+// where the filesystem allows it
+bool copy_file_prefix(int from, int to, uint64_t length) {
+  uint64_t copied = 0;
+#ifdef __NR_copy_file_range
+  while (copied < length) {
+    loff_t in = copied;
+    loff_t out = copied;
+    ssize_t n = syscall(__NR_copy_file_range, from, &in, to, &out,
+                        (size_t)(length - copied), 0);
+    if (n > 0) {
+      copied += n;
+    } else if (n == 0) {
+      return false;
+    } else if (errno != EINTR) {
+      if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+          errno != EOPNOTSUPP) {
+        return false;
+      }
+      break;
+    }
+  }
+#endif
+  std::vector<uint8_t> buffer(std::min(length - copied, (uint64_t)1 << 20));
+  while (copied < length) {
+    ssize_t n = pread(from, buffer.data(),
+                      std::min((uint64_t)buffer.size(), length - copied),
+                      copied);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    for (ssize_t written = 0; written < n;) {
+      ssize_t w = pwrite(to, buffer.data() + written, n - written,
+                         copied + written);
+      if (w < 0 && errno != EINTR) {
+        return false;
+      }
+      written += std::max(w, (ssize_t)0);
+    }
+    copied += n;
+  }
+  return true;
+}
+
+}
+
+/* PosixWriteFile
+ *
+ * Stages appends in a large buffer and writes it out with pwrite, passing
+ * appends bigger than the buffer straight through. With atomic_save the data
+ * goes to a hidden temporary file that save renames into place; the first
+ * change after a save copies the published file to a new temporary file, so
+ * every save replaces the file with a single rename. With direct
+ * I/O the buffer comes from the aligned pool; save writes the trailing
+ * partial block padded and truncates the file back to its true length, and
+ * the block stays buffered to be rewritten in place by the next flush.
+ */
 class PosixWriteFile : public WriteFile {
  public:
-  PosixWriteFile(const std::string& file_path) : file_path_(file_path) {
+  PosixWriteFile(const std::string& file_path, const PosixConfig& config,
+                 std::shared_ptr<AlignedBufferPool> direct_pool)
+      : file_path_(file_path),
+        config_(config),
+        direct_pool_(direct_pool),
+        fd_(-1),
+        buffer_size_(0),
+        alignment_(1),
+        buffer_offset_(0),
+        buffer_used_(0),
+        reserved_(0),
+        unsynced_bytes_(0),
+        published_(false) {
     VLOG(1) << "PosixWriteFile: opening " << file_path.c_str()
             << " for writing.";
     char* path;
     path = strdup(file_path.c_str());
     LOG_IF(FATAL, path == NULL)
       << "PosixWriteFile: could not strdup " << file_path.c_str();
-    LOG_IF(FATAL, mkdir_p(dirname(path), S_IRWXU) != 0)
-      << "PosixWriteFile: could not mkdir " << path;
+    if (mkdir_p(dirname(path), S_IRWXU) != 0) {
+      LOG(ERROR) << "PosixWriteFile: could not mkdir " << path;
+      free(path);
+      return;
+    }
     free(path);
-    fp_ = fopen(file_path.c_str(), "w");
-    LOG_IF(FATAL, fp_ == NULL) << "PosixWriteFile: could not open "
-                               << file_path.c_str() << " for writing.";
+
+    write_path_ = config_.atomic_save ? temp_path_for(file_path) : file_path;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (config_.atomic_save) {
+      // Readable, so later saves can copy it after it is published
+      flags = O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC;
+    }
+    if (direct_pool_ != nullptr) {
+      fd_ = open(write_path_.c_str(), flags | O_DIRECT, 0666);
+      if (fd_ < 0 && errno == EINVAL) {
+        LOG(WARNING) << "PosixWriteFile: " << file_path.c_str()
+                     << " does not support O_DIRECT, writing through the "
+                     << "page cache";
+        // Some filesystems create the file before rejecting O_DIRECT. The
+        // temporary name is unique to this process, so whatever is there is
+        // ours to reopen.
+        fd_ = open(write_path_.c_str(), flags & ~O_EXCL, 0666);
+      }
+      buffer_ = direct_pool_->acquire(direct_pool_->buffer_size());
+      buffer_size_ = direct_pool_->buffer_size();
+      alignment_ = direct_pool_->alignment();
+    } else {
+      fd_ = open(write_path_.c_str(), flags, 0666);
+      buffer_size_ = std::max(config_.write_buffer_size, (uint64_t)1);
+      buffer_.reset(new uint8_t[buffer_size_],
+                    std::default_delete<uint8_t[]>());
+    }
+    if (fd_ < 0) {
+      LOG(ERROR) << "PosixWriteFile: could not open " << write_path_.c_str()
+                 << " for writing: " << strerror(errno);
+    }
   }
 
   ~PosixWriteFile() {
-    save();
-    if (fp_ != NULL) {
-      fclose(fp_);
+    StoreResult result = save();
+    if (fd_ >= 0) {
+      close(fd_);
+      if (result != StoreResult::Success && write_path_ != file_path_ &&
+          !published_) {
+        unlink(write_path_.c_str());
+      }
     }
   }
 
+  bool is_open() const { return fd_ >= 0 && buffer_ != nullptr; }
+
   StoreResult append(size_t size, const uint8_t* data) override {
-    size_t size_written = fwrite(data, sizeof(uint8_t), size, fp_);
-    LOG_IF(FATAL, size_written != size)
-      << "PosixWriteFile: did not write all " << size << " "
-      << "bytes for file " << file_path_.c_str() << ".";
+    if (!is_open()) {
+      return StoreResult::SaveFailure;
+    }
+    if (published_) {
+      StoreResult result = restage();
+      if (result != StoreResult::Success) {
+        return result;
+      }
+    }
+    // Appends larger than the buffer are written straight from the caller
+    // when nothing is staged ahead of them
+    if (alignment_ == 1 && buffer_used_ == 0 && size >= buffer_size_) {
+      StoreResult result = write_fully(data, size, buffer_offset_);
+      if (result == StoreResult::Success) {
+        buffer_offset_ += size;
+      }
+      return result;
+    }
+
+    while (size > 0) {
+      size_t copied = std::min(size, buffer_size_ - buffer_used_);
+      memcpy(buffer_.get() + buffer_used_, data, copied);
+      buffer_used_ += copied;
+      data += copied;
+      size -= copied;
+      if (buffer_used_ == buffer_size_) {
+        StoreResult result = flush(false);
+        if (result != StoreResult::Success) {
+          return result;
+        }
+      }
+    }
+    return StoreResult::Success;
+  }
+
+  StoreResult reserve(uint64_t size) override {
+    if (!is_open()) {
+      return StoreResult::SaveFailure;
+    }
+    if (size <= reserved_) {
+      return StoreResult::Success;
+    }
+    if (published_) {
+      StoreResult result = restage();
+      if (result != StoreResult::Success) {
+        return result;
+      }
+    }
+    // The file keeps its size, so nobody reading it, now or after a crash,
+    // sees the reserved space as trailing zeros
+    if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size) != 0) {
+      if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        return StoreResult::Success;
+      }
+      LOG(ERROR) << "PosixWriteFile: could not reserve " << size
+                 << " bytes for " << file_path_.c_str() << ": "
+                 << strerror(errno);
+      return StoreResult::SaveFailure;
+    }
+    reserved_ = size;
     return StoreResult::Success;
   }
 
   StoreResult save() override {
-    fflush(fp_);
+    if (!is_open()) {
+      return StoreResult::SaveFailure;
+    }
+    if (published_) {
+      // Nothing changed since the last save
+      return StoreResult::Success;
+    }
+    StoreResult result = flush(true);
+    if (result != StoreResult::Success) {
+      return result;
+    }
+
+    // Release whatever was reserved beyond the end of the data
+    uint64_t size = buffer_offset_ + buffer_used_;
+    if (reserved_ > size) {
+      if (ftruncate(fd_, size) != 0) {
+        return write_error("truncating", size);
+      }
+      reserved_ = 0;
+    }
+
+    if (config_.sync_policy != PosixSyncPolicy::None) {
+      if (fdatasync(fd_) != 0) {
+        return write_error("syncing", size);
+      }
+      unsynced_bytes_ = 0;
+    }
+
+    if (write_path_ != file_path_ && !published_) {
+      if (rename(write_path_.c_str(), file_path_.c_str()) != 0) {
+        return write_error("renaming", size);
+      }
+      published_ = true;
+      if (config_.sync_policy == PosixSyncPolicy::Full &&
+          fsync_directory(file_path_) != 0) {
+        return write_error("syncing the directory of", size);
+      }
+    }
     return StoreResult::Success;
   }
 
   const std::string path() override { return file_path_; }
 
  private:
+  // Continues in a new temporary file holding what the last save published
+  StoreResult restage() {
+    std::string temp_path = temp_path_for(file_path_);
+    int fd =
+      open(temp_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      return write_error("creating a new temporary file for", 0);
+    }
+    // Copied through the page cache, then direct I/O resumes if it was on
+    int flags = fcntl(fd_, F_GETFL);
+    struct stat stat_buf;
+    if (flags < 0 || fcntl(fd_, F_SETFL, flags & ~O_DIRECT) != 0 ||
+        fstat(fd_, &stat_buf) != 0 ||
+        !copy_file_prefix(fd_, fd, stat_buf.st_size) ||
+        fcntl(fd, F_SETFL, flags) != 0) {
+      StoreResult result = write_error("copying", 0);
+      close(fd);
+      unlink(temp_path.c_str());
+      return result;
+    }
+    close(fd_);
+    fd_ = fd;
+    write_path_ = temp_path;
+    reserved_ = 0;
+    published_ = false;
+    return StoreResult::Success;
+  }
+
+  StoreResult flush(bool include_tail) {
+    size_t whole_blocks = buffer_used_ / alignment_ * alignment_;
+    size_t length = whole_blocks;
+    if (include_tail && whole_blocks < buffer_used_) {
+      length += alignment_;
+    }
+    memset(buffer_.get() + buffer_used_, 0, length - buffer_used_);
+    StoreResult result = write_fully(buffer_.get(), length, buffer_offset_);
+    if (result != StoreResult::Success) {
+      return result;
+    }
+    if (length > buffer_used_ &&
+        ftruncate(fd_, buffer_offset_ + buffer_used_) != 0) {
+      return write_error("truncating", buffer_offset_ + buffer_used_);
+    }
+
+    memmove(buffer_.get(), buffer_.get() + whole_blocks,
+            buffer_used_ - whole_blocks);
+    buffer_offset_ += whole_blocks;
+    buffer_used_ -= whole_blocks;
+    return StoreResult::Success;
+  }
+
+  StoreResult write_fully(const uint8_t* data, size_t size, uint64_t offset) {
+    size_t written = 0;
+    while (written < size) {
+      ssize_t n = pwrite(fd_, data + written, size - written, offset + written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return write_error("writing", offset + written);
+      }
+      written += n;
+    }
+
+    unsynced_bytes_ += size;
+    if (config_.sync_policy != PosixSyncPolicy::None &&
+        config_.sync_interval_bytes > 0 &&
+        unsynced_bytes_ >= config_.sync_interval_bytes) {
+      if (fdatasync(fd_) != 0) {
+        return write_error("syncing", offset + size);
+      }
+      unsynced_bytes_ = 0;
+    }
+    return StoreResult::Success;
+  }
+
+  StoreResult write_error(const std::string& action, uint64_t position) {
+    LOG(ERROR) << "PosixWriteFile: Error in " << action << " file "
+               << file_path_.c_str() << " at position " << position << ": "
+               << strerror(errno);
+    return StoreResult::SaveFailure;
+  }
+
   const std::string file_path_;
-  FILE* fp_;
+  const PosixConfig config_;
+  std::shared_ptr<AlignedBufferPool> direct_pool_;
+  // The temporary file written until the next save publishes it
+  std::string write_path_;
+  int fd_;
+  std::shared_ptr<uint8_t> buffer_;
+  size_t buffer_size_;
+  size_t alignment_;
+  // File offset of the start of buffer_, aligned for direct I/O
+  uint64_t buffer_offset_;
+  size_t buffer_used_;
+  uint64_t reserved_;
+  uint64_t unsynced_bytes_;
+  // Set when a save has renamed write_path_ into place and nothing has
+  // changed since
+  bool published_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// PosixDirectoryListing
+namespace {
+
+// The record layout getdents64 fills in, which glibc does not export
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+const size_t DIRENT_BUFFER_SIZE = 64 * 1024;
+const size_t LISTING_PAGE_SIZE = 1000;
+
+// There is no content hash to hand, so identify the version by inode,
+// modification time and size
+std::string file_etag(uint64_t inode, int64_t mtime_sec, int64_t mtime_nsec,
+                      uint64_t size) {
+  std::stringstream etag;
+  etag << inode << "-" << mtime_sec << "." << mtime_nsec << "-" << size;
+  return etag.str();
+}
+
+void fill_file_info(const struct stat& stat_buf, FileInfo& file_info) {
+  file_info.file_exists = true;
+  file_info.file_is_folder = S_ISDIR(stat_buf.st_mode);
+  file_info.size = stat_buf.st_size;
+  file_info.mtime = (int64_t)stat_buf.st_mtim.tv_sec * 1000000000 +
+                    stat_buf.st_mtim.tv_nsec;
+  file_info.etag = file_etag(stat_buf.st_ino, stat_buf.st_mtim.tv_sec,
+                             stat_buf.st_mtim.tv_nsec, stat_buf.st_size);
+}
+
+#ifdef STATX_BASIC_STATS
+// Asks only for what FileInfo needs, which saves network filesystems from
+// fetching the rest
+StoreResult statx_file_info(const std::string& name, FileInfo& file_info) {
+  struct statx statx_buf;
+  if (statx(AT_FDCWD, name.c_str(), 0,
+            STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME,
+            &statx_buf) < 0) {
+    file_info.file_exists = false;
+    return StoreResult::FileDoesNotExist;
+  }
+  file_info.file_exists = true;
+  file_info.file_is_folder = S_ISDIR(statx_buf.stx_mode);
+  file_info.size = statx_buf.stx_size;
+  file_info.mtime = statx_buf.stx_mtime.tv_sec * 1000000000 +
+                    statx_buf.stx_mtime.tv_nsec;
+  file_info.etag = file_etag(statx_buf.stx_ino, statx_buf.stx_mtime.tv_sec,
+                             statx_buf.stx_mtime.tv_nsec, statx_buf.stx_size);
+  return StoreResult::Success;
+}
+#endif
+
+}
+
+/* PosixDirectoryListing
+ *
+ * Reads directory records in large batches with getdents64 and stats each
+ * entry relative to the open directory. A recursive listing walks folders
+ * depth first, keeping only the folders still to visit, and lists each
+ * folder as well as what is inside it. Symlinks to folders are listed but
+ * not followed, so a link cycle cannot make the walk loop. Folders below the
+ * first that cannot be opened are skipped with a warning.
+ */
+class PosixDirectoryListing : public DirectoryListing {
+ public:
+  PosixDirectoryListing(const std::string& name, bool recursive)
+      : recursive_(recursive), fd_(-1), buffer_(DIRENT_BUFFER_SIZE) {
+    pending_.push_back(name);
+  }
+
+  ~PosixDirectoryListing() {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  /* open_next
+   *
+   * Opens the next folder waiting to be listed, which leaves the queue
+   * whether or not it could be opened.
+   */
+  StoreResult open_next() {
+    directory_ = pending_.back();
+    pending_.pop_back();
+    fd_ = open(directory_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd_ < 0) {
+      if (errno == ENOENT) {
+        return StoreResult::FileDoesNotExist;
+      }
+      LOG(WARNING) << "PosixDirectoryListing: Error opening "
+                   << directory_.c_str() << ": " << strerror(errno);
+      return StoreResult::ReadFailure;
+    }
+    if (!directory_.empty() && directory_.back() != '/') {
+      directory_ += '/';
+    }
+    return StoreResult::Success;
+  }
+
+  StoreResult next_page(std::vector<DirectoryEntry>& entries) override {
+    entries.clear();
+    while (entries.size() < LISTING_PAGE_SIZE) {
+      if (fd_ < 0) {
+        if (pending_.empty()) {
+          return StoreResult::EndOfFile;
+        }
+        // A folder removed while the walk was under way, or one that cannot
+        // be read, is skipped so the rest of the walk still completes
+        open_next();
+        continue;
+      }
+
+      long bytes =
+        syscall(SYS_getdents64, fd_, buffer_.data(), buffer_.size());
+      if (bytes < 0) {
+        LOG(WARNING) << "PosixDirectoryListing: Error reading "
+                     << directory_.c_str() << ": " << strerror(errno);
+        return StoreResult::ReadFailure;
+      }
+      if (bytes == 0) {
+        close(fd_);
+        fd_ = -1;
+        continue;
+      }
+      for (long pos = 0; pos < bytes;) {
+        const linux_dirent64* record =
+          reinterpret_cast<const linux_dirent64*>(buffer_.data() + pos);
+        pos += record->d_reclen;
+        StoreResult result = add_entry(*record, entries);
+        if (result != StoreResult::Success) {
+          return result;
+        }
+      }
+    }
+    return StoreResult::Success;
+  }
+
+ private:
+  StoreResult add_entry(const linux_dirent64& record,
+                        std::vector<DirectoryEntry>& entries) {
+    const char* name = record.d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      return StoreResult::Success;
+    }
+    struct stat stat_buf;
+    if (fstatat(fd_, name, &stat_buf, 0) < 0) {
+      if (errno == ENOENT) {
+        // Removed since the record was read, or a dangling symlink
+        return StoreResult::Success;
+      }
+      LOG(WARNING) << "PosixDirectoryListing: Error reading " << directory_
+                   << name << ": " << strerror(errno);
+      return StoreResult::ReadFailure;
+    }
+
+    entries.emplace_back();
+    entries.back().name = directory_ + name;
+    fill_file_info(stat_buf, entries.back().info);
+
+    if (S_ISDIR(stat_buf.st_mode) && recursive_) {
+      bool is_link = record.d_type == DT_LNK;
+      struct stat link_buf;
+      if (record.d_type == DT_UNKNOWN &&
+          fstatat(fd_, name, &link_buf, AT_SYMLINK_NOFOLLOW) == 0) {
+        is_link = S_ISLNK(link_buf.st_mode);
+      }
+      if (!is_link) {
+        pending_.push_back(entries.back().name);
+      }
+    }
+    return StoreResult::Success;
+  }
+
+  const bool recursive_;
+  // Folders still to be listed, the next one at the back
+  std::vector<std::string> pending_;
+  // The folder being read, with a trailing slash
+  std::string directory_;
+  int fd_;
+  std::vector<uint8_t> buffer_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 /// PosixStorage
-PosixStorage::PosixStorage(PosixConfig config) {}
+PosixStorage::PosixStorage(PosixConfig config) : config_(config) {
+  if (config_.use_io_uring) {
+    IoUringOptions options;
+    options.queue_depth = config_.io_uring_queue_depth;
+    options.reaper_threads = config_.io_uring_reaper_threads;
+    io_uring_.reset(IoUringEngine::make(options));
+    LOG_IF(WARNING, io_uring_ == nullptr)
+      << "PosixStorage: falling back to pread";
+  }
+  if (config_.use_direct_io) {
+    size_t alignment = config_.direct_io_alignment;
+    size_t buffer_size = config_.direct_io_buffer_size;
+    if (!AlignedBufferPool::valid(alignment, buffer_size)) {
+      PosixConfig defaults;
+      alignment = defaults.direct_io_alignment;
+      buffer_size = defaults.direct_io_buffer_size;
+      LOG(WARNING) << "PosixStorage: direct_io_alignment must be a power of "
+                   << "two and direct_io_buffer_size a multiple of it, using "
+                   << alignment << " and " << buffer_size;
+    }
+    direct_pool_ = std::make_shared<AlignedBufferPool>(alignment, buffer_size);
+  }
+}
 
 PosixStorage::~PosixStorage() {}
 
+bool PosixStorage::uses_io_uring() const {
+  return io_uring_ != nullptr && !io_uring_->failed();
+}
+
 StoreResult PosixStorage::get_file_info(const std::string& name,
                                         FileInfo& file_info) {
   struct stat stat_buf;
   int rc = stat(name.c_str(), &stat_buf);
   if (rc == 0) {
-    file_info.file_is_folder = false;
-    if (S_ISDIR(stat_buf.st_mode)) {
-      file_info.file_is_folder = true;
-    }
-
-    file_info.size = stat_buf.st_size;
-    file_info.file_exists = true;
+    fill_file_info(stat_buf, file_info);
     return StoreResult::Success;
   } else {
     file_info.file_exists = false;
@@ -169,6 +1274,22 @@ StoreResult PosixStorage::get_file_info(const std::string& name,
   }
 }
 
+StoreResult PosixStorage::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  file_infos.assign(names.size(), FileInfo());
+  results.assign(names.size(), StoreResult::Success);
+  io_executor()->parallel_for(
+    names.size(), config_.file_info_concurrency, [&](size_t i) {
+#ifdef STATX_BASIC_STATS
+      results[i] = statx_file_info(names[i], file_infos[i]);
+#else
+      results[i] = get_file_info(names[i], file_infos[i]);
+#endif
+    });
+  return file_info_many_result(results);
+}
+
 StoreResult PosixStorage::make_random_read_file(const std::string& name,
                                                 RandomReadFile*& file) {
   FileInfo file_info;
@@ -176,13 +1297,26 @@ StoreResult PosixStorage::make_random_read_file(const std::string& name,
   if ((result = get_file_info(name, file_info)) != StoreResult::Success) {
     return result;
   }
-  file = new PosixRandomReadFile(name);
+  if (config_.use_mmap) {
+    std::shared_ptr<FileMapping> mapping;
+    if (map_file(name, config_, mapping) == StoreResult::Success) {
+      file = new PosixMappedRandomReadFile(name, mapping);
+      return StoreResult::Success;
+    }
+    // Files that cannot be mapped are still readable with pread
+  }
+  file = new PosixRandomReadFile(name, io_uring_.get(), direct_pool_);
   return StoreResult::Success;
 }
 
 StoreResult PosixStorage::make_write_file(const std::string& name,
                                           WriteFile*& file) {
-  file = new PosixWriteFile(name);
+  PosixWriteFile* posix_file = new PosixWriteFile(name, config_, direct_pool_);
+  if (!posix_file->is_open()) {
+    delete posix_file;
+    return StoreResult::SaveFailure;
+  }
+  file = posix_file;
   return StoreResult::Success;
 }
 
@@ -207,20 +1341,118 @@ StoreResult PosixStorage::delete_file(const std::string& name) {
   return StoreResult::Success;
 }
 
-int rm_r(const char* path, const struct stat* info, int tflag,
-         struct FTW* ftwbuf) {
-  if (tflag == FTW_F) {
-    return remove(path);
-  } else if (tflag == FTW_D || tflag == FTW_DP) {
-    return rmdir(path);
-  } else {
-    return -1;
+namespace {
+
+/* Removes the files inside the folder open as dir_fd, spreading them over
+ * the io_executor, and adds its subfolders to subfolders. The whole folder
+ * is read before anything is removed, since a directory stream may skip
+ * entries when others are removed while it is being read. Symlinks are
+ * removed, not followed. Returns false if anything could not be removed. */
+bool remove_files(int dir_fd, size_t concurrency,
+                  std::vector<std::string>& subfolders) {
+  int list_fd = dup(dir_fd);
+  DIR* dir = list_fd < 0 ? nullptr : fdopendir(list_fd);
+  if (dir == nullptr) {
+    if (list_fd >= 0) {
+      close(list_fd);
+    }
+    return false;
+  }
+
+  std::vector<std::string> files;
+  while (struct dirent* entry = readdir(dir)) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    bool is_dir = entry->d_type == DT_DIR;
+    struct stat stat_buf;
+    if (entry->d_type == DT_UNKNOWN &&
+        fstatat(dir_fd, entry->d_name, &stat_buf, AT_SYMLINK_NOFOLLOW) == 0) {
+      is_dir = S_ISDIR(stat_buf.st_mode);
+    }
+    (is_dir ? subfolders : files).emplace_back(entry->d_name);
   }
+  closedir(dir);
+
+  std::atomic<bool> removed_all(true);
+  io_executor()->parallel_for(files.size(), concurrency, [&](size_t i) {
+    if (unlinkat(dir_fd, files[i].c_str(), 0) < 0 && errno != ENOENT) {
+      LOG(WARNING) << "PosixStorage: Error removing " << files[i] << ": "
+                   << strerror(errno);
+      removed_all = false;
+    }
+  });
+  return removed_all;
+}
+
+// A folder being emptied by remove_contents
+struct RemovingFolder {
+  int fd;
+  // Name in the folder below it on the stack
+  std::string name;
+  // Subfolders not yet emptied
+  std::vector<std::string> subfolders;
+};
+
+/* Removes everything inside the folder open as dir_fd. Subfolders are
+ * walked depth first from an explicit stack holding one descriptor per
+ * level, and each is removed once everything inside it has been. Returns
+ * false if anything could not be removed. */
+bool remove_contents(int dir_fd, size_t concurrency) {
+  std::vector<RemovingFolder> stack(1);
+  stack[0].fd = dir_fd;
+  bool removed_all = remove_files(dir_fd, concurrency, stack[0].subfolders);
+  while (true) {
+    RemovingFolder& folder = stack.back();
+    if (!folder.subfolders.empty()) {
+      std::string name = std::move(folder.subfolders.back());
+      folder.subfolders.pop_back();
+      int child_fd = openat(folder.fd, name.c_str(),
+                            O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if (child_fd < 0) {
+        if (errno != ENOENT) {
+          LOG(WARNING) << "PosixStorage: Error opening " << name << ": "
+                       << strerror(errno);
+          removed_all = false;
+        }
+        continue;
+      }
+      stack.emplace_back();
+      stack.back().fd = child_fd;
+      stack.back().name = name;
+      if (!remove_files(child_fd, concurrency, stack.back().subfolders)) {
+        removed_all = false;
+      }
+      continue;
+    }
+
+    if (stack.size() == 1) {
+      // The caller removes dir_fd's own folder
+      return removed_all;
+    }
+    close(folder.fd);
+    std::string name = std::move(folder.name);
+    stack.pop_back();
+    if (unlinkat(stack.back().fd, name.c_str(), AT_REMOVEDIR) < 0 &&
+        errno != ENOENT) {
+      LOG(WARNING) << "PosixStorage: Error removing " << name << ": "
+                   << strerror(errno);
+      removed_all = false;
+    }
+  }
+}
+
 }
 
 StoreResult PosixStorage::delete_dir(const std::string& name, bool recursive) {
   if (recursive) {
-    if (nftw(name.c_str(), rm_r, 20, FTW_DEPTH | FTW_PHYS) < 0) {
+    int dir_fd = open(name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+      return StoreResult::RemoveFailure;
+    }
+    bool removed_all = remove_contents(dir_fd, config_.delete_concurrency);
+    close(dir_fd);
+    if (!removed_all) {
       return StoreResult::RemoveFailure;
     }
   }
@@ -231,4 +1463,18 @@ StoreResult PosixStorage::delete_dir(const std::string& name, bool recursive) {
 
   return StoreResult::Success;
 }
+
+StoreResult PosixStorage::make_directory_listing(const std::string& name,
+                                                 bool recursive,
+                                                 DirectoryListing*& listing) {
+  PosixDirectoryListing* posix_listing =
+    new PosixDirectoryListing(name, recursive);
+  StoreResult result = posix_listing->open_next();
+  if (result != StoreResult::Success) {
+    delete posix_listing;
+    return result;
+  }
+  listing = posix_listing;
+  return StoreResult::Success;
+}
 }
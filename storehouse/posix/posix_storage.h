@@ -18,9 +18,76 @@
 #include "storehouse/storage_backend.h"
 #include "storehouse/storage_config.h"
 
+#include <memory>
+
 namespace storehouse {
 
-struct PosixConfig : public StorageConfig {};
+class AlignedBufferPool;
+class IoUringEngine;
+
+// Access pattern passed to madvise for memory-mapped files
+enum class MmapAdvice {
+  Normal,
+  Sequential,
+  Random,
+  WillNeed,
+};
+
+// When saved files are flushed to stable storage
+enum class PosixSyncPolicy {
+  // Never; a crash may lose or truncate recently saved files
+  None,
+  // fdatasync the file before save returns, and before it is renamed into
+  // place with atomic_save
+  Data,
+  // Data, and also fsync the directory after the rename so the new name
+  // survives a crash
+  Full,
+};
+
+struct PosixConfig : public StorageConfig {
+  // Serve reads from a read-only mapping of the whole file, which lets
+  // read_view return pointers into the page cache. The mapping reflects the
+  // file's size when it was opened; truncating a mapped file while it is
+  // being read is not supported.
+  bool use_mmap = false;
+  MmapAdvice mmap_advice = MmapAdvice::Normal;
+  // Align mappings to 2MB and ask for transparent huge pages. Only takes
+  // effect where the kernel supports huge pages for file mappings.
+  bool mmap_huge_pages = false;
+  // Issue asynchronous and batched reads through io_uring, using pread when
+  // the kernel does not support it. Ignored for memory-mapped files.
+  bool use_io_uring = false;
+  uint32_t io_uring_queue_depth = 128;
+  uint32_t io_uring_reaper_threads = 1;
+  // Read and write with O_DIRECT so large transfers bypass the page cache.
+  // Offsets, lengths and buffers are aligned internally, staging through a
+  // pool of aligned buffers of direct_io_buffer_size bytes. Ignored for
+  // memory-mapped reads. The alignment must be a power of two and the
+  // buffer size a multiple of it, or both defaults are used.
+  bool use_direct_io = false;
+  uint32_t direct_io_alignment = 4096;
+  uint64_t direct_io_buffer_size = 4 * 1024 * 1024;
+  // Appends are staged in a buffer this large before each pwrite
+  uint64_t write_buffer_size = 8 * 1024 * 1024;
+  // Write to a hidden temporary file that save renames into place, so
+  // readers never see a partial file. Appending after a save first copies
+  // the file to a new temporary one, which costs a copy of the data saved
+  // so far. Temporary files are named .<name>.tmp.<pid>.<n> next to the
+  // file; those of a writer that crashed are not removed by storehouse, as
+  // finding them would mean scanning the folder on every open.
+  bool atomic_save = true;
+  PosixSyncPolicy sync_policy = PosixSyncPolicy::None;
+  // Unless the policy is None, also fdatasync after every this many bytes
+  // written, bounding the dirty data outstanding at any time. 0 disables.
+  uint64_t sync_interval_bytes = 0;
+  // Files get_file_info_many stats at once, limited by the size of the
+  // shared io_executor
+  uint32_t file_info_concurrency = 16;
+  // Entries delete_dir removes at once when deleting recursively, also
+  // limited by the size of the shared io_executor
+  uint32_t delete_concurrency = 16;
+};
 
 class PosixStorage : public StorageBackend {
  public:
@@ -31,6 +98,10 @@ class PosixStorage : public StorageBackend {
   StoreResult get_file_info(const std::string& name,
                             FileInfo& file_info) override;
 
+  StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                 std::vector<FileInfo>& file_infos,
+                                 std::vector<StoreResult>& results) override;
+
   /* make_random_read_file
    *
    */
@@ -50,7 +121,20 @@ class PosixStorage : public StorageBackend {
   StoreResult delete_dir(const std::string& name,
                          bool recursive = false) override;
 
+  StoreResult make_directory_listing(const std::string& name, bool recursive,
+                                     DirectoryListing*& listing) override;
+
+  /* uses_io_uring
+   *
+   * Whether reads go through io_uring, which takes use_io_uring and a kernel
+   * that supports it. Turns false if the engine fails later on.
+   */
+  bool uses_io_uring() const;
+
  protected:
   const std::string data_directory_;
+  const PosixConfig config_;
+  std::unique_ptr<IoUringEngine> io_uring_;
+  std::shared_ptr<AlignedBufferPool> direct_pool_;
 };
 }
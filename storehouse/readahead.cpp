@@ -0,0 +1,177 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/readahead.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace storehouse {
+
+namespace {
+// Prefetched windows kept ahead of the reader
+const size_t MAX_SEGMENTS = 2;
+}
+
+ReadaheadRandomReadFile::ReadaheadRandomReadFile(RandomReadFile* file,
+                                                 ReadaheadOptions options)
+    : file_(file),
+      options_(options),
+      inflight_(0),
+      next_offset_(0),
+      sequential_reads_(0),
+      window_(options.min_window),
+      end_of_file_(false) {}
+
+ReadaheadRandomReadFile::~ReadaheadRandomReadFile() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this] { return inflight_ == 0; });
+}
+
+StoreResult ReadaheadRandomReadFile::read(uint64_t offset, size_t size,
+                                          uint8_t* data, size_t& size_read) {
+  size_read = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  if (offset == next_offset_) {
+    sequential_reads_++;
+  } else {
+    // Random access: stop prefetching until reads line up again
+    sequential_reads_ = 0;
+    window_ = options_.min_window;
+    drop_segments();
+  }
+  next_offset_ = offset + size;
+
+  // Serve what we can from prefetched windows, oldest first
+  while (size_read < size && !segments_.empty()) {
+    std::shared_ptr<Segment> segment = segments_.front();
+    uint64_t position = offset + size_read;
+    if (position < segment->offset) {
+      break;
+    }
+    if (!segment->done) {
+      // The reader caught up with the prefetch, so reach further ahead
+      window_ = std::min(window_ * 2, options_.max_window);
+      cv_.wait(lock, [&] { return segment->done; });
+    }
+    if (segment->result != StoreResult::Success &&
+        segment->result != StoreResult::EndOfFile) {
+      // Let the direct read below surface or retry the error
+      drop_segments();
+      break;
+    }
+    uint64_t segment_end = segment->offset + segment->size_read;
+    if (position < segment_end) {
+      size_t length =
+        std::min((uint64_t)(size - size_read), segment_end - position);
+      memcpy(data + size_read,
+             segment->data.data() + (position - segment->offset), length);
+      size_read += length;
+    }
+    if (offset + size_read >= segment_end) {
+      if (segment->result == StoreResult::EndOfFile) {
+        end_of_file_ = true;
+        segments_.clear();
+        break;
+      }
+      segments_.pop_front();
+    }
+  }
+
+  StoreResult result = StoreResult::Success;
+  if (size_read < size) {
+    if (end_of_file_ && segments_.empty() && size_read > 0) {
+      result = StoreResult::EndOfFile;
+    } else {
+      // Not prefetched: read the rest directly. Nothing in flight can cover
+      // it, since windows always start where the previous one ended.
+      drop_segments();
+      size_t direct_read = 0;
+      uint64_t position = offset + size_read;
+      lock.unlock();
+      result = file_->read(position, size - size_read, data + size_read,
+                           direct_read);
+      lock.lock();
+      size_read += direct_read;
+      end_of_file_ = result == StoreResult::EndOfFile;
+    }
+  }
+
+  if (sequential_reads_ >= options_.sequential_trigger && !end_of_file_ &&
+      result == StoreResult::Success) {
+    std::vector<std::shared_ptr<Segment>> started = plan_prefetch();
+    // Issued without the lock in case a completion runs on this thread
+    lock.unlock();
+    for (const std::shared_ptr<Segment>& segment : started) {
+      prefetch(segment);
+    }
+  }
+  return result;
+}
+
+StoreResult ReadaheadRandomReadFile::get_size(uint64_t& size) {
+  return file_->get_size(size);
+}
+
+const std::string ReadaheadRandomReadFile::path() { return file_->path(); }
+
+std::vector<std::shared_ptr<ReadaheadRandomReadFile::Segment>>
+ReadaheadRandomReadFile::plan_prefetch() {
+  std::vector<std::shared_ptr<Segment>> started;
+  while (segments_.size() < MAX_SEGMENTS) {
+    uint64_t offset =
+      segments_.empty()
+        ? next_offset_
+        : segments_.back()->offset + segments_.back()->data.size();
+    std::shared_ptr<Segment> segment = std::make_shared<Segment>();
+    segment->offset = offset;
+    segment->data.resize(window_);
+    segments_.push_back(segment);
+    started.push_back(segment);
+    inflight_++;
+  }
+  return started;
+}
+
+void ReadaheadRandomReadFile::prefetch(std::shared_ptr<Segment> segment) {
+  segment->start = std::chrono::steady_clock::now();
+  file_->read_async(
+    segment->offset, segment->data.size(), segment->data.data(),
+    [this, segment](StoreResult result, size_t size_read) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      segment->result = result;
+      segment->size_read = size_read;
+      segment->done = true;
+
+      double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - segment->start)
+                         .count();
+      if (result == StoreResult::Success && seconds > 0) {
+        // Size the window so a fetch lasts about target_fetch_seconds
+        size_t target = size_read / seconds * options_.target_fetch_seconds;
+        window_ = std::max(window_, std::min(target, options_.max_window));
+      }
+      inflight_--;
+      cv_.notify_all();
+    });
+}
+
+void ReadaheadRandomReadFile::drop_segments() {
+  // In-flight reads keep their segment alive until they complete
+  segments_.clear();
+  end_of_file_ = false;
+}
+}
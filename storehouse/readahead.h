@@ -0,0 +1,97 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/storage_backend.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace storehouse {
+
+struct ReadaheadOptions {
+  // Bounds on how far ahead of the reader each prefetch reaches
+  size_t min_window = 1024 * 1024;
+  size_t max_window = 64 * 1024 * 1024;
+  // Consecutive sequential reads needed before prefetching starts
+  int sequential_trigger = 2;
+  // The window is sized so one prefetch takes about this long at the
+  // throughput observed so far
+  double target_fetch_seconds = 0.25;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// ReadaheadRandomReadFile
+/* Wraps a RandomReadFile and, once reads start following each other, fetches
+ * the next window of the file in the background with read_async. Up to two
+ * windows are kept in flight. The window doubles whenever the reader has to
+ * wait for a prefetch, and otherwise tracks the observed throughput. A read
+ * that does not continue where the last one ended drops the prefetched data
+ * and stops prefetching until reads become sequential again.
+ */
+class ReadaheadRandomReadFile : public RandomReadFile {
+ public:
+  /* Takes ownership of file. */
+  ReadaheadRandomReadFile(RandomReadFile* file,
+                          ReadaheadOptions options = ReadaheadOptions());
+
+  /* Waits for outstanding prefetches, which write into this object. */
+  ~ReadaheadRandomReadFile();
+
+  StoreResult read(uint64_t offset, size_t size, uint8_t* data,
+                   size_t& size_read) override;
+
+  StoreResult get_size(uint64_t& size) override;
+
+  const std::string path() override;
+
+  size_t window() { return window_; }
+
+ private:
+  struct Segment {
+    uint64_t offset;
+    std::vector<uint8_t> data;
+    bool done = false;
+    StoreResult result = StoreResult::Success;
+    size_t size_read = 0;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  /* Reserves the windows to fetch next; called with mutex_ held. */
+  std::vector<std::shared_ptr<Segment>> plan_prefetch();
+
+  void prefetch(std::shared_ptr<Segment> segment);
+
+  void drop_segments();
+
+  std::unique_ptr<RandomReadFile> file_;
+  const ReadaheadOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::shared_ptr<Segment>> segments_;
+  int inflight_;
+
+  uint64_t next_offset_;
+  int sequential_reads_;
+  size_t window_;
+  bool end_of_file_;
+};
+}
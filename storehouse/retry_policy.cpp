@@ -0,0 +1,142 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/retry_policy.h"
+#include "storehouse/storage_backend.h"
+
+#include <glog/logging.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+
+namespace storehouse {
+
+namespace {
+
+const int64_t MILLITOKENS = 1000;
+
+double random_between(double low, double high) {
+  static thread_local std::mt19937_64 generator(std::random_device{}());
+  if (high <= low) {
+    return low;
+  }
+  return std::uniform_real_distribution<double>(low, high)(generator);
+}
+
+}
+
+RetryPolicy::RetryPolicy(RetryOptions options)
+    : options_(options),
+      budget_(options.budget_tokens * MILLITOKENS),
+      calls_(0),
+      retries_(0),
+      recovered_(0),
+      exhausted_(0),
+      budget_rejections_(0) {}
+
+StoreResult RetryPolicy::run(const std::function<StoreResult()>& operation) {
+  calls_++;
+  auto start = std::chrono::steady_clock::now();
+  double delay_ms = options_.base_delay_ms;
+  for (uint32_t attempt = 1;; ++attempt) {
+    StoreResult result = operation();
+    if (result != StoreResult::TransientFailure) {
+      deposit_tokens();
+      if (attempt > 1) {
+        recovered_++;
+      }
+      return result;
+    }
+
+    if (options_.max_attempts > 0 && attempt >= options_.max_attempts) {
+      LOG(WARNING) << "RetryPolicy: giving up after " << attempt
+                   << " attempts.";
+      exhausted_++;
+      return result;
+    }
+    delay_ms = std::min((double)options_.max_delay_ms,
+                        random_between(options_.base_delay_ms, delay_ms * 3));
+    if (options_.deadline_ms > 0) {
+      double elapsed_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      if (elapsed_ms >= options_.deadline_ms) {
+        LOG(WARNING) << "RetryPolicy: giving up after " << attempt
+                     << " attempts, deadline of " << options_.deadline_ms
+                     << "ms reached.";
+        exhausted_++;
+        return result;
+      }
+      delay_ms = std::min(delay_ms, options_.deadline_ms - elapsed_ms);
+    }
+    if (!withdraw_token()) {
+      LOG_EVERY_N(WARNING, 100) << "RetryPolicy: retry budget exhausted, not "
+                                << "retrying transient failure.";
+      budget_rejections_++;
+      return result;
+    }
+
+    retries_++;
+    LOG(WARNING) << "RetryPolicy: transient failure, retrying in " << delay_ms
+                 << "ms.";
+    std::this_thread::sleep_for(
+      std::chrono::duration<double, std::milli>(delay_ms));
+  }
+}
+
+RetryStats RetryPolicy::stats() const {
+  RetryStats stats;
+  stats.calls = calls_;
+  stats.retries = retries_;
+  stats.recovered = recovered_;
+  stats.exhausted = exhausted_;
+  stats.budget_rejections = budget_rejections_;
+  return stats;
+}
+
+bool RetryPolicy::withdraw_token() {
+  if (options_.budget_tokens == 0) {
+    return true;
+  }
+  int64_t budget = budget_.load();
+  while (budget >= MILLITOKENS) {
+    if (budget_.compare_exchange_weak(budget, budget - MILLITOKENS)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void RetryPolicy::deposit_tokens() {
+  int64_t limit = options_.budget_tokens * MILLITOKENS;
+  int64_t deposit = options_.budget_ratio * MILLITOKENS;
+  int64_t budget = budget_.load();
+  while (budget < limit &&
+         !budget_.compare_exchange_weak(budget,
+                                        std::min(limit, budget + deposit))) {
+  }
+}
+
+RetryPolicy* default_retry_policy() {
+  static RetryPolicy policy([] {
+    RetryOptions options;
+    options.budget_tokens = 0;
+    return options;
+  }());
+  return &policy;
+}
+}
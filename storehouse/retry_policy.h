@@ -0,0 +1,101 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+namespace storehouse {
+
+// Defined in storage_backend.h, which includes this header
+enum class StoreResult;
+
+struct RetryOptions {
+  // Attempts in all, counting the first. 0 leaves only the deadline.
+  uint32_t max_attempts = 10;
+  // Each sleep is a random length between base_delay_ms and three times the
+  // previous sleep, capped at max_delay_ms (decorrelated jitter)
+  uint32_t base_delay_ms = 100;
+  uint32_t max_delay_ms = 10 * 1000;
+  // No retry starts after this long since the first attempt, and the last
+  // sleep is cut short to end at it. 0 disables the deadline.
+  uint32_t deadline_ms = 2 * 60 * 1000;
+  // Every retry spends one token from a bucket shared by all callers of the
+  // policy, and every call that ends in something other than a transient
+  // failure puts budget_ratio back, up to budget_tokens. While the bucket is
+  // empty transient failures are returned without retrying, so an outage
+  // does not multiply the load on the service. 0 tokens disables the budget.
+  double budget_ratio = 0.1;
+  uint32_t budget_tokens = 100;
+};
+
+struct RetryStats {
+  uint64_t calls;
+  uint64_t retries;
+  // Calls that succeeded or failed for good after at least one retry
+  uint64_t recovered;
+  // Calls that ran out of attempts or hit the deadline
+  uint64_t exhausted;
+  // Retries skipped because the budget was spent
+  uint64_t budget_rejections;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// RetryPolicy
+class RetryPolicy {
+ public:
+  RetryPolicy(RetryOptions options = RetryOptions());
+
+  /* run
+   *
+   * Calls operation until it returns something other than TransientFailure,
+   * sleeping between attempts, and returns its last result. Gives up with
+   * TransientFailure once the attempts, the deadline or the budget run out;
+   * it never ends the process.
+   */
+  StoreResult run(const std::function<StoreResult()>& operation);
+
+  RetryStats stats() const;
+
+  const RetryOptions& options() const { return options_; }
+
+ private:
+  bool withdraw_token();
+
+  void deposit_tokens();
+
+  const RetryOptions options_;
+
+  // Thousandths of a token
+  std::atomic<int64_t> budget_;
+
+  std::atomic<uint64_t> calls_;
+  std::atomic<uint64_t> retries_;
+  std::atomic<uint64_t> recovered_;
+  std::atomic<uint64_t> exhausted_;
+  std::atomic<uint64_t> budget_rejections_;
+};
+
+/* default_retry_policy
+ *
+ * Used by EXP_BACKOFF and anything else without a backend at hand. It has
+ * no retry budget: those callers, BACKOFF_FAIL in particular, end the
+ * process on a failure, so a budget spent by other calls must not cost them
+ * their retries.
+ */
+RetryPolicy* default_retry_policy();
+}
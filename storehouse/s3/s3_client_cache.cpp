@@ -0,0 +1,162 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/s3/s3_client_cache.h"
+
+#include <aws/core/Aws.h>
+#include <aws/core/VersionConfig.h>
+#include <aws/core/auth/AWSAuthSigner.h>
+#include <aws/core/auth/AWSCredentials.h>
+#include <aws/core/client/ClientConfiguration.h>
+#include <aws/core/utils/HashingUtils.h>
+#include <aws/core/utils/threading/Executor.h>
+#include <glog/logging.h>
+
+// The SDK pinned in thirdparty predates these settings, so they are only
+// applied when building against an SDK that has them
+#if defined(AWS_SDK_VERSION_MAJOR) && \
+  (AWS_SDK_VERSION_MAJOR > 1 || AWS_SDK_VERSION_MINOR >= 8)
+#define STOREHOUSE_S3_TCP_KEEP_ALIVE 1
+#endif
+#if defined(AWS_SDK_VERSION_MAJOR) && \
+  (AWS_SDK_VERSION_MAJOR > 1 || AWS_SDK_VERSION_MINOR >= 9)
+#define STOREHOUSE_S3_HTTP2 1
+#include <aws/core/http/Version.h>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace storehouse {
+
+using Aws::S3::S3Client;
+
+namespace {
+
+std::mutex clients_mutex;
+std::map<std::string, std::weak_ptr<S3Client>> clients;
+size_t num_clients = 0;
+Aws::SDKOptions sdk_options;
+
+std::string client_key(const S3Config& config) {
+  std::string key;
+  auto add = [&key](const std::string& field) {
+    key += field;
+    key.push_back('\0');
+  };
+  // The key lives as long as the process, so it holds a digest of the
+  // credentials rather than the secret itself
+  std::string credentials;
+  for (const std::string* field : {&config.access_key_id,
+                                   &config.secret_access_key,
+                                   &config.session_token}) {
+    credentials += *field;
+    credentials.push_back('\0');
+  }
+  add(config.endpointOverride);
+  add(config.endpointRegion);
+  add(std::to_string(config.use_https));
+  add(std::to_string(config.virtual_addressing));
+  add(Aws::Utils::HashingUtils::HexEncode(
+    Aws::Utils::HashingUtils::CalculateSHA256(credentials)));
+  add(std::to_string(config.max_connections));
+  add(std::to_string(config.connect_timeout_ms));
+  add(std::to_string(config.request_timeout_ms));
+  add(std::to_string(config.tcp_keep_alive));
+  add(std::to_string(config.tcp_keep_alive_interval_ms));
+  add(std::to_string(config.http2));
+  add(std::to_string(config.async_concurrency));
+  return key;
+}
+
+Aws::Client::ClientConfiguration client_configuration(const S3Config& config) {
+  Aws::Client::ClientConfiguration cc;
+  cc.scheme =
+    config.use_https ? Aws::Http::Scheme::HTTPS : Aws::Http::Scheme::HTTP;
+  cc.region = config.endpointRegion;
+  cc.endpointOverride = config.endpointOverride;
+  cc.maxConnections = std::max(config.max_connections, 1);
+  cc.connectTimeoutMs = config.connect_timeout_ms;
+  cc.requestTimeoutMs = config.request_timeout_ms;
+#ifdef STOREHOUSE_S3_TCP_KEEP_ALIVE
+  cc.enableTcpKeepAlive = config.tcp_keep_alive;
+  cc.tcpKeepAliveIntervalMs = config.tcp_keep_alive_interval_ms;
+#endif
+#ifdef STOREHOUSE_S3_HTTP2
+  if (config.http2) {
+    // Falls back to HTTP/1.1 when the endpoint does not offer HTTP/2
+    cc.version = Aws::Http::Version::HTTP_VERSION_2TLS;
+  }
+#else
+  LOG_IF(WARNING, config.http2)
+    << "S3Storage: this AWS SDK does not support HTTP/2, using HTTP/1.1";
+#endif
+
+  // Bounds the threads the SDK uses for GetObjectAsync
+  cc.executor = Aws::MakeShared<Aws::Utils::Threading::PooledThreadExecutor>(
+    "S3StorageExecutor", std::max(config.async_concurrency, 1));
+  return cc;
+}
+
+void release_client(const std::string& key, S3Client* client) {
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  auto it = clients.find(key);
+  // The entry may already hold a newer client made after this one expired
+  if (it != clients.end() && it->second.expired()) {
+    clients.erase(it);
+  }
+  delete client;
+
+  num_clients--;
+  if (num_clients == 0) {
+    Aws::ShutdownAPI(sdk_options);
+  }
+}
+
+}
+
+std::shared_ptr<S3Client> acquire_s3_client(const S3Config& config) {
+  std::string key = client_key(config);
+  std::lock_guard<std::mutex> lock(clients_mutex);
+  std::shared_ptr<S3Client> client = clients[key].lock();
+  if (client != nullptr) {
+    return client;
+  }
+
+  if (num_clients == 0) {
+    Aws::InitAPI(sdk_options);
+  }
+  num_clients++;
+
+  Aws::Client::ClientConfiguration cc = client_configuration(config);
+  S3Client* new_client;
+  auto sign_payloads =
+    Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never;
+  if (config.access_key_id.empty()) {
+    new_client = new S3Client(cc, sign_payloads, config.virtual_addressing);
+  } else {
+    new_client = new S3Client(
+      Aws::Auth::AWSCredentials(config.access_key_id, config.secret_access_key,
+                                config.session_token),
+      cc, sign_payloads, config.virtual_addressing);
+  }
+  client.reset(new_client,
+               [key](S3Client* client) { release_client(key, client); });
+  clients[key] = client;
+  return client;
+}
+}
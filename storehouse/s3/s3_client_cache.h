@@ -0,0 +1,35 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/s3/s3_storage.h"
+
+#include <aws/s3/S3Client.h>
+
+#include <memory>
+
+namespace storehouse {
+
+/* acquire_s3_client
+ *
+ * Returns the client for the endpoint, region, credentials and connection
+ * settings in config, creating it if no backend holds one already, so
+ * backends that agree on all of them share one connection pool. The AWS SDK
+ * is initialized along with the first client and shut down when the last
+ * one is released.
+ */
+std::shared_ptr<Aws::S3::S3Client> acquire_s3_client(const S3Config& config);
+}
@@ -0,0 +1,189 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/s3/s3_hedging.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace storehouse {
+
+namespace {
+
+const int64_t MILLITOKENS = 1000;
+// Tokens the budget starts with and never exceeds, allowing a short burst
+// of hedges
+const int64_t MAX_HEDGE_TOKENS = 10;
+// First-byte latencies the percentile is taken over
+const size_t LATENCY_WINDOW = 1024;
+// Latencies needed before hedging starts, and between updates of the delay
+const size_t LATENCY_UPDATE_INTERVAL = 64;
+
+}
+
+ReadHedger::ReadHedger(double percentile, long min_delay_ms,
+                       double budget_ratio, size_t max_size)
+    : percentile_(std::min(std::max(percentile, 0.0), 1.0)),
+      min_delay_(std::chrono::milliseconds(min_delay_ms)),
+      deposit_(budget_ratio * MILLITOKENS),
+      max_size_(max_size),
+      next_latency_(0),
+      since_update_(0),
+      delay_us_(-1),
+      budget_(MAX_HEDGE_TOKENS * MILLITOKENS),
+      reads_(0),
+      hedges_(0),
+      hedge_wins_(0),
+      budget_rejections_(0) {
+  latencies_.reserve(LATENCY_WINDOW);
+}
+
+bool ReadHedger::hedge_delay(std::chrono::microseconds& delay) {
+  int64_t delay_us = delay_us_.load();
+  if (delay_us < 0) {
+    return false;
+  }
+  delay = std::max(std::chrono::microseconds(delay_us), min_delay_);
+  return true;
+}
+
+void ReadHedger::record_latency(std::chrono::microseconds latency) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (latencies_.size() < LATENCY_WINDOW) {
+    latencies_.push_back(latency.count());
+  } else {
+    latencies_[next_latency_] = latency.count();
+    next_latency_ = (next_latency_ + 1) % LATENCY_WINDOW;
+  }
+  if (++since_update_ < LATENCY_UPDATE_INTERVAL) {
+    return;
+  }
+  since_update_ = 0;
+  std::vector<int64_t> sorted(latencies_);
+  auto nth = sorted.begin() + (size_t)(percentile_ * (sorted.size() - 1));
+  std::nth_element(sorted.begin(), nth, sorted.end());
+  delay_us_ = *nth;
+}
+
+void ReadHedger::record_read() {
+  reads_++;
+  int64_t limit = MAX_HEDGE_TOKENS * MILLITOKENS;
+  int64_t budget = budget_.load();
+  while (budget < limit &&
+         !budget_.compare_exchange_weak(budget,
+                                        std::min(limit, budget + deposit_))) {
+  }
+}
+
+bool ReadHedger::start_hedge() {
+  int64_t budget = budget_.load();
+  while (budget >= MILLITOKENS) {
+    if (budget_.compare_exchange_weak(budget, budget - MILLITOKENS)) {
+      hedges_++;
+      return true;
+    }
+  }
+  budget_rejections_++;
+  return false;
+}
+
+void ReadHedger::record_win() { hedge_wins_++; }
+
+S3HedgeStats ReadHedger::stats() const {
+  S3HedgeStats stats;
+  stats.reads = reads_;
+  stats.hedges = hedges_;
+  stats.hedge_wins = hedge_wins_;
+  stats.budget_rejections = budget_rejections_;
+  return stats;
+}
+
+HedgedStreamBuf::HedgedStreamBuf(std::shared_ptr<HedgedRange> range,
+                                 int attempt)
+    : range_(range), attempt_(range->attempts[attempt]), read_pos_(0) {
+  // The SDK opens a new stream for each of its own retries, which starts
+  // the body over
+  std::lock_guard<std::mutex> lock(range_->mutex);
+  attempt_.written = 0;
+}
+
+std::streamsize HedgedStreamBuf::xsputn(const char* s, std::streamsize n) {
+  std::lock_guard<std::mutex> lock(range_->mutex);
+  if (n > 0 && !attempt_.first_byte) {
+    attempt_.first_byte = true;
+    attempt_.first_byte_at = std::chrono::steady_clock::now();
+    range_->cv.notify_all();
+  }
+  if (range_->closed) {
+    return 0;
+  }
+  size_t size = std::min((size_t)n, range_->size - attempt_.written);
+  memcpy(attempt_.target + attempt_.written, s, size);
+  attempt_.written += size;
+  return size;
+}
+
+HedgedStreamBuf::int_type HedgedStreamBuf::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof())) {
+    return traits_type::not_eof(c);
+  }
+  char ch = traits_type::to_char_type(c);
+  return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+}
+
+HedgedStreamBuf::int_type HedgedStreamBuf::underflow() {
+  std::lock_guard<std::mutex> lock(range_->mutex);
+  if (range_->closed || read_pos_ >= attempt_.written) {
+    return traits_type::eof();
+  }
+  size_t size = std::min(sizeof(read_buffer_), attempt_.written - read_pos_);
+  memcpy(read_buffer_, attempt_.target + read_pos_, size);
+  read_pos_ += size;
+  setg(read_buffer_, read_buffer_, read_buffer_ + size);
+  return traits_type::to_int_type(*gptr());
+}
+
+HedgedStreamBuf::pos_type HedgedStreamBuf::seekoff(
+  off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) {
+  std::lock_guard<std::mutex> lock(range_->mutex);
+  off_type end = attempt_.written;
+  if (which & std::ios_base::out) {
+    // Only reporting the write position is supported
+    if (off != 0 || dir != std::ios_base::cur) {
+      return pos_type(off_type(-1));
+    }
+    return pos_type(end);
+  }
+  off_type base = 0;
+  if (dir == std::ios_base::cur) {
+    base = read_pos_ - (egptr() - gptr());
+  } else if (dir == std::ios_base::end) {
+    base = end;
+  }
+  off_type pos = base + off;
+  if (pos < 0 || pos > end) {
+    return pos_type(off_type(-1));
+  }
+  // The next read refills the copy from the new position
+  read_pos_ = pos;
+  setg(read_buffer_, read_buffer_, read_buffer_);
+  return pos_type(pos);
+}
+
+HedgedStreamBuf::pos_type HedgedStreamBuf::seekpos(
+  pos_type pos, std::ios_base::openmode which) {
+  return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+}
@@ -0,0 +1,184 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/s3/s3_streams.h"
+#include "storehouse/storage_backend.h"
+
+#include <aws/core/Aws.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <vector>
+
+namespace storehouse {
+
+struct S3HedgeStats {
+  // Ranged GETs issued while hedging was enabled
+  uint64_t reads;
+  // Duplicate GETs sent because the first was slow to respond
+  uint64_t hedges;
+  // Reads answered by the duplicate rather than the original
+  uint64_t hedge_wins;
+  // Duplicates not sent because the budget was spent
+  uint64_t budget_rejections;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// ReadHedger
+/* Decides when a ranged GET is slow enough to send a duplicate. Keeps the
+ * first-byte latencies of recent reads and hedges a read once it has waited
+ * longer than the configured percentile of them. Hedges draw from a token
+ * bucket refilled by every read, so they stay a bounded fraction of the
+ * requests even when the service as a whole slows down. Shared by all files
+ * of a backend.
+ */
+class ReadHedger {
+ public:
+  ReadHedger(double percentile, long min_delay_ms, double budget_ratio,
+             size_t max_size);
+
+  /* covers
+   *
+   * Whether a read of size bytes may be hedged. A duplicate needs a buffer
+   * as large as the read, so large reads are left alone.
+   */
+  bool covers(size_t size) const { return size <= max_size_; }
+
+  /* hedge_delay
+   *
+   * How long a read may wait for its first byte before it is hedged. Returns
+   * false until enough latencies have been seen to estimate one.
+   */
+  bool hedge_delay(std::chrono::microseconds& delay);
+
+  void record_latency(std::chrono::microseconds latency);
+
+  /* record_read
+   *
+   * Counts a read and adds its share to the hedge budget.
+   */
+  void record_read();
+
+  /* start_hedge
+   *
+   * Spends a token for a duplicate request, or returns false if there is
+   * none left.
+   */
+  bool start_hedge();
+
+  void record_win();
+
+  S3HedgeStats stats() const;
+
+ private:
+  const double percentile_;
+  const std::chrono::microseconds min_delay_;
+  const int64_t deposit_;
+  const size_t max_size_;
+
+  std::mutex mutex_;
+  std::vector<int64_t> latencies_;
+  size_t next_latency_;
+  size_t since_update_;
+  // Microseconds, or -1 until enough latencies have been recorded
+  std::atomic<int64_t> delay_us_;
+
+  // Thousandths of a token
+  std::atomic<int64_t> budget_;
+
+  std::atomic<uint64_t> reads_;
+  std::atomic<uint64_t> hedges_;
+  std::atomic<uint64_t> hedge_wins_;
+  std::atomic<uint64_t> budget_rejections_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// HedgedRange
+/* State shared by the reader and the requests racing to fill one range.
+ * Requests only touch their destination while holding mutex and before the
+ * reader closes the range, so the loser may outlive the read, and the
+ * caller's buffer, without writing to it.
+ */
+struct HedgedRange {
+  struct Attempt {
+    // Where the response body goes: the caller's buffer for the original
+    // request, buffer for the duplicate
+    uint8_t* target = nullptr;
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t written = 0;
+    std::chrono::steady_clock::time_point sent;
+    bool first_byte = false;
+    std::chrono::steady_clock::time_point first_byte_at;
+    bool done = false;
+    StoreResult result = StoreResult::TransientFailure;
+    bool stale = false;
+  };
+
+  HedgedRange(uint8_t* data, size_t size) : size(size) {
+    attempts[0].target = data;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  const size_t size;
+  bool closed = false;
+  Attempt attempts[2];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// HedgedStreamBuf
+/* Writes one attempt's response body to its target through the HedgedRange
+ * lock. Once the range is closed writes fail, which aborts the transfer.
+ * Reads go through a small copy so the SDK can parse error bodies without
+ * holding on to the target.
+ */
+class HedgedStreamBuf : public std::streambuf {
+ public:
+  HedgedStreamBuf(std::shared_ptr<HedgedRange> range, int attempt);
+
+ protected:
+  std::streamsize xsputn(const char* s, std::streamsize n) override;
+
+  int_type overflow(int_type c) override;
+
+  int_type underflow() override;
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+
+ private:
+  std::shared_ptr<HedgedRange> range_;
+  HedgedRange::Attempt& attempt_;
+  size_t read_pos_;
+  char read_buffer_[1024];
+};
+
+class HedgedIOStream : public ResponseIOStream {
+ public:
+  HedgedIOStream(std::shared_ptr<HedgedRange> range, int attempt)
+      : ResponseIOStream(&buf_), buf_(range, attempt) {}
+
+ private:
+  HedgedStreamBuf buf_;
+};
+}
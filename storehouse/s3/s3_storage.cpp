@@ -1,4 +1,6 @@
 #include "storehouse/s3/s3_storage.h"
+#include "storehouse/s3/s3_client_cache.h"
+#include "storehouse/s3/s3_streams.h"
 
 #include <aws/s3/model/Bucket.h>
 #include <aws/s3/model/GetObjectRequest.h>
@@ -6,9 +8,20 @@
 #include <aws/s3/model/HeadObjectRequest.h>
 #include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/DeleteObjectsRequest.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CompletedPart.h>
+#include <aws/core/client/AsyncCallerContext.h>
 #include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/http/HttpResponse.h>
 #include <aws/core/Aws.h>
+#include <condition_variable>
 #include <fstream>
+#include <iterator>
+#include <map>
 #include <sstream>
 #include <fcntl.h>
 
@@ -16,62 +29,175 @@ namespace storehouse {
 
 using Aws::S3::S3Client;
 
+namespace {
+
+StoreResult get_range_error(
+  const Aws::Client::AWSError<Aws::S3::S3Errors>& error,
+  const std::string& path, bool& stale) {
+  if (error.GetResponseCode() ==
+      Aws::Http::HttpResponseCode::PRECONDITION_FAILED) {
+    stale = true;
+    return StoreResult::TransientFailure;
+  }
+  LOG(WARNING) << "Error opening file: " <<
+    path << " - " <<
+    error.GetMessage();
+
+  if (error.ShouldRetry()) {
+    return StoreResult::TransientFailure;
+  } else {
+    return StoreResult::ReadFailure;
+  }
+}
+
+// Sends the body of a ranged GET that failed to a scratch buffer instead of
+// the destination. Runs once the headers are in, which with some HTTP clients
+// is before the status is recorded; then only a response with a
+// Content-Range, which every successful ranged GET carries, is let through.
+void divert_error_body(const Aws::Http::HttpRequest*,
+                       Aws::Http::HttpResponse* response) {
+  ResponseIOStream* stream =
+    dynamic_cast<ResponseIOStream*>(&response->GetResponseBody());
+  if (stream == nullptr || stream->diverted()) {
+    return;
+  }
+  Aws::Http::HttpResponseCode code = response->GetResponseCode();
+  bool success =
+    code == Aws::Http::HttpResponseCode::REQUEST_NOT_MADE
+      ? response->HasHeader("content-range")
+      : static_cast<int>(code) >= 200 && static_cast<int>(code) < 300;
+  if (!success) {
+    stream->divert();
+  }
+}
+
+}
+
 class S3RandomReadFile : public RandomReadFile {
  public:
   S3RandomReadFile(const std::string& name, const std::string& bucket,
-                   S3Client* client)
-      : name_(name), bucket_(bucket), client_(client) {}
+                   S3Client* client, ThreadPool* pool = nullptr,
+                   size_t chunk_size = 0, int concurrency = 1,
+                   ReadHedger* hedger = nullptr)
+      : bucket_(bucket),
+        name_(name),
+        client_(client),
+        pool_(pool),
+        chunk_size_(chunk_size),
+        concurrency_(concurrency),
+        hedger_(hedger),
+        has_metadata_(false),
+        size_(0),
+        mtime_(0) {}
 
   StoreResult read(uint64_t offset, size_t requested_size, uint8_t* data,
                    size_t& size_read) override {
-    uint64_t file_size;
-    auto result = get_size(file_size);
-    int64_t size_to_read = std::min((int64_t)(file_size - offset), (int64_t)requested_size);
-    size_to_read = std::max(size_to_read, (int64_t)0);
-
     size_read = 0;
-    if (result != StoreResult::Success
-        || (size_to_read == 0 && requested_size == 0)) {
-      return result;
+    bool stale = false;
+    StoreResult result =
+      read_once(offset, requested_size, data, size_read, stale);
+    if (stale) {
+      // The object was replaced since we cached its metadata, so refetch it
+      // and try again against the new version
+      LOG(WARNING) << "Object " << get_full_path()
+                   << " changed since it was opened, revalidating.";
+      invalidate_metadata();
+      result = read_once(offset, requested_size, data, size_read, stale);
     }
+    return result;
+  }
 
-    if (size_to_read == 0 && requested_size > 0) {
-      return StoreResult::EndOfFile;
+  void read_async(uint64_t offset, size_t requested_size, uint8_t* data,
+                  ReadCallback callback) override {
+    uint64_t file_size;
+    std::string etag;
+    bool has_metadata;
+    {
+      std::lock_guard<std::mutex> lock(metadata_mutex_);
+      has_metadata = has_metadata_;
+      file_size = size_;
+      etag = etag_;
     }
+    uint64_t size_to_read =
+      offset < file_size
+        ? std::min(file_size - offset, (uint64_t)requested_size)
+        : 0;
 
-    Aws::S3::Model::GetObjectRequest object_request;
+    // Reads that first need a HeadObject, or that would be split into
+    // chunks, take the blocking path on the I/O executor
+    if (!has_metadata || requested_size == 0 || size_to_read == 0 ||
+        (pool_ != nullptr && chunk_size_ > 0 && size_to_read > chunk_size_)) {
+      RandomReadFile::read_async(offset, requested_size, data, callback);
+      return;
+    }
 
-    std::stringstream range_request;
-    range_request << "bytes=" << offset << "-" << (offset + size_to_read - 1);
+    client_->GetObjectAsync(
+      make_range_request(offset, size_to_read, etag, data),
+      [this, offset, requested_size, size_to_read, data, callback](
+        const S3Client*, const Aws::S3::Model::GetObjectRequest&,
+        const Aws::S3::Model::GetObjectOutcome& outcome,
+        const std::shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+        size_t size_read = 0;
+        bool stale = false;
+        StoreResult result = get_range_result(outcome, size_read, stale);
+        if (stale) {
+          // Revalidate on the blocking path, which refetches the metadata
+          invalidate_metadata();
+          RandomReadFile::read_async(offset, requested_size, data, callback);
+          return;
+        }
+        // As on the blocking path, a body shorter than the range asked for
+        // is a failure; only a range cut short by the end of the object is
+        // EndOfFile
+        if (result == StoreResult::Success && size_read != size_to_read) {
+          LOG(WARNING) << "Expected " << size_to_read << " bytes from "
+                       << get_full_path() << " but received " << size_read;
+          result = StoreResult::ReadFailure;
+          size_read = 0;
+        } else if (result == StoreResult::Success &&
+                   size_read != requested_size) {
+          result = StoreResult::EndOfFile;
+        }
+        callback(result, size_read);
+      });
+  }
 
-    object_request.WithBucket(bucket_).WithKey(name_).WithRange(range_request.str());
+  StoreResult get_size(uint64_t& size) override {
+    std::string etag;
+    return get_metadata(size, etag);
+  }
 
-    auto get_object_outcome = client_->GetObject(object_request);
+  // Reads send the ETag as If-Match and refetch it when it goes stale, so
+  // this is the version every read so far has returned
+  StoreResult get_etag(std::string& etag) override {
+    uint64_t size;
+    return get_metadata(size, etag);
+  }
 
-    if (get_object_outcome.IsSuccess()) {
-      size_read = get_object_outcome.GetResult().GetContentLength();
-      get_object_outcome.GetResult().GetBody().
-          rdbuf()->sgetn((char*)data, size_read);
+  const std::string path() override { return name_; }
 
-      if (size_read != requested_size) {
-        return StoreResult::EndOfFile;
-      }
-      return StoreResult::Success;
-    } else {
-      auto error = get_object_outcome.GetError();
-      LOG(WARNING) << "Error opening file: " <<
-        get_full_path() << " - " <<
-        error.GetMessage();
+  StoreResult get_metadata(uint64_t& size, std::string& etag) {
+    int64_t mtime;
+    return get_metadata(size, etag, mtime);
+  }
 
-      if (error.ShouldRetry()) {
-        return StoreResult::TransientFailure;
-      } else {
-        return StoreResult::ReadFailure;
+  /* get_metadata
+   *
+   * Returns the size, ETag and modification time of the object. Only the
+   * first call issues a HeadObject request, later calls are answered from
+   * the handle.
+   */
+  StoreResult get_metadata(uint64_t& size, std::string& etag, int64_t& mtime) {
+    {
+      std::lock_guard<std::mutex> lock(metadata_mutex_);
+      if (has_metadata_) {
+        size = size_;
+        etag = etag_;
+        mtime = mtime_;
+        return StoreResult::Success;
       }
     }
-  }
 
-  StoreResult get_size(uint64_t& size) override {
     Aws::S3::Model::HeadObjectRequest object_request;
     object_request.WithBucket(bucket_).WithKey(name_);
 
@@ -79,7 +205,14 @@ class S3RandomReadFile : public RandomReadFile {
 
     if (head_object_outcome.IsSuccess()) {
       size = (uint64_t)head_object_outcome.GetResult().GetContentLength();
+      etag = head_object_outcome.GetResult().GetETag();
+      mtime = head_object_outcome.GetResult().GetLastModified().Millis() *
+              1000000;
     } else {
+      if (head_object_outcome.GetError().GetResponseCode() ==
+          Aws::Http::HttpResponseCode::NOT_FOUND) {
+        return StoreResult::FileDoesNotExist;
+      }
       LOG(WARNING) << "Error getting size - HeadObject error: " <<
           head_object_outcome.GetError().GetExceptionName() << " " <<
           head_object_outcome.GetError().GetMessage() <<
@@ -92,15 +225,279 @@ class S3RandomReadFile : public RandomReadFile {
       }
     }
 
+    std::lock_guard<std::mutex> lock(metadata_mutex_);
+    has_metadata_ = true;
+    size_ = size;
+    etag_ = etag;
+    mtime_ = mtime;
     return StoreResult::Success;
   }
 
-  const std::string path() override { return name_; }
-
  private:
   std::string bucket_;
   std::string name_;
   S3Client* client_;
+  // Helps fetch chunks; null when reads are not split
+  ThreadPool* pool_;
+  const size_t chunk_size_;
+  const int concurrency_;
+  ReadHedger* hedger_;
+
+  std::mutex metadata_mutex_;
+  bool has_metadata_;
+  uint64_t size_;
+  std::string etag_;
+  int64_t mtime_;
+
+  StoreResult read_once(uint64_t offset, size_t requested_size, uint8_t* data,
+                        size_t& size_read, bool& stale) {
+    stale = false;
+    uint64_t file_size;
+    std::string etag;
+    auto result = get_metadata(file_size, etag);
+    if (result != StoreResult::Success) {
+      return result;
+    }
+
+    uint64_t size_to_read =
+      offset < file_size
+        ? std::min(file_size - offset, (uint64_t)requested_size)
+        : 0;
+    if (requested_size == 0) {
+      return StoreResult::Success;
+    }
+    if (size_to_read == 0) {
+      return StoreResult::EndOfFile;
+    }
+
+    if (pool_ != nullptr && chunk_size_ > 0 && size_to_read > chunk_size_) {
+      result = get_range_chunked(offset, size_to_read, etag, data, stale);
+    } else {
+      size_t range_read;
+      result = get_range(offset, size_to_read, etag, data, range_read, stale);
+      if (result == StoreResult::Success && range_read != size_to_read) {
+        LOG(WARNING) << "Expected " << size_to_read << " bytes from "
+                     << get_full_path() << " but received " << range_read;
+        result = StoreResult::ReadFailure;
+      }
+    }
+    if (result != StoreResult::Success) {
+      return result;
+    }
+
+    size_read = size_to_read;
+    if (size_read != requested_size) {
+      return StoreResult::EndOfFile;
+    }
+    return StoreResult::Success;
+  }
+
+  Aws::S3::Model::GetObjectRequest make_range_request(uint64_t offset,
+                                                     size_t size,
+                                                     const std::string& etag,
+                                                     uint8_t* data) {
+    Aws::S3::Model::GetObjectRequest object_request;
+
+    std::stringstream range_request;
+    range_request << "bytes=" << offset << "-" << (offset + size - 1);
+
+    object_request.WithBucket(bucket_).WithKey(name_).WithRange(range_request.str());
+    if (!etag.empty()) {
+      // Guards the cached size against the object being overwritten
+      object_request.WithIfMatch(etag);
+    }
+    // Have the SDK write the body straight into the destination buffer
+    // rather than into its own stream that we would then copy out of
+    object_request.SetResponseStreamFactory([data, size]() {
+      return Aws::New<PreallocatedIOStream>("GetObjectResponseStream", data,
+                                            size);
+    });
+    // Error documents, such as the one for a failed If-Match, must not
+    // overwrite the destination
+    object_request.SetHeadersReceivedEventHandler(divert_error_body);
+    return object_request;
+  }
+
+  StoreResult get_range_result(
+    const Aws::S3::Model::GetObjectOutcome& get_object_outcome,
+    size_t& size_read, bool& stale) {
+    if (get_object_outcome.IsSuccess()) {
+      size_read = static_cast<PreallocatedIOStream&>(
+                    const_cast<Aws::S3::Model::GetObjectOutcome&>(
+                      get_object_outcome)
+                      .GetResult()
+                      .GetBody())
+                    .size_written();
+      return StoreResult::Success;
+    } else {
+      return get_range_error(get_object_outcome.GetError(), get_full_path(),
+                             stale);
+    }
+  }
+
+  StoreResult get_range(uint64_t offset, size_t size, const std::string& etag,
+                        uint8_t* data, size_t& size_read, bool& stale) {
+    if (hedger_ != nullptr && hedger_->covers(size)) {
+      return get_range_hedged(offset, size, etag, data, size_read, stale);
+    }
+    auto get_object_outcome =
+      client_->GetObject(make_range_request(offset, size, etag, data));
+    return get_range_result(get_object_outcome, size_read, stale);
+  }
+
+  // Sends the ranged GET for one attempt of a hedged read. The request only
+  // holds on to the shared range, never to this file.
+  void send_range_attempt(std::shared_ptr<HedgedRange> range, int attempt,
+                          uint64_t offset, const std::string& etag) {
+    Aws::S3::Model::GetObjectRequest object_request =
+      make_range_request(offset, range->size, etag, nullptr);
+    object_request.SetResponseStreamFactory([range, attempt]() {
+      return Aws::New<HedgedIOStream>("GetObjectResponseStream", range,
+                                      attempt);
+    });
+    // Lets the SDK drop the loser as soon as the read is over
+    object_request.SetContinueRequestHandler(
+      [range](const Aws::Http::HttpRequest*) {
+        std::lock_guard<std::mutex> lock(range->mutex);
+        return !range->closed;
+      });
+    {
+      std::lock_guard<std::mutex> lock(range->mutex);
+      range->attempts[attempt].sent = std::chrono::steady_clock::now();
+    }
+    std::string path = get_full_path();
+    client_->GetObjectAsync(
+      object_request,
+      [range, attempt, path](
+        const S3Client*, const Aws::S3::Model::GetObjectRequest&,
+        const Aws::S3::Model::GetObjectOutcome& outcome,
+        const std::shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+        std::lock_guard<std::mutex> lock(range->mutex);
+        HedgedRange::Attempt& a = range->attempts[attempt];
+        a.done = true;
+        // Once the read is over the loser's outcome no longer matters
+        if (!range->closed) {
+          a.result = outcome.IsSuccess()
+                       ? StoreResult::Success
+                       : get_range_error(outcome.GetError(), path, a.stale);
+        }
+        range->cv.notify_all();
+      });
+  }
+
+  // Issues the GET asynchronously and, if it has not received its first
+  // byte by the hedger's delay, a duplicate into a private buffer. The first
+  // to succeed answers the read; the other is cut off.
+  StoreResult get_range_hedged(uint64_t offset, size_t size,
+                               const std::string& etag, uint8_t* data,
+                               size_t& size_read, bool& stale) {
+    auto range = std::make_shared<HedgedRange>(data, size);
+    hedger_->record_read();
+    send_range_attempt(range, 0, offset, etag);
+
+    int attempts = 1;
+    std::chrono::microseconds delay;
+    if (hedger_->hedge_delay(delay)) {
+      std::unique_lock<std::mutex> lock(range->mutex);
+      HedgedRange::Attempt& first = range->attempts[0];
+      bool responded = range->cv.wait_for(
+        lock, delay, [&] { return first.first_byte || first.done; });
+      if (!responded && hedger_->start_hedge()) {
+        range->attempts[1].buffer.reset(new uint8_t[size]);
+        range->attempts[1].target = range->attempts[1].buffer.get();
+        attempts = 2;
+      }
+    }
+    if (attempts == 2) {
+      send_range_attempt(range, 1, offset, etag);
+    }
+
+    std::unique_lock<std::mutex> lock(range->mutex);
+    int winner = -1;
+    range->cv.wait(lock, [&] {
+      bool all_done = true;
+      for (int i = 0; i < attempts; ++i) {
+        HedgedRange::Attempt& a = range->attempts[i];
+        if (a.done && a.result == StoreResult::Success) {
+          winner = i;
+          return true;
+        }
+        all_done = all_done && a.done;
+      }
+      return all_done;
+    });
+    range->closed = true;
+
+    for (int i = 0; i < attempts; ++i) {
+      HedgedRange::Attempt& a = range->attempts[i];
+      if (a.first_byte) {
+        hedger_->record_latency(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+            a.first_byte_at - a.sent));
+      }
+    }
+    if (winner >= 0) {
+      HedgedRange::Attempt& a = range->attempts[winner];
+      if (winner == 1) {
+        hedger_->record_win();
+        memcpy(data, a.target, a.written);
+      }
+      size_read = a.written;
+      return StoreResult::Success;
+    }
+
+    // Both failed: revalidate if either saw the object change, otherwise
+    // report the more severe failure
+    StoreResult result = range->attempts[0].result;
+    for (int i = 0; i < attempts; ++i) {
+      HedgedRange::Attempt& a = range->attempts[i];
+      stale = stale || a.stale;
+      if (a.result == StoreResult::ReadFailure) {
+        result = a.result;
+      }
+    }
+    return result;
+  }
+
+  // Splits the range into chunk_size_ pieces fetched concurrently by the
+  // calling thread and the read pool, each written straight to its slice of
+  // data. The caller fetches chunks itself rather than waiting on the pool,
+  // so a read issued from a pool thread cannot deadlock it.
+  StoreResult get_range_chunked(uint64_t offset, size_t size,
+                                const std::string& etag, uint8_t* data,
+                                bool& stale) {
+    std::mutex mutex;
+    StoreResult result = StoreResult::Success;
+
+    size_t chunks = (size + chunk_size_ - 1) / chunk_size_;
+    pool_->parallel_for(chunks, concurrency_, [&](size_t chunk) {
+      size_t chunk_offset = chunk * chunk_size_;
+      size_t chunk_size = std::min(chunk_size_, size - chunk_offset);
+      size_t chunk_read = 0;
+      bool chunk_stale = false;
+      StoreResult chunk_result =
+        get_range(offset + chunk_offset, chunk_size, etag,
+                  data + chunk_offset, chunk_read, chunk_stale);
+      if (chunk_result == StoreResult::Success && chunk_read != chunk_size) {
+        chunk_result = StoreResult::ReadFailure;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (chunk_stale) {
+        stale = true;
+      }
+      // Report the most severe failure: a hard error over a transient one
+      if (chunk_result != StoreResult::Success &&
+          result != StoreResult::ReadFailure) {
+        result = chunk_result;
+      }
+    });
+    return result;
+  }
+
+  void invalidate_metadata() {
+    std::lock_guard<std::mutex> lock(metadata_mutex_);
+    has_metadata_ = false;
+  }
 
   std::string get_full_path() {
     return bucket_ + "/" + name_;
@@ -201,64 +598,573 @@ class S3WriteFile : public WriteFile {
   }
 };
 
-uint64_t S3Storage::num_clients = 0;
-std::mutex S3Storage::num_clients_mutex;
+// S3 rejects multipart parts smaller than this, except for the last one
+const size_t MIN_MULTIPART_PART_SIZE = 5 * 1024 * 1024;
+const int MAX_MULTIPART_PARTS = 10000;
+
+/* S3MultipartWriteFile
+ *
+ * Buffers appends in memory and uploads each part as soon as it fills, with
+ * at most max_inflight parts buffered or uploading at a time. save() uploads
+ * the remaining tail and completes the multipart upload. Objects smaller than
+ * one part are sent with a single PutObject instead.
+ */
+class S3MultipartWriteFile : public WriteFile {
+ public:
+  S3MultipartWriteFile(const std::string& name, const std::string& bucket,
+                       S3Client* client, ThreadPool* pool, size_t part_size,
+                       int max_inflight,
+                       std::shared_ptr<RetryPolicy> retry_policy)
+      : bucket_(bucket),
+        name_(name),
+        client_(client),
+        pool_(pool),
+        part_size_(std::max(part_size, MIN_MULTIPART_PART_SIZE)),
+        max_inflight_(std::max(max_inflight, 1)),
+        retry_policy_(retry_policy),
+        next_part_number_(1),
+        inflight_(0),
+        failed_(false),
+        has_changed_(true),
+        finished_(false) {
+    buffer_.reserve(part_size_);
+  }
+
+  ~S3MultipartWriteFile() {
+    save();
+    wait_for_parts();
+    if (!upload_id_.empty()) {
+      abort_upload();
+    }
+  }
+
+  StoreResult append(size_t size, const uint8_t* data) override {
+    if (finished_) {
+      LOG(ERROR) << "S3MultipartWriteFile: append to " << get_full_path()
+                 << " after it was saved.";
+      return StoreResult::SaveFailure;
+    }
+    // A full buffer is only uploaded when more bytes arrive, and a failed
+    // upload drops the bytes this call added, so an append that fails can be
+    // retried without writing anything twice. The only failures left once
+    // this call has handed off a part are sticky ones.
+    size_t buffered = buffer_.size();
+    bool handed_off = false;
+    while (size > 0) {
+      if (has_failed()) {
+        return StoreResult::SaveFailure;
+      }
+      if (buffer_.size() == part_size_) {
+        StoreResult result = upload_buffer();
+        if (result != StoreResult::Success) {
+          if (handed_off) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            failed_ = true;
+          } else {
+            buffer_.resize(buffered);
+          }
+          return result;
+        }
+        handed_off = true;
+      }
+      size_t to_copy = std::min(size, part_size_ - buffer_.size());
+      buffer_.insert(buffer_.end(), data, data + to_copy);
+      data += to_copy;
+      size -= to_copy;
+    }
+    has_changed_ = true;
+    return StoreResult::Success;
+  }
+
+  StoreResult save() override {
+    if (!has_changed_ || finished_) { return StoreResult::Success; }
+
+    if (has_failed()) {
+      wait_for_parts();
+      abort_upload();
+      finished_ = true;
+      return StoreResult::SaveFailure;
+    }
+
+    if (upload_id_.empty()) {
+      // Everything fit in one part, so skip the multipart protocol
+      StoreResult result = put_buffer();
+      if (result == StoreResult::Success) {
+        has_changed_ = false;
+        finished_ = true;
+        buffer_.clear();
+        buffer_.shrink_to_fit();
+      }
+      return result;
+    }
+
+    if (!buffer_.empty()) {
+      StoreResult result = upload_buffer();
+      if (result != StoreResult::Success) {
+        return result;
+      }
+    }
+    wait_for_parts();
+    if (has_failed()) {
+      abort_upload();
+      finished_ = true;
+      return StoreResult::SaveFailure;
+    }
+
+    Aws::S3::Model::CompletedMultipartUpload completed_upload;
+    for (const auto& part : completed_parts_) {
+      completed_upload.AddParts(Aws::S3::Model::CompletedPart()
+                                  .WithPartNumber(part.first)
+                                  .WithETag(part.second));
+    }
+    Aws::S3::Model::CompleteMultipartUploadRequest complete_request;
+    complete_request.WithBucket(bucket_)
+      .WithKey(name_)
+      .WithUploadId(upload_id_)
+      .WithMultipartUpload(completed_upload);
+    auto complete_outcome = client_->CompleteMultipartUpload(complete_request);
+    if (!complete_outcome.IsSuccess()) {
+      auto error = complete_outcome.GetError();
+      LOG(WARNING) << "Save Error: error while completing upload: " <<
+        get_full_path() << " - " <<
+        error.GetExceptionName() << " " <<
+        error.GetMessage();
+
+      // The parts stay uploaded, so a transient failure can be retried by
+      // calling save again
+      if (error.ShouldRetry()) {
+        return StoreResult::TransientFailure;
+      } else {
+        abort_upload();
+        finished_ = true;
+        return StoreResult::SaveFailure;
+      }
+    }
 
-S3Storage::S3Storage(S3Config config) : bucket_(config.bucket) {
-  std::lock_guard<std::mutex> guard(num_clients_mutex);
-  if (num_clients == 0) {
-    Aws::InitAPI(sdk_options_);
+    upload_id_.clear();
+    has_changed_ = false;
+    finished_ = true;
+    return StoreResult::Success;
   }
-  num_clients++;
 
-  Aws::Client::ClientConfiguration cc;
-  cc.scheme = Aws::Http::Scheme::HTTPS;
-  cc.region = config.endpointRegion;
-  cc.endpointOverride = config.endpointOverride;
-  cc.connectTimeoutMs = 1000 * 60 * 10;
-  cc.requestTimeoutMs = 1000 * 60 * 10;
+  const std::string path() override { return name_; }
+
+ private:
+  std::string bucket_;
+  std::string name_;
+  S3Client* client_;
+  ThreadPool* pool_;
+  const size_t part_size_;
+  const int max_inflight_;
+  std::shared_ptr<RetryPolicy> retry_policy_;
+
+  std::vector<uint8_t> buffer_;
+  std::string upload_id_;
+  int next_part_number_;
 
-  client_ = new S3Client(cc);
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  int inflight_;
+  bool failed_;
+  std::map<int, std::string> completed_parts_;
+
+  bool has_changed_;
+  bool finished_;
+
+  std::string get_full_path() {
+    return bucket_ + "/" + name_;
+  }
+
+  bool has_failed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_;
+  }
+
+  void wait_for_parts() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return inflight_ == 0; });
+  }
+
+  StoreResult put_buffer() {
+    Aws::S3::Model::PutObjectRequest put_object_request;
+    put_object_request.WithKey(name_).WithBucket(bucket_);
+    put_object_request.SetBody(Aws::MakeShared<MemoryIOStream>(
+      "PutObjectInputStream", buffer_.data(), buffer_.size()));
+    put_object_request.SetContentLength(buffer_.size());
+
+    auto put_object_outcome = client_->PutObject(put_object_request);
+    if (!put_object_outcome.IsSuccess()) {
+      auto error = put_object_outcome.GetError();
+      LOG(WARNING) << "Save Error: error while putting object: " <<
+        get_full_path() << " - " <<
+        error.GetExceptionName() << " " <<
+        error.GetMessage();
+
+      if (error.ShouldRetry()) {
+        return StoreResult::TransientFailure;
+      } else {
+        return StoreResult::SaveFailure;
+      }
+    }
+    return StoreResult::Success;
+  }
+
+  StoreResult create_upload() {
+    Aws::S3::Model::CreateMultipartUploadRequest create_request;
+    create_request.WithBucket(bucket_).WithKey(name_);
+    auto create_outcome = client_->CreateMultipartUpload(create_request);
+    if (!create_outcome.IsSuccess()) {
+      auto error = create_outcome.GetError();
+      LOG(WARNING) << "Save Error: error while creating upload: " <<
+        get_full_path() << " - " <<
+        error.GetExceptionName() << " " <<
+        error.GetMessage();
+
+      // Nothing was consumed, so a transient failure can be retried;
+      // anything else fails the file like a failed part would
+      if (error.ShouldRetry()) {
+        return StoreResult::TransientFailure;
+      } else {
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = true;
+        return StoreResult::SaveFailure;
+      }
+    }
+    upload_id_ = create_outcome.GetResult().GetUploadId();
+    return StoreResult::Success;
+  }
+
+  void abort_upload() {
+    if (upload_id_.empty()) {
+      return;
+    }
+    Aws::S3::Model::AbortMultipartUploadRequest abort_request;
+    abort_request.WithBucket(bucket_).WithKey(name_).WithUploadId(upload_id_);
+    auto abort_outcome = client_->AbortMultipartUpload(abort_request);
+    if (!abort_outcome.IsSuccess()) {
+      LOG(WARNING) << "Error aborting multipart upload for " <<
+        get_full_path() << " - " <<
+        abort_outcome.GetError().GetMessage();
+    }
+    upload_id_.clear();
+  }
+
+  // Hands the current buffer off to the upload pool, blocking while
+  // max_inflight_ parts are already outstanding
+  StoreResult upload_buffer() {
+    if (upload_id_.empty()) {
+      StoreResult result = create_upload();
+      if (result != StoreResult::Success) {
+        return result;
+      }
+    }
+    if (next_part_number_ > MAX_MULTIPART_PARTS) {
+      LOG(ERROR) << "S3MultipartWriteFile: " << get_full_path()
+                 << " needs more than " << MAX_MULTIPART_PARTS
+                 << " parts, increase the part size.";
+      std::lock_guard<std::mutex> lock(mutex_);
+      failed_ = true;
+      return StoreResult::SaveFailure;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return inflight_ < max_inflight_; });
+      inflight_++;
+    }
+
+    auto part = std::make_shared<std::vector<uint8_t>>();
+    part->swap(buffer_);
+    buffer_.reserve(part_size_);
+    int part_number = next_part_number_++;
+    std::string upload_id = upload_id_;
+    pool_->enqueue([this, part, part_number, upload_id]() {
+      std::string etag;
+      bool success = upload_part(upload_id, part_number, *part, etag);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (success) {
+        completed_parts_[part_number] = etag;
+      } else {
+        failed_ = true;
+      }
+      inflight_--;
+      cv_.notify_all();
+    });
+    return StoreResult::Success;
+  }
+
+  bool upload_part(const std::string& upload_id, int part_number,
+                   const std::vector<uint8_t>& part, std::string& etag) {
+    StoreResult result = retry_policy_->run([&] {
+      Aws::S3::Model::UploadPartRequest part_request;
+      part_request.WithBucket(bucket_)
+        .WithKey(name_)
+        .WithUploadId(upload_id)
+        .WithPartNumber(part_number);
+      part_request.SetBody(Aws::MakeShared<MemoryIOStream>(
+        "UploadPartInputStream", part.data(), part.size()));
+      part_request.SetContentLength(part.size());
+
+      auto part_outcome = client_->UploadPart(part_request);
+      if (part_outcome.IsSuccess()) {
+        etag = part_outcome.GetResult().GetETag();
+        return StoreResult::Success;
+      }
+
+      auto error = part_outcome.GetError();
+      LOG(WARNING) << "Save Error: error while uploading part "
+                   << part_number << " of " << get_full_path() << " - "
+                   << error.GetExceptionName() << " " << error.GetMessage();
+      return error.ShouldRetry() ? StoreResult::TransientFailure
+                                 : StoreResult::SaveFailure;
+    });
+    return result == StoreResult::Success;
+  }
+};
+
+/* S3DirectoryListing
+ *
+ * Pages through ListObjectsV2 under the folder's prefix. Without recursive
+ * the listing is split on '/', and S3 reports each subfolder once as a
+ * common prefix. With start_after, only keys after it are listed.
+ */
+class S3DirectoryListing : public DirectoryListing {
+ public:
+  S3DirectoryListing(const std::string& name, bool recursive,
+                     const std::string& bucket, S3Client* client,
+                     const std::string& start_after = "")
+      : bucket_(bucket),
+        recursive_(recursive),
+        client_(client),
+        start_after_(start_after) {
+    prefix_ = name;
+    if (!prefix_.empty() && prefix_.back() != '/') {
+      prefix_ += '/';
+    }
+  }
+
+  StoreResult next_page(std::vector<DirectoryEntry>& entries) override {
+    entries.clear();
+    Aws::S3::Model::ListObjectsV2Request list_request;
+    list_request.SetBucket(bucket_);
+    list_request.SetPrefix(prefix_);
+    if (!recursive_) {
+      list_request.SetDelimiter("/");
+    }
+    if (continuation_token_ != "") {
+      list_request.SetContinuationToken(continuation_token_);
+    } else if (start_after_ != "") {
+      list_request.SetStartAfter(start_after_);
+    }
+    auto list_objects_outcome = client_->ListObjectsV2(list_request);
+    if (!list_objects_outcome.IsSuccess()) {
+      auto error = list_objects_outcome.GetError();
+      LOG(WARNING) << "Error listing dir: " << bucket_ + "/" + prefix_
+                   << " - " << error.GetMessage();
+      if (error.ShouldRetry()) {
+        return StoreResult::TransientFailure;
+      } else {
+        return StoreResult::ReadFailure;
+      }
+    }
+
+    const auto& result = list_objects_outcome.GetResult();
+    for (const auto& obj : result.GetContents()) {
+      entries.emplace_back();
+      DirectoryEntry& entry = entries.back();
+      entry.name = obj.GetKey();
+      entry.info.size = (uint64_t)obj.GetSize();
+      entry.info.file_exists = true;
+      entry.info.file_is_folder = false;
+      entry.info.etag = obj.GetETag();
+      entry.info.mtime = obj.GetLastModified().Millis() * 1000000;
+    }
+    for (const auto& common_prefix : result.GetCommonPrefixes()) {
+      entries.emplace_back();
+      DirectoryEntry& entry = entries.back();
+      entry.name = common_prefix.GetPrefix();
+      entry.name.pop_back();
+      entry.info.size = 0;
+      entry.info.file_exists = true;
+      entry.info.file_is_folder = true;
+      entry.info.mtime = 0;
+    }
+
+    if (!result.GetIsTruncated()) {
+      return StoreResult::EndOfFile;
+    }
+    continuation_token_ = result.GetNextContinuationToken();
+    return StoreResult::Success;
+  }
+
+ private:
+  std::string bucket_;
+  std::string prefix_;
+  const bool recursive_;
+  S3Client* client_;
+  const std::string start_after_;
+  std::string continuation_token_;
+};
+
+S3Storage::S3Storage(S3Config config)
+    : config_(config), bucket_(config.bucket) {
+  if (config_.multipart_upload) {
+    transfer_pool_.reset(
+      new ThreadPool(std::max(config_.multipart_concurrency, 1)));
+  }
+  if (config_.hedge_reads) {
+    hedger_.reset(new ReadHedger(config_.hedge_percentile,
+                                 config_.hedge_min_delay_ms,
+                                 config_.hedge_budget_ratio,
+                                 config_.hedge_max_size));
+  }
 }
 
 S3Storage::~S3Storage() {
-  std::lock_guard<std::mutex> guard(num_clients_mutex);
-  delete client_;
+  // Finish any transfers still referencing the client before releasing it
+  transfer_pool_.reset();
+  read_pool_.reset();
+  request_pool_.reset();
+}
 
-  num_clients--;
-  if (num_clients == 0) {
-    Aws::ShutdownAPI(sdk_options_);
+S3HedgeStats S3Storage::hedge_stats() const {
+  if (hedger_ == nullptr) {
+    return S3HedgeStats();
   }
+  return hedger_->stats();
 }
 
 StoreResult S3Storage::get_file_info(const std::string& name,
                                      FileInfo& file_info) {
-  S3RandomReadFile s3read_file(name, bucket_, client_);
+  S3RandomReadFile s3read_file(name, bucket_, client());
   file_info.file_exists = false;
   file_info.file_is_folder = (name[name.length()-1] == '/');
-  auto result = s3read_file.get_size(file_info.size);
+  auto result = s3read_file.get_metadata(file_info.size, file_info.etag,
+                                         file_info.mtime);
   if (result == StoreResult::Success) {
     file_info.file_exists = true;
   }
   return result;
 }
 
+StoreResult S3Storage::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  file_infos.assign(names.size(), FileInfo());
+  results.assign(names.size(), StoreResult::FileDoesNotExist);
+  std::vector<bool> resolved(names.size(), false);
+  int concurrency = std::max(config_.file_info_concurrency, 1);
+
+  // A listing page answers up to 1000 names in one request, so when the
+  // names are dense enough among the keys between them, list from the first
+  // name instead of sending a HeadObject for each. Listing stops at the last
+  // name, or as soon as a page answers fewer names than one round of
+  // HeadObject requests would, leaving the rest to those.
+  std::map<std::string, std::vector<size_t>> indices;
+  for (size_t i = 0; i < names.size(); ++i) {
+    indices[names[i]].push_back(i);
+  }
+  std::string prefix;
+  if (!names.empty()) {
+    prefix = names[0].substr(0, names[0].rfind('/') + 1);
+    for (const std::string& name : names) {
+      while (!prefix.empty() && name.compare(0, prefix.size(), prefix) != 0) {
+        size_t slash = prefix.size() > 1 ? prefix.rfind('/', prefix.size() - 2)
+                                         : std::string::npos;
+        prefix.erase(slash == std::string::npos ? 0 : slash + 1);
+      }
+    }
+  }
+  if (indices.size() > (size_t)concurrency) {
+    // The listing starts after the first name, which is looked up on its own
+    S3DirectoryListing listing(prefix, true, bucket_, client(),
+                               indices.begin()->first);
+    auto next = std::next(indices.begin());
+    std::vector<DirectoryEntry> entries;
+    std::string last_key;
+    while (next != indices.end()) {
+      StoreResult result = listing.next_page(entries);
+      if (result != StoreResult::Success && result != StoreResult::EndOfFile) {
+        break;
+      }
+      for (const DirectoryEntry& entry : entries) {
+        auto it = indices.find(entry.name);
+        if (it != indices.end()) {
+          for (size_t i : it->second) {
+            file_infos[i] = entry.info;
+            file_infos[i].file_is_folder = entry.name.back() == '/';
+            results[i] = StoreResult::Success;
+          }
+        }
+        last_key = std::max(last_key, entry.name);
+      }
+      // Keys come back in order, so any name the listing has passed without
+      // finding does not exist
+      size_t answered = 0;
+      for (; next != indices.end() &&
+             (result == StoreResult::EndOfFile || next->first <= last_key);
+           ++next, ++answered) {
+        for (size_t i : next->second) {
+          resolved[i] = true;
+        }
+      }
+      if (result == StoreResult::EndOfFile || answered < (size_t)concurrency) {
+        break;
+      }
+    }
+  }
+
+  std::vector<size_t> remaining;
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (!resolved[i]) {
+      remaining.push_back(i);
+    }
+  }
+  if (!remaining.empty()) {
+    request_pool()->parallel_for(remaining.size(), concurrency, [&](size_t j) {
+      size_t i = remaining[j];
+      results[i] = get_file_info(names[i], file_infos[i]);
+    });
+  }
+  return file_info_many_result(results);
+}
+
 StoreResult S3Storage::make_random_read_file(const std::string& name,
                                              RandomReadFile*& file) {
-  file = new S3RandomReadFile(name, bucket_, client_);
+  S3RandomReadFile* s3_file =
+    new S3RandomReadFile(name, bucket_, client(), read_pool(),
+                         config_.read_chunk_size, config_.read_concurrency,
+                         hedger_.get());
+  if (config_.fetch_metadata_on_open) {
+    uint64_t size;
+    std::string etag;
+    StoreResult result = s3_file->get_metadata(size, etag);
+    if (result != StoreResult::Success) {
+      delete s3_file;
+      return result;
+    }
+  }
+  file = s3_file;
   return StoreResult::Success;
 }
 
 StoreResult S3Storage::make_write_file(const std::string& name,
                                        WriteFile*& file) {
-  file = new S3WriteFile(name, bucket_, client_);
+  if (config_.multipart_upload) {
+    file = new S3MultipartWriteFile(
+      name, bucket_, client(), transfer_pool_.get(),
+      config_.multipart_part_size, config_.multipart_concurrency,
+      retry_policy());
+    return StoreResult::Success;
+  }
+  file = new S3WriteFile(name, bucket_, client());
   return StoreResult::Success;
 }
 
 StoreResult S3Storage::make_dir(const std::string& name) {
   Aws::S3::Model::PutObjectRequest put_object_request;
   put_object_request.WithKey(name + "/").WithBucket(bucket_);
-  auto put_object_outcome = client_->PutObject(put_object_request);
+  auto put_object_outcome = client()->PutObject(put_object_request);
 
   if(!put_object_outcome.IsSuccess()) {
     LOG(WARNING) << "Save Error: error while making dir: " <<
@@ -280,73 +1186,131 @@ StoreResult S3Storage::delete_file(const std::string& name) {
 }
 
 StoreResult S3Storage::delete_dir(const std::string& name, bool recursive) {
-  std::vector<std::string> object_paths_to_delete;
-  // List all objects after prefix
-  std::string continuation_token = "";
-  while (true) {
-    Aws::S3::Model::ListObjectsV2Request list_request;
-    list_request.SetBucket(bucket_);
-    list_request.SetPrefix(name + "/");
-    if (continuation_token != "") {
-      list_request.SetContinuationToken(continuation_token);
+  // Each page of the listing is sent as one DeleteObjects batch while the
+  // next page is listed, with up to delete_concurrency batches in flight
+  ThreadPool* pool = request_pool();
+  int max_in_flight = std::max(config_.delete_concurrency, 1);
+  std::mutex mutex;
+  std::condition_variable cv;
+  int in_flight = 0;
+  StoreResult status = StoreResult::Success;
+
+  S3DirectoryListing listing(name + "/", true, bucket_, client());
+  std::vector<DirectoryEntry> entries;
+  StoreResult list_result;
+  do {
+    list_result = listing.next_page(entries);
+    std::unique_lock<std::mutex> lock(mutex);
+    if (status == StoreResult::Success &&
+        list_result != StoreResult::Success &&
+        list_result != StoreResult::EndOfFile) {
+      status = list_result == StoreResult::TransientFailure
+                 ? list_result
+                 : StoreResult::RemoveFailure;
     }
-    auto list_objects_outcome = client_->ListObjectsV2(list_request);
-    if (list_objects_outcome.IsSuccess()) {
-      auto result = list_objects_outcome.GetResult();
-      // Get list of paths and append
-      for (const auto& obj : result.GetContents()) {
-        object_paths_to_delete.push_back(obj.GetKey());
-      }
-      // Are there more objects to fetch?
-      if (!result.GetIsTruncated()) {
-        // No, so finish the loop
-        break;
-      } else {
-        continuation_token = result.GetContinuationToken();
-      }
-    } else {
-      if (list_objects_outcome.GetError().ShouldRetry()) {
-        return StoreResult::TransientFailure;
-      } else {
-        auto error = list_objects_outcome.GetError();
-        LOG(WARNING) << "Error deleting dir: " <<
-            bucket_ + "/" + name << " - " <<
-            error.GetMessage();
-        return StoreResult::RemoveFailure;
-      }
+    cv.wait(lock, [&] { return in_flight < max_in_flight; });
+    if (status != StoreResult::Success) {
+      break;
     }
-  }
+    if (entries.empty()) {
+      continue;
+    }
+    std::shared_ptr<std::vector<std::string>> keys(
+      new std::vector<std::string>());
+    for (const DirectoryEntry& entry : entries) {
+      keys->push_back(entry.name);
+    }
+    in_flight++;
+    pool->enqueue([this, keys, &mutex, &cv, &in_flight, &status] {
+      StoreResult result = delete_objects(*keys);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (result != StoreResult::Success && status == StoreResult::Success) {
+        status = result;
+      }
+      in_flight--;
+      cv.notify_all();
+    });
+  } while (list_result == StoreResult::Success);
 
-  const int MAX_DELETE_SIZE = 1000;
-  // Delete all objects using multi object delete
-  for (int i = 0; i < object_paths_to_delete.size(); i += MAX_DELETE_SIZE) {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&] { return in_flight == 0; });
+  return status;
+}
+
+StoreResult S3Storage::delete_objects(const std::vector<std::string>& keys) {
+  std::vector<std::string> pending = keys;
+  return retry_policy()->run([&] {
     Aws::S3::Model::DeleteObjectsRequest delete_request;
     delete_request.SetBucket(bucket_);
-
+    // Quiet mode reports only the keys that could not be deleted
     Aws::S3::Model::Delete delete_list;
-    int end = std::min(i + MAX_DELETE_SIZE, (int)object_paths_to_delete.size());
-    for (int j = i; j < end; j++) {
-      delete_list.AddObjects(
-        Aws::S3::Model::ObjectIdentifier().WithKey(object_paths_to_delete[j]));
+    delete_list.SetQuiet(true);
+    for (const std::string& key : pending) {
+      delete_list.AddObjects(Aws::S3::Model::ObjectIdentifier().WithKey(key));
     }
     delete_request.SetDelete(delete_list);
 
-    auto delete_objects_outcome = client_->DeleteObjects(delete_request);
-
+    auto delete_objects_outcome = client()->DeleteObjects(delete_request);
     if (!delete_objects_outcome.IsSuccess()) {
-      if (delete_objects_outcome.GetError().ShouldRetry()) {
-        return StoreResult::TransientFailure;
-      } else {
-        auto error = delete_objects_outcome.GetError();
-        LOG(WARNING) << "Error deleting dir: " <<
-            bucket_ + "/" + name << " - " <<
+      auto error = delete_objects_outcome.GetError();
+      LOG(WARNING) << "Error deleting objects in: " << bucket_ << " - " <<
+          error.GetMessage();
+      return error.ShouldRetry() ? StoreResult::TransientFailure
+                                 : StoreResult::RemoveFailure;
+    }
+
+    std::vector<std::string> failed;
+    for (const auto& error : delete_objects_outcome.GetResult().GetErrors()) {
+      // Throttling and internal errors clear up on their own; anything
+      // else, such as AccessDenied, will fail again
+      if (error.GetCode() != "SlowDown" &&
+          error.GetCode() != "InternalError") {
+        LOG(WARNING) << "Error deleting object: " << bucket_ + "/" +
+            error.GetKey() << " - " << error.GetCode() << " " <<
             error.GetMessage();
         return StoreResult::RemoveFailure;
       }
+      failed.push_back(error.GetKey());
     }
+    if (failed.empty()) {
+      return StoreResult::Success;
+    }
+    // Only the keys that failed are sent again
+    pending.swap(failed);
+    return StoreResult::TransientFailure;
+  });
+}
+
+S3Client* S3Storage::client() {
+  std::call_once(client_once_,
+                 [this] { client_ = acquire_s3_client(config_); });
+  return client_.get();
+}
+
+ThreadPool* S3Storage::read_pool() {
+  if (config_.read_concurrency <= 1) {
+    return nullptr;
   }
+  std::lock_guard<std::mutex> lock(request_pool_mutex_);
+  if (read_pool_ == nullptr) {
+    read_pool_.reset(new ThreadPool(config_.read_concurrency - 1));
+  }
+  return read_pool_.get();
+}
 
-  return StoreResult::Success;
+ThreadPool* S3Storage::request_pool() {
+  std::lock_guard<std::mutex> lock(request_pool_mutex_);
+  if (request_pool_ == nullptr) {
+    request_pool_.reset(new ThreadPool(std::max(
+      std::max(config_.file_info_concurrency, config_.delete_concurrency), 1)));
+  }
+  return request_pool_.get();
 }
 
+StoreResult S3Storage::make_directory_listing(const std::string& name,
+                                              bool recursive,
+                                              DirectoryListing*& listing) {
+  listing = new S3DirectoryListing(name, recursive, bucket_, client());
+  return StoreResult::Success;
+}
 }
@@ -1,17 +1,79 @@
 #pragma once
 
+#include "storehouse/s3/s3_hedging.h"
 #include "storehouse/storage_backend.h"
 #include "storehouse/storage_config.h"
+#include "storehouse/thread_pool.h"
 
-#include <aws/core/Aws.h>
 #include <aws/s3/S3Client.h>
 
+#include <memory>
+#include <mutex>
+
 namespace storehouse {
 
 struct S3Config : public StorageConfig {
   std::string bucket;
   std::string endpointOverride;
   std::string endpointRegion;
+  // Plain HTTP and path-style addressing (endpoint/bucket/key rather than
+  // bucket.endpoint/key) are for S3-compatible servers that need them, such
+  // as local stand-ins
+  bool use_https = true;
+  bool virtual_addressing = true;
+  // Static credentials for the client. When access_key_id is empty the
+  // SDK's default chain of environment, profile and instance role is used.
+  std::string access_key_id;
+  std::string secret_access_key;
+  std::string session_token;
+  // Connection settings. Backends whose endpoint, region, credentials and
+  // connection settings all agree share one client and connection pool.
+  int max_connections = 64;
+  long connect_timeout_ms = 10 * 1000;
+  long request_timeout_ms = 10 * 60 * 1000;
+  // Keep-alive needs AWS SDK 1.8 and HTTP/2 needs 1.9; with older SDKs they
+  // are ignored
+  bool tcp_keep_alive = true;
+  long tcp_keep_alive_interval_ms = 30 * 1000;
+  bool http2 = false;
+  // Issue a HeadObject when opening a file so its size and ETag are cached
+  // in the handle before the first read
+  bool fetch_metadata_on_open = false;
+  // Stream writes to S3 as a multipart upload instead of spooling them to a
+  // temp file. At most multipart_concurrency parts of multipart_part_size
+  // bytes are held in memory per file.
+  bool multipart_upload = false;
+  size_t multipart_part_size = 16 * 1024 * 1024;
+  int multipart_concurrency = 4;
+  // Reads larger than read_chunk_size are split into ranged GETs of that size
+  // and fetched on up to read_concurrency connections at once, the reading
+  // thread fetching its share. The default of 1 disables splitting; above
+  // that, read_concurrency - 1 threads are started when a file is first
+  // opened.
+  size_t read_chunk_size = 16 * 1024 * 1024;
+  int read_concurrency = 1;
+  // Hedged reads: a ranged GET that has not received its first byte after
+  // the hedge_percentile of recent first-byte latencies, and at least
+  // hedge_min_delay_ms, is sent again and whichever copy finishes first is
+  // used. Duplicates are limited to hedge_budget_ratio of reads. Only
+  // blocking reads of at most hedge_max_size bytes are hedged, since the
+  // duplicate needs a buffer of its own; split reads are hedged per chunk.
+  bool hedge_reads = false;
+  double hedge_percentile = 0.95;
+  long hedge_min_delay_ms = 20;
+  double hedge_budget_ratio = 0.05;
+  size_t hedge_max_size = 16 * 1024 * 1024;
+  // Threads the SDK runs asynchronous requests such as read_async on
+  int async_concurrency = 32;
+  // HeadObject requests get_file_info_many keeps in flight. With more names
+  // than that, the keys from the first name to the last are listed first,
+  // until a page answers fewer than file_info_concurrency names, and only
+  // names the listing did not reach are looked up one by one.
+  int file_info_concurrency = 32;
+  // DeleteObjects batches of 1000 keys delete_dir keeps in flight while it
+  // lists the rest. Keys S3 reports as throttled or failed internally are
+  // retried following the backend's retry policy.
+  int delete_concurrency = 8;
 };
 
 class S3Storage : public StorageBackend {
@@ -22,6 +84,10 @@ class S3Storage : public StorageBackend {
   StoreResult get_file_info(const std::string& name,
                             FileInfo& file_info) override;
 
+  StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                 std::vector<FileInfo>& file_infos,
+                                 std::vector<StoreResult>& results) override;
+
   StoreResult make_random_read_file(const std::string& name,
                                     RandomReadFile*& file) override;
 
@@ -35,12 +101,44 @@ class S3Storage : public StorageBackend {
   StoreResult delete_dir(const std::string& name,
                          bool recursive = false) override;
 
+  StoreResult make_directory_listing(const std::string& name, bool recursive,
+                                     DirectoryListing*& listing) override;
+
+  /* hedge_stats
+   *
+   * Counts of reads, hedges and hedges that won since the backend was
+   * created. All zero when hedge_reads is off.
+   */
+  S3HedgeStats hedge_stats() const;
+
  private:
-  Aws::SDKOptions sdk_options_;
-  Aws::S3::S3Client* client_;
-  std::string bucket_;
+  /* Deletes up to 1000 keys with one DeleteObjects request, retrying any
+   * that fail transiently. */
+  StoreResult delete_objects(const std::vector<std::string>& keys);
 
-  static uint64_t num_clients;
-  static std::mutex num_clients_mutex;
+  /* Created on first use, sized for the larger of the two batch limits. */
+  ThreadPool* request_pool();
+
+  /* Created on first use; null when read_concurrency disables splitting. */
+  ThreadPool* read_pool();
+
+  /* The shared client, acquired on first use so that constructing a
+   * backend does not start the SDK. */
+  Aws::S3::S3Client* client();
+
+  std::once_flag client_once_;
+  std::shared_ptr<Aws::S3::S3Client> client_;
+  const S3Config config_;
+  std::string bucket_;
+  // Runs multipart part uploads
+  std::unique_ptr<ThreadPool> transfer_pool_;
+  // Helps the reading thread fetch the chunks of a split read
+  std::unique_ptr<ThreadPool> read_pool_;
+  // Runs the HeadObject requests of get_file_info_many and the
+  // DeleteObjects batches of delete_dir. Also guards read_pool_.
+  std::mutex request_pool_mutex_;
+  std::unique_ptr<ThreadPool> request_pool_;
+  // Null unless hedge_reads is set
+  std::unique_ptr<ReadHedger> hedger_;
 };
 }
@@ -0,0 +1,163 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <aws/core/Aws.h>
+
+#include <sstream>
+#include <streambuf>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// MemoryStreamBuf
+/* Exposes a caller-owned buffer as a seekable input stream, so request bodies
+ * can be sent without copying them into an Aws::StringStream first. The
+ * buffer must outlive the stream.
+ */
+class MemoryStreamBuf : public std::streambuf {
+ public:
+  MemoryStreamBuf(const uint8_t* data, size_t size) {
+    char* begin = reinterpret_cast<char*>(const_cast<uint8_t*>(data));
+    setg(begin, begin, begin + size);
+  }
+
+ protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    if (!(which & std::ios_base::in)) {
+      return pos_type(off_type(-1));
+    }
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+      base = gptr() - eback();
+    } else if (dir == std::ios_base::end) {
+      base = egptr() - eback();
+    }
+    off_type pos = base + off;
+    if (pos < 0 || pos > egptr() - eback()) {
+      return pos_type(off_type(-1));
+    }
+    setg(eback(), eback() + pos, egptr());
+    return pos_type(pos);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
+
+class MemoryIOStream : public Aws::IOStream {
+ public:
+  MemoryIOStream(const uint8_t* data, size_t size)
+      : Aws::IOStream(&buf_), buf_(data, size) {}
+
+ private:
+  MemoryStreamBuf buf_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// ResponseIOStream
+/* Base for streams that write a response body straight into caller memory.
+ * divert switches the stream to a private scratch buffer, so the body of an
+ * error response can still be parsed by the SDK without overwriting that
+ * memory. It must be called before any of the body has been written.
+ */
+class ResponseIOStream : public Aws::IOStream {
+ public:
+  ResponseIOStream(std::streambuf* buf)
+      : Aws::IOStream(buf), diverted_(false) {}
+
+  void divert() {
+    diverted_ = true;
+    rdbuf(&scratch_);
+  }
+
+  bool diverted() const { return diverted_; }
+
+ private:
+  std::stringbuf scratch_;
+  bool diverted_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// PreallocatedStreamBuf
+/* Lets the SDK write a response body directly into a caller-owned buffer of
+ * fixed capacity. Writes beyond the capacity fail, which aborts the transfer
+ * instead of overrunning the buffer. What has been written can be read back,
+ * so the SDK can still parse error bodies.
+ */
+class PreallocatedStreamBuf : public std::streambuf {
+ public:
+  PreallocatedStreamBuf(uint8_t* data, size_t size) {
+    char* begin = reinterpret_cast<char*>(data);
+    setp(begin, begin + size);
+    setg(begin, begin, begin);
+  }
+
+  size_t size_written() const { return pptr() - pbase(); }
+
+ protected:
+  int_type underflow() override {
+    if (gptr() < pptr()) {
+      setg(pbase(), gptr(), pptr());
+      return traits_type::to_int_type(*gptr());
+    }
+    return traits_type::eof();
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override {
+    off_type end = pptr() - pbase();
+    if (which & std::ios_base::out) {
+      // Only reporting the write position is supported
+      if (off != 0 || dir != std::ios_base::cur) {
+        return pos_type(off_type(-1));
+      }
+      return pos_type(end);
+    }
+    off_type base = 0;
+    if (dir == std::ios_base::cur) {
+      base = gptr() - eback();
+    } else if (dir == std::ios_base::end) {
+      base = end;
+    }
+    off_type pos = base + off;
+    if (pos < 0 || pos > end) {
+      return pos_type(off_type(-1));
+    }
+    setg(pbase(), pbase() + pos, pptr());
+    return pos_type(pos);
+  }
+
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
+};
+
+class PreallocatedIOStream : public ResponseIOStream {
+ public:
+  PreallocatedIOStream(uint8_t* data, size_t size)
+      : ResponseIOStream(&buf_), buf_(data, size) {}
+
+  size_t size_written() const {
+    return diverted() ? 0 : buf_.size_written();
+  }
+
+ private:
+  PreallocatedStreamBuf buf_;
+};
+}
@@ -14,12 +14,19 @@
  */
 
 #include "storehouse/storage_backend.h"
+#include "storehouse/cache/disk_cache_storage.h"
+#include "storehouse/instrumented_storage.h"
+#include "storehouse/memory/memory_storage.h"
 // #include "storehouse/gcs/gcs_storage.h"
 #include "storehouse/posix/posix_storage.h"
 #include "storehouse/s3/s3_storage.h"
+#include "storehouse/thread_pool.h"
 #include "storehouse/util.h"
 
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <iterator>
 
 namespace storehouse {
 
@@ -41,22 +48,162 @@ StoreResult RandomReadFile::read(uint64_t offset, size_t size,
   return result;
 }
 
+void RandomReadFile::read_async(uint64_t offset, size_t size, uint8_t* data,
+                                ReadCallback callback) {
+  io_executor()->enqueue([this, offset, size, data, callback]() {
+    size_t size_read = 0;
+    StoreResult result = this->read(offset, size, data, size_read);
+    callback(result, size_read);
+  });
+}
+
+std::future<StoreResult> RandomReadFile::read_future(uint64_t offset,
+                                                     size_t size,
+                                                     uint8_t* data,
+                                                     size_t* size_read) {
+  auto promise = std::make_shared<std::promise<StoreResult>>();
+  std::future<StoreResult> future = promise->get_future();
+  this->read_async(offset, size, data,
+                   [promise, size_read](StoreResult result, size_t bytes) {
+                     if (size_read != nullptr) {
+                       *size_read = bytes;
+                     }
+                     promise->set_value(result);
+                   });
+  return future;
+}
+
+StoreResult RandomReadFile::read_many(std::vector<ReadRange>& ranges,
+                                      size_t max_gap) {
+  std::vector<CoalescedRange> merged = coalesce_read_ranges(ranges, max_gap);
+
+  // Merged requests covering more than one range land in a scratch buffer and
+  // are scattered afterwards; lone ranges are read in place
+  std::vector<std::vector<uint8_t>> scratch(merged.size());
+
+  // The calling thread takes part in the reads, so this cannot deadlock when
+  // it is itself an io_executor thread, as under readahead or a cache
+  io_executor()->parallel_for(merged.size(), merged.size(), [&](size_t i) {
+    const CoalescedRange& range = merged[i];
+    uint8_t* destination;
+    if (range.members.size() == 1) {
+      destination = ranges[range.members[0]].data;
+    } else {
+      scratch[i].resize(range.size);
+      destination = scratch[i].data();
+    }
+    size_t size_read = 0;
+    StoreResult result =
+      this->read(range.offset, range.size, destination, size_read);
+    if (range.members.size() > 1) {
+      for (size_t index : range.members) {
+        ReadRange& member = ranges[index];
+        uint64_t start = member.offset - range.offset;
+        if (start < size_read) {
+          memcpy(member.data, scratch[i].data() + start,
+                 std::min((uint64_t)member.size, size_read - start));
+        }
+      }
+    }
+    complete_coalesced_range(range, ranges, result, size_read);
+  });
+  return read_many_result(ranges);
+}
+
+StoreResult RandomReadFile::read_view(uint64_t offset, size_t size,
+                                      ReadView& view) {
+  std::shared_ptr<std::vector<uint8_t>> buffer(new std::vector<uint8_t>(size));
+  size_t size_read = 0;
+  StoreResult result = this->read(offset, size, buffer->data(), size_read);
+  view.data = buffer->data();
+  view.size = size_read;
+  view.holder = buffer;
+  return result;
+}
+
+StoreResult RandomReadFile::get_etag(std::string& etag) {
+  etag.clear();
+  return StoreResult::Success;
+}
+
 StoreResult WriteFile::append(const std::vector<uint8_t>& data) {
   return this->append(data.size(), data.data());
 }
 
+StoreResult WriteFile::reserve(uint64_t size) { return StoreResult::Success; }
+
+void WriteFile::save_async(SaveCallback callback) {
+  io_executor()->enqueue([this, callback]() { callback(this->save()); });
+}
+
+std::future<StoreResult> WriteFile::save_async() {
+  auto promise = std::make_shared<std::promise<StoreResult>>();
+  std::future<StoreResult> future = promise->get_future();
+  this->save_async(
+    [promise](StoreResult result) { promise->set_value(result); });
+  return future;
+}
+
+StorageBackend::StorageBackend()
+    : retry_policy_(std::make_shared<RetryPolicy>()) {}
+
+StoreResult StorageBackend::get_file_info_many(
+  const std::vector<std::string>& names, std::vector<FileInfo>& file_infos,
+  std::vector<StoreResult>& results) {
+  file_infos.assign(names.size(), FileInfo());
+  results.assign(names.size(), StoreResult::Success);
+  ThreadPool* pool = io_executor();
+  pool->parallel_for(names.size(), pool->num_threads(), [&](size_t i) {
+    results[i] = this->get_file_info(names[i], file_infos[i]);
+  });
+  return file_info_many_result(results);
+}
+
+StoreResult StorageBackend::make_directory_listing(const std::string& name,
+                                                   bool recursive,
+                                                   DirectoryListing*& listing) {
+  LOG(WARNING) << "Listing is not supported by this backend (" << name
+               << ").";
+  return StoreResult::ReadFailure;
+}
+
 StorageBackend* StorageBackend::make_from_config(const StorageConfig* config) {
   // if (const GCSConfig *gcs_config = dynamic_cast<const GCSConfig *>(config))
   // {
   //   return new GCSStorage(*gcs_config);
   // } else
+  StorageBackend* backend = nullptr;
   if (const PosixConfig* d_config = dynamic_cast<const PosixConfig*>(config)) {
-    return new PosixStorage(*d_config);
+    backend = new PosixStorage(*d_config);
+    backend->set_retry_policy(std::make_shared<RetryPolicy>(config->retry));
   } else if (const S3Config* s3_config =
                dynamic_cast<const S3Config*>(config)) {
-    return new S3Storage(*s3_config);
+    backend = new S3Storage(*s3_config);
+    backend->set_retry_policy(std::make_shared<RetryPolicy>(config->retry));
+  } else if (const MemoryConfig* memory_config =
+               dynamic_cast<const MemoryConfig*>(config)) {
+    backend = new MemoryStorage(*memory_config);
+    backend->set_retry_policy(std::make_shared<RetryPolicy>(config->retry));
+  } else if (const DiskCacheConfig* cache_config =
+               dynamic_cast<const DiskCacheConfig*>(config)) {
+    StorageBackend* base = make_from_config(cache_config->base_config.get());
+    if (base == nullptr) {
+      return nullptr;
+    }
+    // Shares the retry policy of the backend it wraps
+    backend = new DiskCacheStorage(base, *cache_config);
+  } else {
+    return nullptr;
+  }
+  if (config->metrics || config->slow_operation_ms > 0) {
+    InstrumentedStorage* instrumented = new InstrumentedStorage(backend);
+    if (config->slow_operation_ms > 0) {
+      instrumented->add_observer(std::make_shared<SlowOperationLogger>(
+        std::chrono::milliseconds(config->slow_operation_ms)));
+    }
+    backend = instrumented;
   }
-  return nullptr;
+  return backend;
 }
 
 std::string store_result_to_string(StoreResult result) {
@@ -87,28 +234,8 @@ StoreResult make_unique_random_read_file(
   StorageBackend* storage, const std::string& name,
   std::unique_ptr<RandomReadFile>& file) {
   RandomReadFile* ptr = nullptr;
-
-  int sleep_debt = 1;
-  StoreResult result;
-  // Exponential backoff for transient failures
-  while (true) {
-    result = storage->make_random_read_file(name, ptr);
-    if (result == StoreResult::TransientFailure) {
-      double sleep_time =
-        (sleep_debt + (static_cast<double>(rand()) / RAND_MAX));
-      if (sleep_debt < 64) {
-        sleep_debt *= 2;
-      } else {
-        LOG(FATAL) << "Reached max backoff for " << name << ".";
-        exit(1);
-      }
-      LOG(WARNING) << "Transient failure for " << name << ", sleeping for "
-                   << sleep_time << ".";
-      usleep(sleep_time * 1000000);
-      continue;
-    }
-    break;
-  }
+  StoreResult result = storage->retry_policy()->run(
+    [&] { return storage->make_random_read_file(name, ptr); });
   file.reset(ptr);
   return result;
 }
@@ -117,33 +244,116 @@ StoreResult make_unique_write_file(StorageBackend* storage,
                                    const std::string& name,
                                    std::unique_ptr<WriteFile>& file) {
   WriteFile* ptr = nullptr;
+  StoreResult result = storage->retry_policy()->run(
+    [&] { return storage->make_write_file(name, ptr); });
+  file.reset(ptr);
+  return result;
+}
 
-  int sleep_debt = 1;
-  StoreResult result;
-  // Exponential backoff for transient failures
-  while (true) {
-    result = storage->make_write_file(name, ptr);
-    if (result == StoreResult::TransientFailure) {
-      double sleep_time =
-        (sleep_debt + (static_cast<double>(rand()) / RAND_MAX));
-      if (sleep_debt < 64) {
-        sleep_debt *= 2;
-      } else {
-        LOG(FATAL) << "Reached max backoff for " << name << ".";
-        exit(1);
-      }
-      LOG(WARNING) << "Transient failure for " << name << ", sleeping for "
-                   << sleep_time << ".";
-      usleep(sleep_time * 1000000);
+StoreResult list_directory(StorageBackend* storage, const std::string& name,
+                           bool recursive,
+                           std::vector<DirectoryEntry>& entries) {
+  entries.clear();
+  std::shared_ptr<RetryPolicy> retry_policy = storage->retry_policy();
+  DirectoryListing* ptr = nullptr;
+  StoreResult result = retry_policy->run(
+    [&] { return storage->make_directory_listing(name, recursive, ptr); });
+  if (result != StoreResult::Success) {
+    return result;
+  }
+  std::unique_ptr<DirectoryListing> listing(ptr);
+  std::vector<DirectoryEntry> page;
+  do {
+    result = retry_policy->run([&] { return listing->next_page(page); });
+    if (result != StoreResult::Success && result != StoreResult::EndOfFile) {
+      return result;
+    }
+    entries.insert(entries.end(), std::make_move_iterator(page.begin()),
+                   std::make_move_iterator(page.end()));
+  } while (result == StoreResult::Success);
+  return StoreResult::Success;
+}
+
+std::vector<CoalescedRange> coalesce_read_ranges(
+  const std::vector<ReadRange>& ranges, size_t max_gap) {
+  std::vector<size_t> order(ranges.size());
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return ranges[a].offset < ranges[b].offset;
+  });
+
+  std::vector<CoalescedRange> merged;
+  uint64_t merged_end = 0;
+  for (size_t index : order) {
+    const ReadRange& range = ranges[index];
+    uint64_t end = range.offset + range.size;
+    if (!merged.empty() && range.offset <= merged_end + max_gap) {
+      CoalescedRange& last = merged.back();
+      merged_end = std::max(merged_end, end);
+      last.size = merged_end - last.offset;
+      last.members.push_back(index);
+    } else {
+      CoalescedRange next;
+      next.offset = range.offset;
+      next.size = range.size;
+      next.members.push_back(index);
+      merged.push_back(next);
+      merged_end = end;
+    }
+  }
+  return merged;
+}
+
+void complete_coalesced_range(const CoalescedRange& merged,
+                              std::vector<ReadRange>& ranges,
+                              StoreResult result, size_t size_read) {
+  for (size_t index : merged.members) {
+    ReadRange& member = ranges[index];
+    uint64_t start = member.offset - merged.offset;
+    if (result != StoreResult::Success && result != StoreResult::EndOfFile) {
+      member.size_read = 0;
+      member.result = result;
       continue;
     }
-    break;
+    member.size_read =
+      start < size_read ? std::min((uint64_t)member.size, size_read - start)
+                        : 0;
+    member.result = member.size_read == member.size ? StoreResult::Success
+                                                    : StoreResult::EndOfFile;
   }
-  file.reset(ptr);
-  return result;
+}
+
+StoreResult read_many_result(const std::vector<ReadRange>& ranges) {
+  for (const ReadRange& range : ranges) {
+    if (range.result != StoreResult::Success) {
+      return range.result;
+    }
+  }
+  return StoreResult::Success;
+}
+
+StoreResult file_info_many_result(const std::vector<StoreResult>& results) {
+  for (StoreResult result : results) {
+    if (result != StoreResult::Success &&
+        result != StoreResult::FileDoesNotExist) {
+      return result;
+    }
+  }
+  return StoreResult::Success;
 }
 
 std::vector<uint8_t> read_entire_file(RandomReadFile* file, uint64_t& pos, size_t read_size) {
+  // Ask for the whole remainder at once when the size is known so backends
+  // can fetch it in parallel instead of one read_size request at a time
+  uint64_t file_size;
+  StoreResult size_result;
+  EXP_BACKOFF(file->get_size(file_size), size_result);
+  if (size_result == StoreResult::Success && file_size > pos) {
+    read_size = std::max(read_size, (size_t)(file_size - pos));
+  }
+
   // Load the entire input
   std::vector<uint8_t> bytes;
   {
@@ -155,10 +365,16 @@ std::vector<uint8_t> read_entire_file(RandomReadFile* file, uint64_t& pos, size_
       EXP_BACKOFF(
         file->read(pos, read_size, bytes.data() + prev_size, size_read),
         result);
-      assert(result == StoreResult::Success ||
-             result == StoreResult::EndOfFile);
+      if (result != StoreResult::Success &&
+          result != StoreResult::EndOfFile) {
+        LOG(ERROR) << "read_entire_file: stopping at " << pos << " of "
+                   << file->path() << ": " << store_result_to_string(result);
+        bytes.resize(prev_size);
+        break;
+      }
       pos += size_read;
-      if (result == StoreResult::EndOfFile) {
+      if (result == StoreResult::EndOfFile ||
+          (size_result == StoreResult::Success && pos >= file_size)) {
         bytes.resize(prev_size + size_read);
         break;
       }
@@ -15,11 +15,14 @@
 
 #pragma once
 
+#include "storehouse/retry_policy.h"
 #include "storehouse/storage_config.h"
 
 #include <glog/logging.h>
 
 #include <unistd.h>
+#include <functional>
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -45,11 +48,53 @@ std::string store_result_to_string(StoreResult result);
 ////////////////////////////////////////////////////////////////////////////////
 /// FileInfo
 struct FileInfo {
-  uint64_t size;
-  bool file_exists;
-  bool file_is_folder;
+  uint64_t size = 0;
+  bool file_exists = false;
+  bool file_is_folder = false;
+  // Changes whenever the contents change. Empty if the backend cannot tell.
+  std::string etag;
+  // Last modification time in nanoseconds since the Unix epoch, or 0 if the
+  // backend cannot tell
+  int64_t mtime = 0;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+/// DirectoryEntry
+struct DirectoryEntry {
+  // Full name of the entry, usable with the other StorageBackend calls
+  std::string name;
+  FileInfo info;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// ReadRange
+struct ReadRange {
+  uint64_t offset;
+  size_t size;
+  uint8_t* data;
+
+  // Filled in by read_many
+  size_t size_read;
+  StoreResult result;
+};
+
+// Ranges separated by at most this many bytes are fetched by one request
+const size_t DEFAULT_READ_MANY_GAP = 64 * 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+/// ReadView
+struct ReadView {
+  const uint8_t* data;
+  size_t size;
+  // Keeps data valid for as long as the view, or any copy of holder, lives
+  std::shared_ptr<const void> holder;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// Asynchronous completion callbacks
+typedef std::function<void(StoreResult result, size_t size_read)> ReadCallback;
+typedef std::function<void(StoreResult result)> SaveCallback;
+
 ////////////////////////////////////////////////////////////////////////////////
 /// RandomReadFile
 class RandomReadFile {
@@ -61,8 +106,56 @@ class RandomReadFile {
   virtual StoreResult read(uint64_t offset, size_t size, uint8_t* data,
                            size_t& size_read) = 0;
 
+  /* read_async
+   *
+   * Starts a read and returns immediately. callback receives the same result
+   * and size that read would have produced, on an I/O thread. data and the
+   * file must stay alive until then. By default the read runs on the shared
+   * io_executor.
+   */
+  virtual void read_async(uint64_t offset, size_t size, uint8_t* data,
+                          ReadCallback callback);
+
+  /* read_future
+   *
+   * read_async with a future for the result. If size_read is not null it
+   * receives the bytes read before the future becomes ready.
+   */
+  std::future<StoreResult> read_future(uint64_t offset, size_t size,
+                                       uint8_t* data,
+                                       size_t* size_read = nullptr);
+
+  /* read_many
+   *
+   * Reads every range into its own buffer. Ranges that overlap or lie within
+   * max_gap bytes of each other are merged into a single request, and the
+   * merged requests are issued in parallel. Each range gets its own result
+   * and size_read; the return value is Success only if all ranges were read
+   * in full, and otherwise the first failure in the order given.
+   */
+  virtual StoreResult read_many(std::vector<ReadRange>& ranges,
+                                size_t max_gap = DEFAULT_READ_MANY_GAP);
+
+  /* read_view
+   *
+   * Returns up to size bytes at offset as a read-only view rather than
+   * copying them into a caller buffer. The result and view.size follow the
+   * same rules as read. Backends that can expose their bytes in place, such
+   * as memory-mapped files, do so; by default the bytes are read into a
+   * buffer owned by view.holder.
+   */
+  virtual StoreResult read_view(uint64_t offset, size_t size, ReadView& view);
+
   virtual StoreResult get_size(uint64_t& size) = 0;
 
+  /* get_etag
+   *
+   * The ETag, as get_file_info reports it, of the version of the file this
+   * handle has been reading. Handles that cannot tell without asking the
+   * backend leave it empty, which is the default.
+   */
+  virtual StoreResult get_etag(std::string& etag);
+
   virtual const std::string path() = 0;
 };
 
@@ -76,25 +169,82 @@ class WriteFile {
 
   virtual StoreResult append(size_t size, const uint8_t* data) = 0;
 
+  /* reserve
+   *
+   * Hints that the file will grow to about size bytes, so backends that can
+   * preallocate space do so up front. Does nothing by default.
+   */
+  virtual StoreResult reserve(uint64_t size);
+
   virtual StoreResult save() = 0;
 
+  /* save_async
+   *
+   * Runs save without blocking the caller. No appends may be issued until
+   * callback has run.
+   */
+  virtual void save_async(SaveCallback callback);
+
+  std::future<StoreResult> save_async();
+
   virtual const std::string path() = 0;
 };
 
+////////////////////////////////////////////////////////////////////////////////
+/// DirectoryListing
+class DirectoryListing {
+ public:
+  virtual ~DirectoryListing(){};
+
+  /* next_page
+   *
+   * Replaces entries with the next batch of the listing, in no particular
+   * order. Returns EndOfFile along with the last batch, which may be empty.
+   * After a TransientFailure the same page can be requested again.
+   */
+  virtual StoreResult next_page(std::vector<DirectoryEntry>& entries) = 0;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /// StorageBackend
 class StorageBackend {
  public:
+  StorageBackend();
+
   virtual ~StorageBackend() {}
 
   static StorageBackend* make_from_config(const StorageConfig* config);
 
+  /* retry_policy
+   *
+   * How transient failures of this backend are retried, by the backend
+   * itself and by helpers such as make_unique_random_read_file. Wrapping
+   * backends share the policy of the backend they wrap.
+   */
+  std::shared_ptr<RetryPolicy> retry_policy() const { return retry_policy_; }
+
+  void set_retry_policy(std::shared_ptr<RetryPolicy> policy) {
+    retry_policy_ = policy;
+  }
+
   /* get_file_info
    *
    */
   virtual StoreResult get_file_info(const std::string& name,
                                     FileInfo& file_info) = 0;
 
+  /* get_file_info_many
+   *
+   * Looks up every name at once. file_infos and results are resized to match
+   * names and filled in as get_file_info would for each one. Names that do
+   * not exist get FileDoesNotExist; the return value is Success unless some
+   * other failure occurred, in which case it is the first of those. By
+   * default the lookups run in parallel on the shared io_executor.
+   */
+  virtual StoreResult get_file_info_many(const std::vector<std::string>& names,
+                                         std::vector<FileInfo>& file_infos,
+                                         std::vector<StoreResult>& results);
+
   /* make_random_read_file
    *
    */
@@ -122,6 +272,21 @@ class StorageBackend {
    */
   virtual StoreResult delete_dir(const std::string& name,
                                  bool recursive = false) = 0;
+
+  /* make_directory_listing
+   *
+   * Lists the files and folders directly inside the folder name or, when
+   * recursive, every file anywhere below it, along with the folders on the
+   * way where the backend has real folders. Entries are fetched a page at a
+   * time as the listing is read, so large folders are never held in memory
+   * at once. Backends that cannot list return ReadFailure.
+   */
+  virtual StoreResult make_directory_listing(const std::string& name,
+                                             bool recursive,
+                                             DirectoryListing*& listing);
+
+ private:
+  std::shared_ptr<RetryPolicy> retry_policy_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -134,34 +299,43 @@ StoreResult make_unique_write_file(StorageBackend* storage,
                                    const std::string& name,
                                    std::unique_ptr<WriteFile>& file);
 
+/* Reads every page of a listing of name into entries. */
+StoreResult list_directory(StorageBackend* storage, const std::string& name,
+                           bool recursive,
+                           std::vector<DirectoryEntry>& entries);
+
+struct CoalescedRange {
+  uint64_t offset;
+  size_t size;
+  // Indices of the ranges covered, ordered by offset
+  std::vector<size_t> members;
+};
+
+std::vector<CoalescedRange> coalesce_read_ranges(
+  const std::vector<ReadRange>& ranges, size_t max_gap);
+
+/* Fills in size_read and result for each member of a merged read from how
+ * many bytes of it were actually read. */
+void complete_coalesced_range(const CoalescedRange& merged,
+                              std::vector<ReadRange>& ranges,
+                              StoreResult result, size_t size_read);
+
+StoreResult read_many_result(const std::vector<ReadRange>& ranges);
+
+/* The return value of get_file_info_many for the given per-name results. */
+StoreResult file_info_many_result(const std::vector<StoreResult>& results);
+
 std::vector<uint8_t> read_entire_file(RandomReadFile* file, uint64_t& pos,
                                       size_t read_size = 1048576);
 
 void exit_on_error(StoreResult result, const std::string& exit_msg = "");
 
-#define EXP_BACKOFF(expression__, status__)                             \
-  do {                                                                  \
-    int sleep_debt__ = 1;                                               \
-    while (true) {                                                      \
-      const storehouse::StoreResult result__ = (expression__);          \
-      if (result__ == storehouse::StoreResult::TransientFailure) {      \
-        double sleep_time__ =                                           \
-          (sleep_debt__ + (static_cast<double>(rand()) / RAND_MAX));    \
-        if (sleep_debt__ < 64) {                                        \
-          sleep_debt__ *= 2;                                            \
-        } else {                                                        \
-          LOG(WARNING) << "EXP_BACKOFF: reached max backoff.";          \
-          status__ = result__;                                          \
-          break;                                                        \
-        }                                                               \
-        LOG(WARNING) << "EXP_BACKOFF: transient failure, sleeping for " \
-                     << sleep_time__ << ".";                            \
-        usleep(sleep_time__ * 1000000);                                 \
-        continue;                                                       \
-      }                                                                 \
-      status__ = result__;                                              \
-      break;                                                            \
-    }                                                                   \
+// Retries expression while it returns TransientFailure, following the
+// default RetryPolicy, and stores its last result in status
+#define EXP_BACKOFF(expression__, status__)                           \
+  do {                                                                \
+    status__ = storehouse::default_retry_policy()->run(               \
+      [&]() -> storehouse::StoreResult { return (expression__); });   \
   } while (0);
 
 #define BACKOFF_FAIL(expression__, failure_msg__)        \
@@ -174,7 +348,7 @@ void exit_on_error(StoreResult result, const std::string& exit_msg = "");
 #define RETURN_ON_ERROR(expression)                      \
   do {                                                   \
     const storehouse::StoreResult result = (expression); \
-    if (result != storehouse::StoresResult::Success) {   \
+    if (result != storehouse::StoreResult::Success) {    \
       return result;                                     \
     }                                                    \
   } while (0);
@@ -14,12 +14,87 @@
  */
 
 #include "storehouse/storage_config.h"
+#include "storehouse/cache/disk_cache_storage.h"
 // #include "storehouse/gcs/gcs_storage.h"
+#include "storehouse/memory/memory_storage.h"
+#include "storehouse/posix/aligned_buffer_pool.h"
 #include "storehouse/posix/posix_storage.h"
 #include "storehouse/s3/s3_storage.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
 namespace storehouse {
 
+namespace {
+
+bool parse_bool_arg(const std::map<std::string, std::string>& args,
+                    const std::string& key, bool default_value) {
+  auto it = args.find(key);
+  if (it == args.end()) {
+    return default_value;
+  }
+  return it->second == "true" || it->second == "1";
+}
+
+uint64_t parse_uint_arg(const std::map<std::string, std::string>& args,
+                        const std::string& key, uint64_t default_value) {
+  auto it = args.find(key);
+  if (it == args.end()) {
+    return default_value;
+  }
+  char* end;
+  uint64_t value = strtoull(it->second.c_str(), &end, 10);
+  if (it->second.empty() || *end != '\0') {
+    LOG(WARNING) << "StorageConfig argument " << key << " is not a number: "
+                 << it->second;
+    return default_value;
+  }
+  return value;
+}
+
+// Out-of-range values are ignored like malformed ones
+uint64_t parse_uint_arg(const std::map<std::string, std::string>& args,
+                        const std::string& key, uint64_t default_value,
+                        uint64_t min_value, uint64_t max_value) {
+  uint64_t value = parse_uint_arg(args, key, default_value);
+  if (value < min_value || value > max_value) {
+    LOG(WARNING) << "StorageConfig argument " << key << " must be between "
+                 << min_value << " and " << max_value << ": " << value;
+    return default_value;
+  }
+  return value;
+}
+
+double parse_double_arg(const std::map<std::string, std::string>& args,
+                        const std::string& key, double default_value) {
+  auto it = args.find(key);
+  if (it == args.end()) {
+    return default_value;
+  }
+  char* end;
+  double value = strtod(it->second.c_str(), &end);
+  if (it->second.empty() || *end != '\0') {
+    LOG(WARNING) << "StorageConfig argument " << key << " is not a number: "
+                 << it->second;
+    return default_value;
+  }
+  return value;
+}
+
+std::string parse_string_arg(const std::map<std::string, std::string>& args,
+                             const std::string& key,
+                             const std::string& default_value) {
+  auto it = args.find(key);
+  if (it == args.end()) {
+    return default_value;
+  }
+  return it->second;
+}
+
+}
+
 // StorageConfig *StorageConfig::make_gcs_config(
 //   const std::string &certificates_path,
 //   const std::string &key,
@@ -52,6 +127,8 @@ StorageConfig* StorageConfig::make_gcs_config(const std::string& bucket) {
   	return config;
 }
 
+StorageConfig* StorageConfig::make_memory_config() { return new MemoryConfig; }
+
 StorageConfig* StorageConfig::make_config(const std::string& type, const std::map<std::string, std::string>& args) {
   auto check_key = [&](std::string key) {
     if (args.count(key) == 0) {
@@ -60,10 +137,83 @@ StorageConfig* StorageConfig::make_config(const std::string& type, const std::ma
     }
     return true;
   };
+  // Bounds of the fields numbers are parsed into, so none of them wraps
+  const uint64_t kIntMax = std::numeric_limits<int>::max();
+  const uint64_t kLongMax = std::numeric_limits<long>::max();
+  const uint64_t kUint32Max = std::numeric_limits<uint32_t>::max();
 
   StorageConfig* sc_config = nullptr;
   if (type == "posix") {
     sc_config = StorageConfig::make_posix_config();
+    PosixConfig* posix_config = static_cast<PosixConfig*>(sc_config);
+    posix_config->use_mmap =
+      parse_bool_arg(args, "use_mmap", posix_config->use_mmap);
+    posix_config->mmap_huge_pages =
+      parse_bool_arg(args, "mmap_huge_pages", posix_config->mmap_huge_pages);
+    posix_config->use_io_uring =
+      parse_bool_arg(args, "use_io_uring", posix_config->use_io_uring);
+    posix_config->io_uring_queue_depth =
+      parse_uint_arg(args, "io_uring_queue_depth",
+                     posix_config->io_uring_queue_depth, 0, kUint32Max);
+    posix_config->io_uring_reaper_threads =
+      parse_uint_arg(args, "io_uring_reaper_threads",
+                     posix_config->io_uring_reaper_threads, 0, kUint32Max);
+    posix_config->use_direct_io =
+      parse_bool_arg(args, "use_direct_io", posix_config->use_direct_io);
+    uint64_t alignment =
+      parse_uint_arg(args, "direct_io_alignment",
+                     posix_config->direct_io_alignment, 1,
+                     std::numeric_limits<uint32_t>::max());
+    uint64_t buffer_size = parse_uint_arg(
+      args, "direct_io_buffer_size", posix_config->direct_io_buffer_size);
+    if (AlignedBufferPool::valid(alignment, buffer_size)) {
+      posix_config->direct_io_alignment = alignment;
+      posix_config->direct_io_buffer_size = buffer_size;
+    } else {
+      LOG(WARNING) << "StorageConfig argument direct_io_alignment must be a "
+                   << "power of two and direct_io_buffer_size a multiple of "
+                   << "it: " << alignment << ", " << buffer_size;
+    }
+    posix_config->write_buffer_size = parse_uint_arg(
+      args, "write_buffer_size", posix_config->write_buffer_size);
+    posix_config->atomic_save =
+      parse_bool_arg(args, "atomic_save", posix_config->atomic_save);
+    posix_config->sync_interval_bytes = parse_uint_arg(
+      args, "sync_interval_bytes", posix_config->sync_interval_bytes);
+    posix_config->file_info_concurrency =
+      parse_uint_arg(args, "file_info_concurrency",
+                     posix_config->file_info_concurrency, 0, kUint32Max);
+    posix_config->delete_concurrency =
+      parse_uint_arg(args, "delete_concurrency",
+                     posix_config->delete_concurrency, 0, kUint32Max);
+    if (args.count("sync_policy") > 0) {
+      const std::string& policy = args.at("sync_policy");
+      if (policy == "none") {
+        posix_config->sync_policy = PosixSyncPolicy::None;
+      } else if (policy == "data") {
+        posix_config->sync_policy = PosixSyncPolicy::Data;
+      } else if (policy == "full") {
+        posix_config->sync_policy = PosixSyncPolicy::Full;
+      } else {
+        LOG(WARNING) << "StorageConfig argument sync_policy is not one of "
+                     << "none, data or full: " << policy;
+      }
+    }
+    if (args.count("mmap_advice") > 0) {
+      const std::string& advice = args.at("mmap_advice");
+      if (advice == "normal") {
+        posix_config->mmap_advice = MmapAdvice::Normal;
+      } else if (advice == "sequential") {
+        posix_config->mmap_advice = MmapAdvice::Sequential;
+      } else if (advice == "random") {
+        posix_config->mmap_advice = MmapAdvice::Random;
+      } else if (advice == "willneed") {
+        posix_config->mmap_advice = MmapAdvice::WillNeed;
+      } else {
+        LOG(WARNING) << "StorageConfig argument mmap_advice is not one of "
+                     << "normal, sequential, random or willneed: " << advice;
+      }
+    }
   } else if (type == "gcs") {
     if (!check_key("bucket")) {
       return sc_config;
@@ -75,9 +225,132 @@ StorageConfig* StorageConfig::make_config(const std::string& type, const std::ma
     }
     sc_config = StorageConfig::make_s3_config(args.at("bucket"), args.at("region"),
                                               args.at("endpoint"));
+    S3Config* s3_config = static_cast<S3Config*>(sc_config);
+    s3_config->fetch_metadata_on_open =
+      parse_bool_arg(args, "fetch_metadata_on_open",
+                     s3_config->fetch_metadata_on_open);
+    s3_config->multipart_upload =
+      parse_bool_arg(args, "multipart_upload", s3_config->multipart_upload);
+    s3_config->multipart_part_size = parse_uint_arg(
+      args, "multipart_part_size", s3_config->multipart_part_size);
+    s3_config->multipart_concurrency =
+      parse_uint_arg(args, "multipart_concurrency",
+                     s3_config->multipart_concurrency, 0, kIntMax);
+    s3_config->read_chunk_size =
+      parse_uint_arg(args, "read_chunk_size", s3_config->read_chunk_size);
+    s3_config->read_concurrency = parse_uint_arg(
+      args, "read_concurrency", s3_config->read_concurrency, 0, kIntMax);
+    s3_config->async_concurrency = parse_uint_arg(
+      args, "async_concurrency", s3_config->async_concurrency, 0, kIntMax);
+    s3_config->file_info_concurrency =
+      parse_uint_arg(args, "file_info_concurrency",
+                     s3_config->file_info_concurrency, 0, kIntMax);
+    s3_config->delete_concurrency = parse_uint_arg(
+      args, "delete_concurrency", s3_config->delete_concurrency, 0, kIntMax);
+    s3_config->access_key_id =
+      parse_string_arg(args, "access_key_id", s3_config->access_key_id);
+    s3_config->secret_access_key = parse_string_arg(
+      args, "secret_access_key", s3_config->secret_access_key);
+    s3_config->session_token =
+      parse_string_arg(args, "session_token", s3_config->session_token);
+    s3_config->max_connections = parse_uint_arg(
+      args, "max_connections", s3_config->max_connections, 0, kIntMax);
+    s3_config->connect_timeout_ms = parse_uint_arg(
+      args, "connect_timeout_ms", s3_config->connect_timeout_ms, 0, kLongMax);
+    s3_config->request_timeout_ms = parse_uint_arg(
+      args, "request_timeout_ms", s3_config->request_timeout_ms, 0, kLongMax);
+    s3_config->tcp_keep_alive =
+      parse_bool_arg(args, "tcp_keep_alive", s3_config->tcp_keep_alive);
+    s3_config->tcp_keep_alive_interval_ms =
+      parse_uint_arg(args, "tcp_keep_alive_interval_ms",
+                     s3_config->tcp_keep_alive_interval_ms, 0, kLongMax);
+    s3_config->http2 = parse_bool_arg(args, "http2", s3_config->http2);
+    s3_config->use_https =
+      parse_bool_arg(args, "use_https", s3_config->use_https);
+    s3_config->virtual_addressing = parse_bool_arg(
+      args, "virtual_addressing", s3_config->virtual_addressing);
+    s3_config->hedge_reads =
+      parse_bool_arg(args, "hedge_reads", s3_config->hedge_reads);
+    s3_config->hedge_percentile = parse_double_arg(
+      args, "hedge_percentile", s3_config->hedge_percentile);
+    s3_config->hedge_min_delay_ms = parse_uint_arg(
+      args, "hedge_min_delay_ms", s3_config->hedge_min_delay_ms, 0, kLongMax);
+    s3_config->hedge_budget_ratio = parse_double_arg(
+      args, "hedge_budget_ratio", s3_config->hedge_budget_ratio);
+    s3_config->hedge_max_size =
+      parse_uint_arg(args, "hedge_max_size", s3_config->hedge_max_size);
+  } else if (type == "memory") {
+    sc_config = StorageConfig::make_memory_config();
+    MemoryConfig* memory_config = static_cast<MemoryConfig*>(sc_config);
+    memory_config->shards = parse_uint_arg(
+      args, "shards", memory_config->shards, 0, kUint32Max);
+    memory_config->max_chunk_size =
+      parse_uint_arg(args, "max_chunk_size", memory_config->max_chunk_size);
   } else {
     LOG(WARNING) << "Not a valid storage config type";
   }
+
+  if (sc_config != nullptr) {
+    RetryOptions& retry = sc_config->retry;
+    // The S3 retry counts that came before RetryOptions did not count the
+    // first attempt. They now set the limit for every operation, the larger
+    // one winning, unless retry_max_attempts is given too.
+    bool legacy_retries = false;
+    for (const char* key : {"multipart_max_retries", "delete_max_retries"}) {
+      if (args.count(key) == 0) {
+        continue;
+      }
+      LOG(WARNING) << "StorageConfig argument " << key << " is deprecated, "
+                   << "use retry_max_attempts instead";
+      // Malformed values come back as the default and are skipped
+      uint64_t retries = parse_uint_arg(args, key, kUint32Max);
+      if (retries >= kUint32Max) {
+        continue;
+      }
+      uint32_t attempts = static_cast<uint32_t>(retries + 1);
+      retry.max_attempts =
+        legacy_retries ? std::max(retry.max_attempts, attempts) : attempts;
+      legacy_retries = true;
+    }
+    retry.max_attempts = parse_uint_arg(
+      args, "retry_max_attempts", retry.max_attempts, 0, kUint32Max);
+    retry.base_delay_ms = parse_uint_arg(
+      args, "retry_base_delay_ms", retry.base_delay_ms, 0, kUint32Max);
+    retry.max_delay_ms = parse_uint_arg(
+      args, "retry_max_delay_ms", retry.max_delay_ms, 0, kUint32Max);
+    retry.deadline_ms = parse_uint_arg(
+      args, "retry_deadline_ms", retry.deadline_ms, 0, kUint32Max);
+    retry.budget_ratio =
+      parse_double_arg(args, "retry_budget_ratio", retry.budget_ratio);
+    retry.budget_tokens = parse_uint_arg(
+      args, "retry_budget_tokens", retry.budget_tokens, 0, kUint32Max);
+  }
+
+  // Remote backends can be fronted by a local disk cache
+  if (sc_config != nullptr && (type == "s3" || type == "gcs") &&
+      args.count("cache_dir") > 0) {
+    DiskCacheConfig* cache_config = new DiskCacheConfig;
+    cache_config->base_config.reset(sc_config);
+    cache_config->cache_namespace = type + "://" +
+                                    (args.count("endpoint") > 0
+                                       ? args.at("endpoint") + "/"
+                                       : std::string()) +
+                                    args.at("bucket");
+    cache_config->directory = args.at("cache_dir");
+    cache_config->capacity_bytes = parse_uint_arg(
+      args, "cache_capacity_bytes", cache_config->capacity_bytes);
+    cache_config->block_size =
+      parse_uint_arg(args, "cache_block_size", cache_config->block_size, 1,
+                     std::numeric_limits<size_t>::max());
+    sc_config = cache_config;
+  }
+
+  // These apply to the outermost backend, so cache hits are counted too
+  if (sc_config != nullptr) {
+    sc_config->metrics = parse_bool_arg(args, "metrics", sc_config->metrics);
+    sc_config->slow_operation_ms = parse_uint_arg(
+      args, "slow_operation_ms", sc_config->slow_operation_ms, 0, kUint32Max);
+  }
   return sc_config;
 }
 
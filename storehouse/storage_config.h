@@ -15,6 +15,9 @@
 
 #pragma once
 
+#include "storehouse/retry_policy.h"
+
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <map>
@@ -39,6 +42,19 @@ class StorageConfig {
 
   static StorageConfig* make_gcs_config(const std::string& bucket);
 
+  static StorageConfig* make_memory_config();
+
   static StorageConfig* make_config(const std::string& type, const std::map<std::string, std::string>& args);
+
+  // How the backend retries transient failures
+  RetryOptions retry;
+
+  // Wrap the backend in an InstrumentedStorage that records counts, bytes,
+  // results and latencies of every operation
+  bool metrics = false;
+
+  // Log every operation that takes at least this long, with its path and
+  // caller. 0 disables the log.
+  uint32_t slow_operation_ms = 0;
 };
 }
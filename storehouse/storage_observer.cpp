@@ -0,0 +1,81 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/storage_observer.h"
+#include "storehouse/storage_backend.h"
+
+#include <glog/logging.h>
+
+namespace storehouse {
+
+namespace {
+
+const std::string NO_CALLER;
+
+thread_local const std::string* current_caller = nullptr;
+
+}
+
+StorageCallerScope::StorageCallerScope(const std::string& caller)
+    : caller_(caller), previous_(current_caller) {
+  current_caller = &caller_;
+}
+
+StorageCallerScope::~StorageCallerScope() { current_caller = previous_; }
+
+const std::string& StorageCallerScope::current() {
+  return current_caller != nullptr ? *current_caller : NO_CALLER;
+}
+
+SlowOperationLogger::SlowOperationLogger(std::chrono::milliseconds threshold,
+                                         size_t max_records)
+    : threshold_(threshold), max_records_(max_records) {}
+
+void SlowOperationLogger::on_end(const StorageEvent& event) {
+  if (event.duration < threshold_) {
+    return;
+  }
+  double ms =
+    std::chrono::duration<double, std::milli>(event.duration).count();
+  LOG(WARNING) << "Slow " << storage_operation_to_string(event.operation)
+               << " of " << event.path << " (offset " << event.offset
+               << ", size " << event.size << ")"
+               << (event.caller.empty() ? "" : " by ") << event.caller
+               << " took " << ms << "ms and returned "
+               << store_result_to_string(event.result);
+
+  if (max_records_ == 0) {
+    return;
+  }
+  Record record;
+  record.operation = event.operation;
+  record.path = event.path;
+  record.caller = event.caller;
+  record.offset = event.offset;
+  record.size = event.size;
+  record.result = event.result;
+  record.duration = event.duration;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (records_.size() == max_records_) {
+    records_.pop_front();
+  }
+  records_.push_back(record);
+}
+
+std::vector<SlowOperationLogger::Record> SlowOperationLogger::records() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return std::vector<Record>(records_.begin(), records_.end());
+}
+}
@@ -0,0 +1,124 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/metrics.h"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// StorageEvent
+struct StorageEvent {
+  // Unique per call; the start and end events of a call share it
+  uint64_t id;
+  StorageOperation operation;
+  // The file or folder operated on, or "<N names>" for get_file_info_many
+  const std::string& path;
+  // Innermost StorageCallerScope on the thread that issued the call, or empty
+  const std::string& caller;
+  // Position and length requested, for the operations that take them
+  uint64_t offset;
+  uint64_t size;
+  // The rest are only set for end events
+  StoreResult result;
+  // Bytes read or written
+  uint64_t bytes;
+  std::chrono::steady_clock::duration duration;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// StorageObserver
+/* Receives an event when each call on an InstrumentedStorage, or on its files
+ * and listings, starts and ends. Both run on the thread making the call,
+ * except that the end of read_async and save_async runs on the thread that
+ * completes it. Observers must be thread safe and quick, since they run
+ * inline with the I/O.
+ */
+class StorageObserver {
+ public:
+  virtual ~StorageObserver() {}
+
+  virtual void on_start(const StorageEvent& event) {}
+
+  virtual void on_end(const StorageEvent& event) {}
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// StorageCallerScope
+/* Names the code making storage calls on the current thread for as long as it
+ * lives, so observers can attribute the calls. Scopes nest; the innermost
+ * one wins.
+ */
+class StorageCallerScope {
+ public:
+  StorageCallerScope(const std::string& caller);
+
+  ~StorageCallerScope();
+
+  /* current
+   *
+   * The innermost caller on this thread, or an empty string.
+   */
+  static const std::string& current();
+
+ private:
+  const std::string caller_;
+  const std::string* previous_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// SlowOperationLogger
+/* Logs a warning for every call that takes at least threshold, and keeps the
+ * last max_records of them for inspection.
+ */
+class SlowOperationLogger : public StorageObserver {
+ public:
+  struct Record {
+    StorageOperation operation;
+    std::string path;
+    std::string caller;
+    uint64_t offset;
+    uint64_t size;
+    StoreResult result;
+    std::chrono::steady_clock::duration duration;
+  };
+
+  SlowOperationLogger(std::chrono::milliseconds threshold,
+                      size_t max_records = 100);
+
+  void on_end(const StorageEvent& event) override;
+
+  /* records
+   *
+   * The slow calls seen most recently, oldest first.
+   */
+  std::vector<Record> records();
+
+ private:
+  const std::chrono::steady_clock::duration threshold_;
+  const size_t max_records_;
+
+  std::mutex mutex_;
+  std::deque<Record> records_;
+};
+}
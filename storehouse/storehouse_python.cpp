@@ -1,4 +1,8 @@
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include "storehouse/instrumented_storage.h"
+#include "storehouse/readahead.h"
+#include "storehouse/write_behind.h"
 #include "storehouse/storage_backend.h"
 #include "storehouse/storage_config.h"
 
@@ -21,6 +25,16 @@ class GILRelease {
  private:
   PyThreadState* m_thread_state;
 };
+
+// Files may block on destruction, joining readahead fetches or saving
+// write-behind buffers, so Python frees them without holding the GIL
+struct GILReleaseDelete {
+  template <typename T>
+  void operator()(T* ptr) const {
+    py::gil_scoped_release release;
+    delete ptr;
+  }
+};
 }
 
 class StorehouseException : public std::exception {
@@ -40,17 +54,25 @@ void attempt(StoreResult result) {
 }
 
 RandomReadFile* make_random_read_file(StorageBackend* backend,
-                                      const std::string& name) {
+                                      const std::string& name,
+                                      bool readahead) {
   GILRelease r;
   RandomReadFile* file;
   attempt(backend->make_random_read_file(name, file));
+  if (readahead) {
+    file = new ReadaheadRandomReadFile(file);
+  }
   return file;
 }
 
-WriteFile* make_write_file(StorageBackend* backend, const std::string& name) {
+WriteFile* make_write_file(StorageBackend* backend, const std::string& name,
+                           bool write_behind) {
   GILRelease r;
   WriteFile* file;
   attempt(backend->make_write_file(name, file));
+  if (write_behind) {
+    file = new WriteBehindWriteFile(file);
+  }
   return file;
 }
 
@@ -123,6 +145,29 @@ FileInfo get_file_info(StorageBackend* backend, const std::string& name) {
   return file_info;
 }
 
+// One (info, status) pair per name, so a name that fails does not hide
+// what was learned about the others
+std::vector<std::pair<FileInfo, std::string>> get_file_info_many(
+  StorageBackend* backend, const std::vector<std::string>& names) {
+  GILRelease r;
+  std::vector<FileInfo> file_infos;
+  std::vector<StoreResult> results;
+  backend->get_file_info_many(names, file_infos, results);
+  std::vector<std::pair<FileInfo, std::string>> infos;
+  for (size_t i = 0; i < names.size(); ++i) {
+    infos.emplace_back(file_infos[i], store_result_to_string(results[i]));
+  }
+  return infos;
+}
+
+std::vector<DirectoryEntry> list_dir(StorageBackend* backend,
+                                     const std::string& name, bool recursive) {
+  GILRelease r;
+  std::vector<DirectoryEntry> entries;
+  attempt(list_directory(backend, name, recursive, entries));
+  return entries;
+}
+
 void delete_file(StorageBackend* backend, const std::string& name) {
   GILRelease r;
   attempt(backend->delete_file(name));
@@ -133,6 +178,24 @@ void delete_dir(StorageBackend* backend, const std::string& name) {
   attempt(backend->delete_dir(name));
 }
 
+py::object metrics(StorageBackend* backend) {
+  InstrumentedStorage* instrumented =
+    dynamic_cast<InstrumentedStorage*>(backend);
+  if (instrumented == nullptr) {
+    return py::none();
+  }
+  return py::cast(instrumented->metrics_snapshot());
+}
+
+std::string metrics_text(StorageBackend* backend, const std::string& prefix) {
+  InstrumentedStorage* instrumented =
+    dynamic_cast<InstrumentedStorage*>(backend);
+  if (instrumented == nullptr) {
+    return "";
+  }
+  return format_metrics_text(instrumented->metrics_snapshot(), prefix);
+}
+
 PYBIND11_MODULE(_python, m) {
   m.doc() = "Storehouse C library";
   m.attr("__name__") = "storehouse._python";
@@ -142,30 +205,80 @@ PYBIND11_MODULE(_python, m) {
   py::class_<StorageConfig>(m, "StorageConfig")
     .def_static("make_posix_config", &StorageConfig::make_posix_config)
     .def_static("make_s3_config", &StorageConfig::make_s3_config)
-    .def_static("make_gcs_config", &StorageConfig::make_gcs_config);
+    .def_static("make_gcs_config", &StorageConfig::make_gcs_config)
+    .def_static("make_memory_config", &StorageConfig::make_memory_config)
+    .def_static("make_config", &StorageConfig::make_config)
+    .def_readwrite("metrics", &StorageConfig::metrics);
 
   py::class_<FileInfo>(m, "FileInfo")
     .def_readonly("size", &FileInfo::size)
     .def_readonly("file_exists", &FileInfo::file_exists)
-    .def_readonly("file_is_folder", &FileInfo::file_is_folder);
+    .def_readonly("file_is_folder", &FileInfo::file_is_folder)
+    .def_readonly("etag", &FileInfo::etag)
+    .def_readonly("mtime", &FileInfo::mtime);
+
+  py::class_<DirectoryEntry>(m, "DirectoryEntry")
+    .def_readonly("name", &DirectoryEntry::name)
+    .def_readonly("info", &DirectoryEntry::info);
+
+  py::class_<RetryStats>(m, "RetryStats")
+    .def_readonly("calls", &RetryStats::calls)
+    .def_readonly("retries", &RetryStats::retries)
+    .def_readonly("recovered", &RetryStats::recovered)
+    .def_readonly("exhausted", &RetryStats::exhausted)
+    .def_readonly("budget_rejections", &RetryStats::budget_rejections);
+
+  py::class_<LatencyHistogramSnapshot>(m, "LatencyHistogram")
+    .def_readonly("count", &LatencyHistogramSnapshot::count)
+    .def_readonly("sum_us", &LatencyHistogramSnapshot::sum_us)
+    .def_readonly("buckets", &LatencyHistogramSnapshot::buckets)
+    .def_static("bucket_lower_bound_us",
+                &LatencyHistogramSnapshot::bucket_lower_bound_us)
+    .def("percentile_us", &LatencyHistogramSnapshot::percentile_us);
+
+  py::class_<OperationMetricsSnapshot>(m, "OperationMetrics")
+    .def_property_readonly("operation",
+                           [](const OperationMetricsSnapshot& op) {
+                             return storage_operation_to_string(op.operation);
+                           })
+    .def_readonly("calls", &OperationMetricsSnapshot::calls)
+    .def_readonly("bytes", &OperationMetricsSnapshot::bytes)
+    .def_readonly("results", &OperationMetricsSnapshot::results)
+    .def_readonly("latency", &OperationMetricsSnapshot::latency);
+
+  py::class_<MetricsSnapshot>(m, "MetricsSnapshot")
+    .def_readonly("operations", &MetricsSnapshot::operations)
+    .def_readonly("retries", &MetricsSnapshot::retries);
+
+  m.def("format_metrics_text", &format_metrics_text, py::arg("snapshot"),
+        py::arg("prefix") = "storehouse");
 
   py::class_<StorageBackend>(m, "StorageBackend")
     .def_static("make_from_config", &StorageBackend::make_from_config)
-    .def("make_random_read_file", &make_random_read_file)
-    .def("make_write_file", &make_write_file)
+    .def("make_random_read_file", &make_random_read_file, py::arg("name"),
+         py::arg("readahead") = false)
+    .def("make_write_file", &make_write_file, py::arg("name"),
+         py::arg("write_behind") = false)
     .def("get_file_info", &get_file_info)
+    .def("get_file_info_many", &get_file_info_many)
+    .def("list_dir", &list_dir, py::arg("name"), py::arg("recursive") = false)
     .def("read", &read_all_file)
     .def("write", &write_all_file)
     .def("make_dir", &make_dir)
     .def("delete_file", &delete_file)
-    .def("delete_dir", &delete_dir);
+    .def("delete_dir", &delete_dir)
+    .def("metrics", &metrics)
+    .def("metrics_text", &metrics_text, py::arg("prefix") = "storehouse");
 
-  py::class_<RandomReadFile>(m, "RandomReadFile")
+  py::class_<RandomReadFile,
+             std::unique_ptr<RandomReadFile, GILReleaseDelete>>(
+    m, "RandomReadFile")
     .def("read", &wrapper_r_read)
     .def("read_offset", &wrapper_r_read_offset)
     .def("get_size", &r_get_size);
 
-  py::class_<WriteFile>(m, "WriteFile")
+  py::class_<WriteFile, std::unique_ptr<WriteFile, GILReleaseDelete>>(
+    m, "WriteFile")
     .def("append", &w_append)
     .def("save", &w_save);
 }
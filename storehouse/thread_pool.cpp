@@ -0,0 +1,119 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+namespace storehouse {
+
+namespace {
+const size_t DEFAULT_IO_EXECUTOR_THREADS = 32;
+std::atomic<size_t> io_executor_threads(DEFAULT_IO_EXECUTOR_THREADS);
+}
+
+ThreadPool::ThreadPool(size_t num_threads) : stopping_(false) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(&ThreadPool::worker, this);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void ThreadPool::enqueue(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+  }
+  cv_.notify_one();
+}
+
+void ThreadPool::parallel_for(size_t count, size_t max_workers,
+                              const std::function<void(size_t)>& body) {
+  struct State {
+    std::atomic<size_t> next;
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t finished;
+  };
+  std::shared_ptr<State> state(new State);
+  state->next = 0;
+  state->finished = 0;
+
+  // Helpers that start after every index is taken return without touching
+  // body, so they may safely outlive this call
+  auto work = [state, count, &body] {
+    size_t finished = 0;
+    for (size_t i = state->next++; i < count; i = state->next++) {
+      body(i);
+      finished++;
+    }
+    if (finished > 0) {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->finished += finished;
+      if (state->finished == count) {
+        state->cv.notify_all();
+      }
+    }
+  };
+  size_t helpers = std::min(max_workers, count);
+  for (size_t i = 1; i < helpers; ++i) {
+    enqueue(work);
+  }
+  work();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->cv.wait(lock, [&] { return state->finished == count; });
+}
+
+void ThreadPool::worker() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if (tasks_.empty()) {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+
+ThreadPool* io_executor() {
+  static ThreadPool pool(io_executor_threads.load());
+  return &pool;
+}
+
+void set_io_executor_threads(size_t num_threads) {
+  io_executor_threads = num_threads;
+}
+}
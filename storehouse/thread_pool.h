@@ -0,0 +1,73 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace storehouse {
+
+////////////////////////////////////////////////////////////////////////////////
+/// ThreadPool
+class ThreadPool {
+ public:
+  ThreadPool(size_t num_threads);
+
+  /* Runs every task that was already enqueued before joining the workers. */
+  ~ThreadPool();
+
+  void enqueue(std::function<void()> task);
+
+  /* parallel_for
+   *
+   * Calls body once for each index below count, on the calling thread and
+   * up to max_workers - 1 threads of the pool, and returns once every call
+   * has finished. The calling thread keeps taking indices itself, so this
+   * is safe to use from a task already running on the pool.
+   */
+  void parallel_for(size_t count, size_t max_workers,
+                    const std::function<void(size_t)>& body);
+
+  size_t num_threads() const { return threads_.size(); }
+
+ private:
+  void worker();
+
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopping_;
+};
+
+/* io_executor
+ *
+ * Shared pool that runs asynchronous operations for backends without a
+ * native asynchronous path. Created on first use.
+ */
+ThreadPool* io_executor();
+
+/* set_io_executor_threads
+ *
+ * Sets the size of the shared pool. Only takes effect before the first call
+ * to io_executor.
+ */
+void set_io_executor_threads(size_t num_threads);
+}
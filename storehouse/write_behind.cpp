@@ -0,0 +1,136 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "storehouse/write_behind.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace storehouse {
+
+WriteBehindWriteFile::WriteBehindWriteFile(WriteFile* file,
+                                           WriteBehindOptions options)
+    : file_(file),
+      options_(options),
+      flushing_(false),
+      stopping_(false),
+      error_(StoreResult::Success) {
+  current_.reserve(options_.buffer_size);
+}
+
+WriteBehindWriteFile::~WriteBehindWriteFile() {
+  save();
+  if (flusher_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    flusher_.join();
+  }
+}
+
+StoreResult WriteBehindWriteFile::append(size_t size, const uint8_t* data) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (size > 0) {
+    if (error_ != StoreResult::Success) {
+      return error_;
+    }
+    size_t copied = std::min(size, options_.buffer_size - current_.size());
+    current_.insert(current_.end(), data, data + copied);
+    data += copied;
+    size -= copied;
+    if (current_.size() == options_.buffer_size) {
+      cv_.wait(lock, [this] {
+        return queued_.size() < options_.max_buffers ||
+               error_ != StoreResult::Success;
+      });
+      enqueue_current();
+    }
+  }
+  return error_;
+}
+
+StoreResult WriteBehindWriteFile::reserve(uint64_t size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // The wrapped file is only used by the flush task while it runs
+  wait_for_flush(lock);
+  if (error_ != StoreResult::Success) {
+    return error_;
+  }
+  return file_->reserve(size);
+}
+
+StoreResult WriteBehindWriteFile::save() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!current_.empty()) {
+    enqueue_current();
+  }
+  wait_for_flush(lock);
+  if (error_ != StoreResult::Success) {
+    return error_;
+  }
+  return file_->save();
+}
+
+const std::string WriteBehindWriteFile::path() { return file_->path(); }
+
+void WriteBehindWriteFile::enqueue_current() {
+  queued_.push_back(std::move(current_));
+  if (!spare_.empty()) {
+    current_ = std::move(spare_.back());
+    spare_.pop_back();
+  } else {
+    current_ = std::vector<uint8_t>();
+    current_.reserve(options_.buffer_size);
+  }
+  flushing_ = true;
+  if (!flusher_.joinable()) {
+    flusher_ = std::thread(&WriteBehindWriteFile::flush_buffers, this);
+  }
+  cv_.notify_all();
+}
+
+void WriteBehindWriteFile::flush_buffers() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return !queued_.empty() || stopping_; });
+    if (queued_.empty()) {
+      return;
+    }
+    std::vector<uint8_t>& buffer = queued_.front();
+    StoreResult result = StoreResult::Success;
+    if (error_ == StoreResult::Success) {
+      lock.unlock();
+      result = file_->append(buffer.size(), buffer.data());
+      lock.lock();
+    }
+    if (error_ == StoreResult::Success && result != StoreResult::Success) {
+      error_ = result;
+    }
+    buffer.clear();
+    spare_.push_back(std::move(buffer));
+    queued_.pop_front();
+    if (queued_.empty()) {
+      flushing_ = false;
+    }
+    cv_.notify_all();
+  }
+}
+
+void WriteBehindWriteFile::wait_for_flush(std::unique_lock<std::mutex>& lock) {
+  cv_.wait(lock, [this] { return !flushing_; });
+}
+}
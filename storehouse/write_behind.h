@@ -0,0 +1,92 @@
+/* Copyright 2016 Carnegie Mellon University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "storehouse/storage_backend.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace storehouse {
+
+struct WriteBehindOptions {
+  // Appends are gathered into buffers of this size before being handed on
+  size_t buffer_size = 8 * 1024 * 1024;
+  // Filled buffers allowed to wait for the background flush before append
+  // blocks
+  size_t max_buffers = 4;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+/// WriteBehindWriteFile
+/* Wraps a WriteFile so append only copies into memory. Filled buffers are
+ * passed to the wrapped file's append by a flusher thread of its own,
+ * started when the first buffer fills, one at a time and in order. The
+ * flusher does not share the io_executor, so a slow backend cannot starve
+ * other work queued there or be starved by it. When max_buffers are waiting,
+ * append blocks until the flush catches up. The first error from the wrapped
+ * file is returned by the next append or save, and by every call after it.
+ */
+class WriteBehindWriteFile : public WriteFile {
+ public:
+  /* Takes ownership of file. */
+  WriteBehindWriteFile(WriteFile* file,
+                       WriteBehindOptions options = WriteBehindOptions());
+
+  /* Saves, which waits for the background flush to finish, and stops the
+   * flusher thread. */
+  ~WriteBehindWriteFile();
+
+  StoreResult append(size_t size, const uint8_t* data) override;
+
+  StoreResult reserve(uint64_t size) override;
+
+  StoreResult save() override;
+
+  const std::string path() override;
+
+ private:
+  /* Queues the current buffer and starts the flusher thread if it is not
+   * running yet; called with mutex_ held. */
+  void enqueue_current();
+
+  /* Body of the flusher thread, which writes queued buffers until stopping_
+   * is set. */
+  void flush_buffers();
+
+  /* Waits until every queued buffer has been written; called with mutex_
+   * held. */
+  void wait_for_flush(std::unique_lock<std::mutex>& lock);
+
+  std::unique_ptr<WriteFile> file_;
+  const WriteBehindOptions options_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<uint8_t> current_;
+  std::deque<std::vector<uint8_t>> queued_;
+  std::vector<std::vector<uint8_t>> spare_;
+  // Set while any buffer is queued or being written
+  bool flushing_;
+  bool stopping_;
+  StoreResult error_;
+  std::thread flusher_;
+};
+}